@@ -0,0 +1,55 @@
+// throughput of the key hash: str_hash (wyhash) against the FNV loop it
+// replaced, over a range of key lengths.
+//
+//   ./hash-bench [total_mb]      (default: 256MB hashed per length)
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "../server/common.h"
+
+
+static double now_sec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec / 1e9;
+}
+
+// the previous str_hash
+static uint64_t fnv_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static void bench(const char *name, uint64_t (*hash)(const uint8_t *, size_t),
+                  const std::vector<uint8_t> &data, size_t len, size_t total) {
+    // hash overlapping keys at different offsets, like the keys of a buffer
+    size_t n = total / len;
+    size_t span = data.size() - len;
+    uint64_t sum = 0;
+    double t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        sum += hash(&data[(i * 64) % span], len);
+    }
+    double secs = now_sec() - t;
+    printf("%-8s len=%-6zu %8.2f GB/s %8.2f ns/hash  (%llx)\n", name, len,
+        (double)n * len / secs / 1e9, secs * 1e9 / n, (unsigned long long)(sum & 0xff));
+}
+
+int main(int argc, char **argv) {
+    size_t total = (argc > 1 ? strtoull(argv[1], NULL, 10) : 256) << 20;
+    std::vector<uint8_t> data(1 << 20);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (uint8_t)rand();
+    }
+    const size_t lens[] = {4, 8, 16, 32, 64, 256, 1024, 4096};
+    for (size_t len : lens) {
+        bench("fnv", &fnv_hash, data, len, total);
+        bench("str_hash", &str_hash, data, len, total);
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+// a microbenchmark of the hashtable engines: the chained HMap, the same
+// with an inlined comparator (HMapT), and the open-addressing SwissMap.
+// the keys are 64-bit integers in intrusive nodes, so it measures the
+// tables rather than the key comparisons.
+//
+//   ./hmap-bench [nkeys ...]     (default: 1000000 10000000)
+//   ./hmap-bench 100000000       (needs ~8GB of memory)
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "../server/common.h"
+#include "../server/hashtable.h"
+#include "../server/swisstable.h"
+
+
+struct Node {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static double now_sec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec / 1e9;
+}
+
+static bool node_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Node, node)->key == container_of(rhs, Node, node)->key;
+}
+
+struct NodeEq {
+    bool operator()(HNode *lhs, HNode *rhs) const {
+        return container_of(lhs, Node, node)->key == container_of(rhs, Node, node)->key;
+    }
+};
+typedef HMapT<NodeEq> NodeMap;
+
+static uint64_t key_hash(uint64_t key) {
+    return str_hash((const uint8_t *)&key, sizeof(key));
+}
+
+// visit the keys in a scattered order: i * p mod n, p is a prime
+static uint64_t scatter(uint64_t i, uint64_t n) {
+    return (i * 2654435761ull) % n;
+}
+
+// the engine's interface
+struct Engine {
+    const char *name;
+    void *(*create)();
+    void (*insert)(void *map, HNode *node);
+    HNode *(*lookup)(void *map, HNode *key);
+    HNode *(*remove)(void *map, HNode *key);
+    size_t (*size)(void *map);
+    void (*destroy)(void *map);
+};
+
+static const Engine k_engines[] = {
+    {
+        "HMap",
+        []() -> void * { return new HMap(); },
+        [](void *m, HNode *node) { hm_insert((HMap *)m, node); },
+        [](void *m, HNode *key) { return hm_lookup((HMap *)m, key, &node_eq); },
+        [](void *m, HNode *key) { return hm_delete((HMap *)m, key, &node_eq); },
+        [](void *m) { return hm_size((HMap *)m); },
+        [](void *m) { hm_clear((HMap *)m); delete (HMap *)m; },
+    },
+    {
+        "HMapT",
+        []() -> void * { return new NodeMap(); },
+        [](void *m, HNode *node) { hm_insert((NodeMap *)m, node); },
+        [](void *m, HNode *key) { return hm_lookup((NodeMap *)m, key); },
+        [](void *m, HNode *key) { return hm_delete((NodeMap *)m, key); },
+        [](void *m) { return hm_size((NodeMap *)m); },
+        [](void *m) { hm_clear((NodeMap *)m); delete (NodeMap *)m; },
+    },
+    {
+        "SwissMap",
+        []() -> void * { return new SwissMap(); },
+        [](void *m, HNode *node) { sm_insert((SwissMap *)m, node); },
+        [](void *m, HNode *key) { return sm_lookup((SwissMap *)m, key, &node_eq); },
+        [](void *m, HNode *key) { return sm_delete((SwissMap *)m, key, &node_eq); },
+        [](void *m) { return sm_size((SwissMap *)m); },
+        [](void *m) { sm_clear((SwissMap *)m); delete (SwissMap *)m; },
+    },
+};
+
+static void report(const Engine &e, size_t n, const char *op, double secs) {
+    printf("%-9s n=%-10zu %-7s %7.1f ns/op\n", e.name, n, op, secs * 1e9 / n);
+}
+
+// the tail latency of inserts shows the cost of the resizes
+static void report_tail(const Engine &e, size_t n, std::vector<float> &lat) {
+    std::sort(lat.begin(), lat.end());
+    printf("%-9s n=%-10zu insert  p99 %.0f ns, p99.9 %.0f ns, max %.0f ns\n", e.name, n,
+        lat[lat.size() * 99 / 100], lat[lat.size() * 999 / 1000], lat.back());
+}
+
+static void bench(const Engine &e, Node *nodes, size_t n) {
+    void *map = e.create();
+    double t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        e.insert(map, &nodes[i].node);
+    }
+    report(e, n, "insert", now_sec() - t);
+    assert(e.size(map) == n);
+    e.destroy(map);
+
+    // again, timing each insert
+    std::vector<float> lat(n);
+    map = e.create();
+    for (size_t i = 0; i < n; i++) {
+        t = now_sec();
+        e.insert(map, &nodes[i].node);
+        lat[i] = (float)((now_sec() - t) * 1e9);
+    }
+    report_tail(e, n, lat);
+
+    Node key;
+    size_t found = 0;
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        key.key = scatter(i, n);
+        key.node.hcode = key_hash(key.key);
+        found += e.lookup(map, &key.node) != NULL;
+    }
+    report(e, n, "hit", now_sec() - t);
+    assert(found == n);
+
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        key.key = n + scatter(i, n);
+        key.node.hcode = key_hash(key.key);
+        found -= e.lookup(map, &key.node) == NULL;
+    }
+    report(e, n, "miss", now_sec() - t);
+    assert(found == 0);
+
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        key.key = scatter(i, n);
+        key.node.hcode = key_hash(key.key);
+        HNode *node = e.remove(map, &key.node);
+        assert(node);
+        (void)node;
+    }
+    report(e, n, "delete", now_sec() - t);
+    assert(e.size(map) == 0);
+    e.destroy(map);
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[16] = {1000000, 10000000};
+    size_t nsizes = 2;
+    if (argc > 1) {
+        nsizes = 0;
+        for (int i = 1; i < argc && nsizes < 16; i++) {
+            sizes[nsizes++] = strtoull(argv[i], NULL, 10);
+        }
+    }
+    for (size_t s = 0; s < nsizes; s++) {
+        size_t n = sizes[s];
+        Node *nodes = new Node[n];
+        for (size_t i = 0; i < n; i++) {
+            nodes[i].key = i;
+            nodes[i].node.hcode = key_hash(i);
+        }
+        for (const Engine &e : k_engines) {
+            bench(e, nodes, n);
+        }
+        delete[] nodes;
+    }
+    return 0;
+}
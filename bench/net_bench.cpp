@@ -0,0 +1,214 @@
+// a load generator for the server.
+// each connection keeps `pipeline` requests in flight; with `--pid`, it also
+// reports the server's read/write syscalls per request from /proc/PID/io,
+// and the growth of its resident memory per key of the keyspace.
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+
+static void die(const char *msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    abort();
+}
+
+static double now_sec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec / 1e9;
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0) {
+            die("write()");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+static void read_full(int fd, uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            die("read()");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+static void append_req(std::vector<uint8_t> &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    out.insert(out.end(), (uint8_t *)&len, (uint8_t *)&len + 4);
+    uint32_t n = (uint32_t)cmd.size();
+    out.insert(out.end(), (uint8_t *)&n, (uint8_t *)&n + 4);
+    for (const std::string &s : cmd) {
+        uint32_t p = (uint32_t)s.size();
+        out.insert(out.end(), (uint8_t *)&p, (uint8_t *)&p + 4);
+        out.insert(out.end(), s.begin(), s.end());
+    }
+}
+
+// read 1 response and discard it
+static void skip_resp(int fd) {
+    uint32_t len = 0;
+    read_full(fd, (uint8_t *)&len, 4);
+    std::vector<uint8_t> body(len);
+    read_full(fd, body.data(), len);
+}
+
+// read/write syscalls done by the process so far
+static bool proc_syscalls(int pid, uint64_t &nr, uint64_t &nw) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long v = 0;
+        if (sscanf(line, "syscr: %llu", &v) == 1) {
+            nr = v;
+        } else if (sscanf(line, "syscw: %llu", &v) == 1) {
+            nw = v;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// resident memory of the process in bytes, 0 on error
+static uint64_t proc_rss(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), fp) && sscanf(line, "VmRSS: %llu kB", &kb) != 1) {}
+    fclose(fp);
+    return kb << 10;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: redis-bench [-c conns] [-n requests] [-P pipeline] "
+        "[-d value_size] [-r keyspace] [-t get|set] [--pid server_pid]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t nconn = 50, nreq = 100000, pipeline = 1, vsize = 16, keyspace = 10000;
+    std::string type = "set";
+    int pid = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        const char *arg = argv[i++];
+        if (strcmp(arg, "-c") == 0) {
+            nconn = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(arg, "-n") == 0) {
+            nreq = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(arg, "-P") == 0) {
+            pipeline = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(arg, "-d") == 0) {
+            vsize = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(arg, "-r") == 0) {
+            keyspace = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(arg, "-t") == 0) {
+            type = argv[i];
+        } else if (strcmp(arg, "--pid") == 0) {
+            pid = atoi(argv[i]);
+        } else {
+            usage();
+        }
+    }
+    if (!nconn || !pipeline || !keyspace) {
+        usage();
+    }
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < nconn; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = ntohs(1234);
+        addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+        if (fd < 0 || connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+            die("connect()");
+        }
+        fds.push_back(fd);
+    }
+
+    std::string value(vsize, 'x');
+    uint64_t r0 = 0, w0 = 0, r1 = 0, w1 = 0;
+    bool has_io = pid && proc_syscalls(pid, r0, w0);
+    uint64_t rss0 = pid ? proc_rss(pid) : 0;
+    double t0 = now_sec();
+
+    // each round sends a batch on every connection, then reads them back
+    size_t done = 0, seq = 0;
+    std::vector<uint8_t> out;
+    std::vector<size_t> sent(nconn);
+    while (done < nreq) {
+        for (size_t i = 0; i < nconn; ++i) {
+            out.clear();
+            sent[i] = 0;
+            while (sent[i] < pipeline && done + sent[i] < nreq) {
+                std::string key = "key:" + std::to_string(seq++ % keyspace);
+                if (type == "get") {
+                    append_req(out, {"get", key});
+                } else {
+                    append_req(out, {"set", key, value});
+                }
+                sent[i]++;
+            }
+            done += sent[i];
+            write_all(fds[i], out.data(), out.size());
+        }
+        for (size_t i = 0; i < nconn; ++i) {
+            for (size_t j = 0; j < sent[i]; ++j) {
+                skip_resp(fds[i]);
+            }
+        }
+    }
+
+    double secs = now_sec() - t0;
+    printf("%s: %zu requests, %zu conns, pipeline %zu: %.3f s, %.0f req/s\n",
+        type.c_str(), nreq, nconn, pipeline, secs, nreq / secs);
+    if (has_io && proc_syscalls(pid, r1, w1)) {
+        printf("server read syscalls/req: %.3f, write syscalls/req: %.3f\n",
+            (double)(r1 - r0) / nreq, (double)(w1 - w0) / nreq);
+    }
+    // meaningful when the keys are new, e.g. -t set -n N -r N on an empty server
+    uint64_t rss1 = pid ? proc_rss(pid) : 0;
+    if (rss0 && rss1 && type == "set") {
+        printf("server memory: %.1f MB grown, %.1f bytes/key\n",
+            (double)(rss1 - rss0) / (1 << 20), (double)(rss1 - rss0) / std::min(nreq, keyspace));
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+// LD_PRELOAD shim that counts the I/O syscalls of the server, for comparing
+// the I/O backends. The counts are printed to stderr on exit (or SIGTERM).
+//   LD_PRELOAD=./libsyscount.so ./redis-server [--io-uring]
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+
+enum { C_READ, C_WRITE, C_WRITEV, C_EPOLL_WAIT, C_EPOLL_CTL, C_URING_ENTER, C_FSYNC, C_MAX };
+static const char *k_names[C_MAX] = {
+    "read", "write", "writev", "epoll_wait", "epoll_ctl", "io_uring_enter", "fsync",
+};
+static unsigned long g_counts[C_MAX];
+
+template <class F>
+static F real(const char *name) {
+    return (F)dlsym(RTLD_NEXT, name);
+}
+
+static void report() {
+    unsigned long total = 0;
+    for (int i = 0; i < C_MAX; ++i) {
+        fprintf(stderr, "syscount %-16s %lu\n", k_names[i], g_counts[i]);
+        total += g_counts[i];
+    }
+    fprintf(stderr, "syscount %-16s %lu\n", "total", total);
+}
+
+static void on_term(int) {
+    exit(0);    // run the atexit() handler
+}
+
+__attribute__((constructor)) static void init() {
+    atexit(&report);
+    signal(SIGTERM, &on_term);
+    signal(SIGINT, &on_term);
+}
+
+extern "C" {
+
+ssize_t read(int fd, void *buf, size_t n) {
+    __atomic_add_fetch(&g_counts[C_READ], 1, __ATOMIC_RELAXED);
+    static auto f = real<ssize_t (*)(int, void *, size_t)>("read");
+    return f(fd, buf, n);
+}
+
+ssize_t write(int fd, const void *buf, size_t n) {
+    __atomic_add_fetch(&g_counts[C_WRITE], 1, __ATOMIC_RELAXED);
+    static auto f = real<ssize_t (*)(int, const void *, size_t)>("write");
+    return f(fd, buf, n);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int n) {
+    __atomic_add_fetch(&g_counts[C_WRITEV], 1, __ATOMIC_RELAXED);
+    static auto f = real<ssize_t (*)(int, const struct iovec *, int)>("writev");
+    return f(fd, iov, n);
+}
+
+int epoll_wait(int epfd, struct epoll_event *ev, int n, int timeout) {
+    __atomic_add_fetch(&g_counts[C_EPOLL_WAIT], 1, __ATOMIC_RELAXED);
+    static auto f = real<int (*)(int, struct epoll_event *, int, int)>("epoll_wait");
+    return f(epfd, ev, n, timeout);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev) {
+    __atomic_add_fetch(&g_counts[C_EPOLL_CTL], 1, __ATOMIC_RELAXED);
+    static auto f = real<int (*)(int, int, int, struct epoll_event *)>("epoll_ctl");
+    return f(epfd, op, fd, ev);
+}
+
+int fsync(int fd) {
+    __atomic_add_fetch(&g_counts[C_FSYNC], 1, __ATOMIC_RELAXED);
+    static auto f = real<int (*)(int)>("fsync");
+    return f(fd);
+}
+
+long syscall(long nr, ...) {
+    va_list ap;
+    va_start(ap, nr);
+    long a[6];
+    for (int i = 0; i < 6; ++i) {
+        a[i] = va_arg(ap, long);
+    }
+    va_end(ap);
+    if (nr == __NR_io_uring_enter) {
+        __atomic_add_fetch(&g_counts[C_URING_ENTER], 1, __ATOMIC_RELAXED);
+    }
+    static auto f = real<long (*)(long, ...)>("syscall");
+    return f(nr, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+}   // extern "C"
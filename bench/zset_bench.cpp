@@ -0,0 +1,136 @@
+// a microbenchmark of the zset order indexes: the AVL tree and the B+tree.
+// the members are 12-byte names with random scores in the tree encoding,
+// so it measures the index, the hashtable lookups are the same for both.
+//
+//   ./zset-bench [nmembers ...]  (default: 100000 1000000 10000000)
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "../server/common.h"
+#include "../server/zset.h"
+
+
+static double now_sec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec / 1e9;
+}
+
+// visit the members in a scattered order: i * p mod n, p is a prime
+static uint64_t scatter(uint64_t i, uint64_t n) {
+    return (i * 2654435761ull) % n;
+}
+
+struct Member {
+    char name[12];
+    double score;
+};
+
+static const char *const k_index_names[] = {"avl", "btree"};
+
+static void report(uint8_t index, size_t n, const char *op, size_t nops, double secs) {
+    printf("%-6s n=%-10zu %-8s %7.1f ns/op\n", k_index_names[index], n, op, secs * 1e9 / nops);
+}
+
+static void bench(uint8_t index, const std::vector<Member> &members) {
+    size_t n = members.size();
+    zset_set_index(index);
+    int64_t mem = g_used_memory.load();
+    ZSet zset;
+    double t = now_sec();
+    for (const Member &m : members) {
+        zset_insert(&zset, m.name, sizeof(m.name), m.score);
+    }
+    report(index, n, "insert", n, now_sec() - t);
+    assert(zset_size(&zset) == n);
+    printf("%-6s n=%-10zu memory   %7.1f B/member\n", k_index_names[index], n,
+        (double)(g_used_memory.load() - mem) / n);
+
+    // a point query: the first member >= the key
+    ZIter it;
+    size_t found = 0;
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        const Member &m = members[scatter(i, n)];
+        zset_seekge(&zset, m.score, m.name, sizeof(m.name), &it);
+        found += it.valid;
+    }
+    report(index, n, "seekge", n, now_sec() - t);
+    assert(found == n);
+
+    // a range: seek, then the next 1000 members
+    const size_t k_range = 1000;
+    size_t nseeks = n / k_range > 1000 ? 1000 : n / k_range + 1;
+    double sum = 0;
+    t = now_sec();
+    for (size_t i = 0; i < nseeks; i++) {
+        const Member &m = members[scatter(i, n)];
+        zset_seekge(&zset, m.score, m.name, sizeof(m.name), &it);
+        for (size_t j = 0; j < k_range && it.valid; j++) {
+            sum += ziter_get(&it).score;
+            ziter_offset(&it, 1);
+        }
+    }
+    report(index, n, "range", nseeks * k_range, now_sec() - t);
+
+    // a rank query: far from the start, by the subtree counts
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        zset_seekge(&zset, -1, "", 0, &it);
+        ziter_offset(&it, (int64_t)scatter(i, n));
+        found -= it.valid;
+    }
+    report(index, n, "offset", n, now_sec() - t);
+    assert(found == 0);
+
+    // the score changes, the node moves
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        const Member &m = members[scatter(i, n)];
+        zset_insert(&zset, m.name, sizeof(m.name), m.score + 0.5);
+    }
+    report(index, n, "update", n, now_sec() - t);
+
+    t = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        const Member &m = members[scatter(i, n)];
+        bool ok = zset_remove(&zset, m.name, sizeof(m.name));
+        assert(ok);
+        (void)ok;
+    }
+    report(index, n, "delete", n, now_sec() - t);
+    assert(zset_size(&zset) == 0);
+    zset_clear(&zset);
+    if (sum < 0) {  // keep the loads
+        printf("%f\n", sum);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[16] = {100000, 1000000, 10000000};
+    size_t nsizes = 3;
+    if (argc > 1) {
+        nsizes = 0;
+        for (int i = 1; i < argc && nsizes < 16; i++) {
+            sizes[nsizes++] = strtoull(argv[i], NULL, 10);
+        }
+    }
+    zset_set_list_limits(0, 0);     // always the tree
+    for (size_t s = 0; s < nsizes; s++) {
+        size_t n = sizes[s];
+        std::vector<Member> members(n);
+        srand(1);
+        for (size_t i = 0; i < n; i++) {
+            // "m" + 10 digits + NUL fill the name exactly
+            snprintf(members[i].name, sizeof(members[i].name), "m%010u", (uint32_t)i);
+            members[i].score = (double)(rand() % 1000000);
+        }
+        for (uint8_t index : {ZINDEX_AVL, ZINDEX_BTREE}) {
+            bench(index, members);
+        }
+    }
+    return 0;
+}
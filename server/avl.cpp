@@ -175,3 +175,15 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset) {
     }
     return node;
 }
+
+// the number of nodes before this one, by the subtree sizes on the path
+// to the root. O(log N).
+int64_t avl_rank(AVLNode *node) {
+    int64_t rank = avl_cnt(node->left);
+    for (AVLNode *parent = node->parent; parent; node = parent, parent = node->parent) {
+        if (parent->right == node) {
+            rank += avl_cnt(parent->left) + 1;
+        }
+    }
+    return rank;
+}
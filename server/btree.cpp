@@ -0,0 +1,478 @@
+#include <assert.h>
+#include <string.h>
+#include <new>
+#include <vector>
+// proj
+#include "btree.h"
+#include "zset.h"       // ZNode
+#include "common.h"     // mem_track()
+#include "slab.h"
+
+
+const uint32_t k_bt_max = 30;               // items of a leaf, children of an inner node
+const uint32_t k_bt_min = k_bt_max / 2;     // except the root
+const uint32_t k_bt_max_height = 16;
+
+// the key of each slot: an item of a leaf, the first item of a child
+struct BNode {
+    uint32_t n = 0;
+    bool leaf = true;
+    double scores[k_bt_max];    // the same as keys[i]->score
+    ZNode *keys[k_bt_max];
+};
+
+struct BLeaf : BNode {
+    BLeaf *prev = NULL;
+    BLeaf *next = NULL;
+};
+
+struct BInner : BNode {
+    BNode *kids[k_bt_max];
+    uint64_t counts[k_bt_max];  // items under each child
+};
+
+// the leaves are most of the nodes
+static_assert(sizeof(BLeaf) <= k_slab_max, "a leaf fits a slab class");
+
+struct BKey {
+    double score;
+    const char *name;
+    size_t len;
+};
+
+static BLeaf *leaf_new() {
+    mem_track(sizeof(BLeaf));
+    return new (slab_alloc(sizeof(BLeaf))) BLeaf();
+}
+
+static BInner *inner_new() {
+    mem_track(sizeof(BInner));
+    BInner *node = new (slab_alloc(sizeof(BInner))) BInner();
+    node->leaf = false;
+    return node;
+}
+
+static void bnode_del(BNode *node) {
+    size_t size = node->leaf ? sizeof(BLeaf) : sizeof(BInner);
+    mem_track(-(int64_t)size);
+    slab_free(node, size);  // maybe from the thread pool
+}
+
+// compare the slot `i` with the key: < 0, 0, > 0
+static int slot_cmp(BNode *node, uint32_t i, const BKey &key) {
+    if (node->scores[i] != key.score) {
+        return node->scores[i] < key.score ? -1 : 1;
+    }
+    ZNode *z = node->keys[i];
+    int rv = memcmp(z->name, key.name, z->len < key.len ? z->len : key.len);
+    if (rv != 0) {
+        return rv;
+    }
+    return z->len < key.len ? -1 : (z->len > key.len ? 1 : 0);
+}
+
+// the first slot >= the key
+static uint32_t lower_bound(BNode *node, const BKey &key) {
+    uint32_t lo = 0, hi = node->n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (slot_cmp(node, mid, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child whose range holds the key: the last one starting <= the key
+static uint32_t child_for(BInner *node, const BKey &key) {
+    uint32_t i = lower_bound(node, key);
+    if (i < node->n && slot_cmp(node, i, key) == 0) {
+        return i;
+    }
+    return i > 0 ? i - 1 : 0;
+}
+
+static uint64_t bnode_count(BNode *node) {
+    if (node->leaf) {
+        return node->n;
+    }
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < node->n; i++) {
+        total += ((BInner *)node)->counts[i];
+    }
+    return total;
+}
+
+// move the slots [from, from + n) of `src` to `dst` at `to`
+static void slots_move(BNode *dst, uint32_t to, BNode *src, uint32_t from, uint32_t n) {
+    memmove(&dst->scores[to], &src->scores[from], n * sizeof(double));
+    memmove(&dst->keys[to], &src->keys[from], n * sizeof(ZNode *));
+    if (!src->leaf) {
+        BInner *d = (BInner *)dst, *s = (BInner *)src;
+        memmove(&d->kids[to], &s->kids[from], n * sizeof(BNode *));
+        memmove(&d->counts[to], &s->counts[from], n * sizeof(uint64_t));
+    }
+}
+
+// open a gap at slot `i`
+static void slots_shift_right(BNode *node, uint32_t i) {
+    slots_move(node, i + 1, node, i, node->n - i);
+    node->n++;
+}
+
+static void slots_remove(BNode *node, uint32_t i) {
+    slots_move(node, i, node, i + 1, node->n - i - 1);
+    node->n--;
+}
+
+// the key of the child `i` is its first item
+static void refresh_key(BInner *parent, uint32_t i) {
+    BNode *child = parent->kids[i];
+    parent->keys[i] = child->keys[0];
+    parent->scores[i] = child->scores[0];
+}
+
+static void leaf_link_after(BLeaf *left, BLeaf *right) {
+    right->prev = left;
+    right->next = left->next;
+    if (right->next) {
+        right->next->prev = right;
+    }
+    left->next = right;
+}
+
+static void leaf_unlink(BLeaf *leaf) {
+    if (leaf->prev) {
+        leaf->prev->next = leaf->next;
+    }
+    if (leaf->next) {
+        leaf->next->prev = leaf->prev;
+    }
+}
+
+// split the full child `i` in halves, the parent has room
+static void split_child(BInner *parent, uint32_t i) {
+    BNode *child = parent->kids[i];
+    BNode *right = NULL;
+    if (child->leaf) {
+        BLeaf *leaf = leaf_new();
+        leaf_link_after((BLeaf *)child, leaf);
+        right = leaf;
+    } else {
+        right = inner_new();
+    }
+    uint32_t half = child->n / 2;
+    slots_move(right, 0, child, half, child->n - half);
+    right->n = child->n - half;
+    child->n = half;
+
+    slots_shift_right(parent, i + 1);
+    parent->kids[i + 1] = right;
+    refresh_key(parent, i + 1);
+    parent->counts[i + 1] = bnode_count(right);
+    parent->counts[i] -= parent->counts[i + 1];
+}
+
+void bt_insert(BTree *tree, ZNode *node) {
+    if (!tree->root) {
+        tree->root = leaf_new();
+    }
+    if (tree->root->n == k_bt_max) {
+        // grow a level at the top
+        BInner *root = inner_new();
+        root->n = 1;
+        root->kids[0] = tree->root;
+        refresh_key(root, 0);
+        root->counts[0] = bnode_count(tree->root);
+        tree->root = root;
+        split_child(root, 0);
+    }
+    // split full nodes on the way down, so a parent always has room
+    BKey key = {node->score, node->name, node->len};
+    BNode *cur = tree->root;
+    while (!cur->leaf) {
+        BInner *inner = (BInner *)cur;
+        uint32_t i = child_for(inner, key);
+        if (inner->kids[i]->n == k_bt_max) {
+            split_child(inner, i);
+            if (slot_cmp(inner, i + 1, key) <= 0) {
+                i++;
+            }
+        }
+        if (i == 0 && slot_cmp(inner, 0, key) > 0) {
+            inner->keys[0] = node;  // the new first item
+            inner->scores[0] = node->score;
+        }
+        inner->counts[i]++;
+        cur = inner->kids[i];
+    }
+    uint32_t pos = lower_bound(cur, key);
+    slots_shift_right(cur, pos);
+    cur->keys[pos] = node;
+    cur->scores[pos] = node->score;
+}
+
+// move the last slot of the left sibling to the front of the child `i`
+static void borrow_left(BInner *parent, uint32_t i) {
+    BNode *left = parent->kids[i - 1], *child = parent->kids[i];
+    slots_shift_right(child, 0);
+    slots_move(child, 0, left, left->n - 1, 1);
+    left->n--;
+    uint64_t moved = child->leaf ? 1 : ((BInner *)child)->counts[0];
+    parent->counts[i - 1] -= moved;
+    parent->counts[i] += moved;
+    refresh_key(parent, i);
+}
+
+// move the first slot of the right sibling to the end of the child `i`
+static void borrow_right(BInner *parent, uint32_t i) {
+    BNode *child = parent->kids[i], *right = parent->kids[i + 1];
+    slots_move(child, child->n, right, 0, 1);
+    child->n++;
+    uint64_t moved = child->leaf ? 1 : ((BInner *)child)->counts[child->n - 1];
+    slots_remove(right, 0);
+    parent->counts[i] += moved;
+    parent->counts[i + 1] -= moved;
+    refresh_key(parent, i + 1);
+}
+
+// append the child `i + 1` to the child `i`
+static void merge_right(BInner *parent, uint32_t i) {
+    BNode *child = parent->kids[i], *right = parent->kids[i + 1];
+    assert(child->n + right->n <= k_bt_max);
+    slots_move(child, child->n, right, 0, right->n);
+    child->n += right->n;
+    if (right->leaf) {
+        leaf_unlink((BLeaf *)right);
+    }
+    parent->counts[i] += parent->counts[i + 1];
+    slots_remove(parent, i + 1);
+    bnode_del(right);
+}
+
+// make sure the child `i` can lose an item, returns its new index
+static uint32_t fix_child(BInner *parent, uint32_t i) {
+    if (parent->kids[i]->n > k_bt_min) {
+        return i;
+    }
+    if (i > 0 && parent->kids[i - 1]->n > k_bt_min) {
+        borrow_left(parent, i);
+    } else if (i + 1 < parent->n && parent->kids[i + 1]->n > k_bt_min) {
+        borrow_right(parent, i);
+    } else if (i + 1 < parent->n) {
+        merge_right(parent, i);
+    } else if (i > 0) {
+        merge_right(parent, i - 1);
+        i--;
+    }
+    return i;
+}
+
+void bt_delete(BTree *tree, ZNode *node) {
+    BKey key = {node->score, node->name, node->len};
+    BInner *path[k_bt_max_height];
+    uint32_t idx[k_bt_max_height];
+    uint32_t depth = 0;
+    // refill small nodes on the way down, so a child can always lose 1
+    BNode *cur = tree->root;
+    while (!cur->leaf) {
+        BInner *inner = (BInner *)cur;
+        uint32_t i = fix_child(inner, child_for(inner, key));
+        inner->counts[i]--;
+        assert(depth < k_bt_max_height);
+        path[depth] = inner;
+        idx[depth++] = i;
+        cur = inner->kids[i];
+    }
+    uint32_t pos = lower_bound(cur, key);
+    assert(pos < cur->n && cur->keys[pos] == node);
+    slots_remove(cur, pos);
+    // the first item of a subtree may be gone
+    while (depth > 0 && cur->n > 0) {
+        depth--;
+        refresh_key(path[depth], idx[depth]);
+    }
+    // shrink at the top
+    BNode *root = tree->root;
+    while (!root->leaf && root->n == 1) {
+        tree->root = ((BInner *)root)->kids[0];
+        bnode_del(root);
+        root = tree->root;
+    }
+    if (root->leaf && root->n == 0) {
+        bnode_del(root);
+        tree->root = NULL;
+    }
+}
+
+void bt_seekge(BTree *tree, double score, const char *name, size_t len, BIter *it) {
+    *it = BIter{};
+    BNode *cur = tree->root;
+    if (!cur) {
+        return;
+    }
+    BKey key = {score, name, len};
+    while (!cur->leaf) {
+        BInner *inner = (BInner *)cur;
+        cur = inner->kids[child_for(inner, key)];
+    }
+    uint32_t pos = lower_bound(cur, key);
+    BLeaf *leaf = (BLeaf *)cur;
+    if (pos == leaf->n) {   // all of the leaf are < the key
+        leaf = leaf->next;
+        pos = 0;
+    }
+    it->leaf = leaf;
+    it->slot = pos;
+}
+
+ZNode *bt_get(const BIter *it) {
+    assert(it->leaf && it->slot < it->leaf->n);
+    return it->leaf->keys[it->slot];
+}
+
+uint64_t bt_rank(BTree *tree, const BIter *it) {
+    ZNode *node = bt_get(it);
+    BKey key = {node->score, node->name, node->len};
+    uint64_t rank = 0;
+    BNode *cur = tree->root;
+    while (!cur->leaf) {
+        BInner *inner = (BInner *)cur;
+        uint32_t i = child_for(inner, key);
+        for (uint32_t j = 0; j < i; j++) {
+            rank += inner->counts[j];
+        }
+        cur = inner->kids[i];
+    }
+    return rank + lower_bound(cur, key);
+}
+
+void bt_select(BTree *tree, uint64_t rank, BIter *it) {
+    *it = BIter{};
+    BNode *cur = tree->root;
+    if (!cur || rank >= bnode_count(cur)) {
+        return;
+    }
+    while (!cur->leaf) {
+        BInner *inner = (BInner *)cur;
+        uint32_t i = 0;
+        while (rank >= inner->counts[i]) {
+            rank -= inner->counts[i++];
+        }
+        cur = inner->kids[i];
+    }
+    it->leaf = cur;
+    it->slot = (uint32_t)rank;
+}
+
+void bt_offset(BTree *tree, BIter *it, int64_t offset) {
+    if (!it->leaf) {
+        return;
+    }
+    // a few leaves away: follow the links
+    const int64_t k_max_walk = 4 * k_bt_max;
+    if (offset > -k_max_walk && offset < k_max_walk) {
+        BLeaf *leaf = (BLeaf *)it->leaf;
+        int64_t slot = (int64_t)it->slot + offset;
+        while (leaf && slot >= (int64_t)leaf->n) {
+            slot -= leaf->n;
+            leaf = leaf->next;
+        }
+        while (leaf && slot < 0) {
+            leaf = leaf->prev;
+            slot += leaf ? leaf->n : 0;
+        }
+        it->leaf = leaf;
+        it->slot = leaf ? (uint32_t)slot : 0;
+        return;
+    }
+    int64_t rank = (int64_t)bt_rank(tree, it) + offset;
+    if (rank < 0) {
+        *it = BIter{};
+        return;
+    }
+    bt_select(tree, (uint64_t)rank, it);
+}
+
+uint64_t bt_size(BTree *tree) {
+    return tree->root ? bnode_count(tree->root) : 0;
+}
+
+// split `n` items into groups of k_bt_min .. k_bt_max as evenly as possible
+static uint32_t group_size(size_t n, size_t ngroups, size_t g) {
+    return (uint32_t)(n / ngroups + (g < n % ngroups ? 1 : 0));
+}
+
+void bt_build(BTree *tree, ZNode **nodes, size_t n) {
+    assert(!tree->root);
+    if (n == 0) {
+        return;
+    }
+    // the leaves, full, then each level above them
+    std::vector<BNode *> level;
+    size_t ngroups = (n + k_bt_max - 1) / k_bt_max;
+    BLeaf *prev = NULL;
+    for (size_t g = 0, i = 0; g < ngroups; g++) {
+        BLeaf *leaf = leaf_new();
+        leaf->n = group_size(n, ngroups, g);
+        for (uint32_t j = 0; j < leaf->n; j++, i++) {
+            leaf->keys[j] = nodes[i];
+            leaf->scores[j] = nodes[i]->score;
+        }
+        leaf->prev = prev;
+        if (prev) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level.push_back(leaf);
+    }
+    while (level.size() > 1) {
+        std::vector<BNode *> upper;
+        ngroups = (level.size() + k_bt_max - 1) / k_bt_max;
+        for (size_t g = 0, i = 0; g < ngroups; g++) {
+            BInner *inner = inner_new();
+            inner->n = group_size(level.size(), ngroups, g);
+            for (uint32_t j = 0; j < inner->n; j++, i++) {
+                inner->kids[j] = level[i];
+                refresh_key(inner, j);
+                inner->counts[j] = bnode_count(level[i]);
+            }
+            upper.push_back(inner);
+        }
+        level.swap(upper);
+    }
+    tree->root = level[0];
+}
+
+static void bnode_clear(BNode *node) {
+    if (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        for (uint32_t i = 0; i < inner->n; i++) {
+            bnode_clear(inner->kids[i]);
+        }
+    }
+    bnode_del(node);
+}
+
+void bt_clear(BTree *tree) {
+    if (tree->root) {
+        bnode_clear(tree->root);
+    }
+    tree->root = NULL;
+}
+
+void bt_foreach(BTree *tree, bool (*f)(ZNode *, void *), void *arg) {
+    BNode *cur = tree->root;
+    while (cur && !cur->leaf) {
+        cur = ((BInner *)cur)->kids[0];
+    }
+    for (BLeaf *leaf = (BLeaf *)cur; leaf; leaf = leaf->next) {
+        for (uint32_t i = 0; i < leaf->n; i++) {
+            if (!f(leaf->keys[i], arg)) {
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct ZNode;
+struct BNode;
+
+// a B+tree of ZNodes ordered by (score, name). the nodes are wide and
+// keep the scores inline, so a search compares names only on ties and
+// touches a few cache lines per level instead of 1 node per level.
+// the inner nodes count the items of each child for the ranks, and the
+// leaves are linked, so a range is a sequential scan.
+struct BTree {
+    BNode *root = NULL;
+};
+
+// a position: a slot of a leaf, the leaf is NULL when out of range
+struct BIter {
+    BNode *leaf = NULL;
+    uint32_t slot = 0;
+};
+
+// the node must not be in the tree yet
+void     bt_insert(BTree *tree, ZNode *node);
+// the node must be in the tree
+void     bt_delete(BTree *tree, ZNode *node);
+// the first item that is >= (score, name)
+void     bt_seekge(BTree *tree, double score, const char *name, size_t len, BIter *it);
+ZNode   *bt_get(const BIter *it);
+// move by `offset` items; nearby by the leaf links, far by the ranks
+void     bt_offset(BTree *tree, BIter *it, int64_t offset);
+uint64_t bt_rank(BTree *tree, const BIter *it);
+void     bt_select(BTree *tree, uint64_t rank, BIter *it);
+uint64_t bt_size(BTree *tree);
+// build an empty tree from sorted, unique nodes in O(n)
+void     bt_build(BTree *tree, ZNode **nodes, size_t n);
+// free the tree nodes, not the ZNodes
+void     bt_clear(BTree *tree);
+// in order, until the callback returns false
+void     bt_foreach(BTree *tree, bool (*f)(ZNode *, void *), void *arg);
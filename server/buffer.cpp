@@ -1,16 +1,23 @@
 #include "buffer.h"
+#include "common.h"     // mem_track()
 #include <unistd.h>
 
 Buffer::Buffer(size_t capacity) {
     head = 0;
     tail = 0;
     _size = 0;
+    consumed = 0;
     this->capacity = capacity;
     data = new uint8_t[capacity];
+    mem_track((int64_t)capacity);
 }
 
 Buffer::~Buffer() {
+    for (Splice &s : splices) {
+        rcstr_unref(s.str);
+    }
     delete[] data;
+    mem_track(-(int64_t)capacity);
 }
 
 size_t Buffer::size() const {
@@ -37,6 +44,28 @@ void Buffer::append(const uint8_t *data, size_t len) {
     _size += len;
 }
 
+// 追加另一个缓冲区的全部数据（包括其引用的外部字符串）
+void Buffer::append_buffer(const Buffer &src) {
+    struct iovec iov[16];
+    size_t pos = 0;     // src 中已追加的字节数
+    size_t i = 0;       // 下一个外部字符串
+    while (pos < src._size || i < src.splices.size()) {
+        size_t upto = src._size;
+        if (i < src.splices.size()) {
+            upto = (size_t)(src.splices[i].pos - src.consumed);
+        }
+        int n = src.bytes_iovecs(pos, upto, iov, 16);
+        for (int k = 0; k < n; k++) {
+            append((const uint8_t *)iov[k].iov_base, iov[k].iov_len);
+        }
+        pos = upto;
+        if (i < src.splices.size()) {
+            const Splice &s = src.splices[i++];
+            push_splice(consumed + _size, s.off, rcstr_ref(s.str));
+        }
+    }
+}
+
 void Buffer::append_u8(uint8_t data) {
     append(&data, 1);
 }
@@ -56,6 +85,10 @@ void Buffer::append_dbl(double data) {
 void Buffer::consume(size_t len) {
     head = (head + len) % capacity;
     _size -= len;
+    consumed += len;
+    if (_size == 0) {
+        head = tail = 0;    // keep the free space contiguous
+    }
 }
 
 void Buffer::resize(size_t new_capacity) {
@@ -69,6 +102,7 @@ void Buffer::resize(size_t new_capacity) {
     }
     head = 0;
     tail = _size;
+    mem_track((int64_t)new_capacity - (int64_t)capacity);
     capacity = new_capacity;
     delete[] data;
     data = new_data;
@@ -120,6 +154,26 @@ void Buffer::copy_data(uint8_t *dst, size_t len) const {
     peek(dst, 0, len);
 }
 
+// 暴露尾部的空闲空间，供 read() 等直接写入，避免额外的拷贝。
+// 调用后至少有 len 字节空闲，但返回的连续区域可能因环绕而更短。
+void Buffer::reserve_tail(size_t len, uint8_t **data_ptr, size_t *size) {
+    if (len + _size > capacity) {
+        size_t new_capacity = (len + _size < 1024 * 1024) ?  (len + _size) * 2: len + _size + 1024 * 1024;
+        resize(new_capacity);
+    }
+    if (tail == capacity) {
+        tail = 0;
+    }
+    *data_ptr = data + tail;
+    *size = (tail >= head) ? capacity - tail : head - tail;
+}
+
+// 提交通过 reserve_tail() 写入的数据
+void Buffer::commit(size_t len) {
+    tail += len;
+    _size += len;
+}
+
 uint8_t& Buffer::operator[](size_t pos) {
     return data[(head + pos) % capacity];
 }
@@ -129,7 +183,106 @@ const uint8_t& Buffer::operator[](size_t pos) const {
 }
 
 bool Buffer::empty() const {
-    return _size == 0;
+    return _size == 0 && splices.empty();
+}
+
+// 截断到 len 字节，丢弃之后的外部字符串
+void Buffer::truncate(size_t len) {
+    if (len >= _size) {
+        return;
+    }
+    _size = len;
+    tail = (head + len) % capacity;
+    while (!splices.empty() && splices.back().pos > consumed + len) {
+        rcstr_unref(splices.back().str);
+        splices.pop_back();
+    }
+}
+
+void Buffer::push_splice(uint64_t pos, size_t off, RcStr *str) {
+    Splice s = {pos, off, str};
+    splices.push_back(s);
+}
+
+// 在当前末尾引用一个外部字符串，不拷贝数据
+void Buffer::append_ref(RcStr *str) {
+    push_splice(consumed + _size, 0, rcstr_ref(str));
+}
+
+// 字节位置 pos 之后的外部字符串的剩余长度
+size_t Buffer::ext_size(size_t pos) const {
+    size_t total = 0;
+    for (const Splice &s : splices) {
+        if (s.pos > consumed + pos) {
+            total += s.str->len - s.off;
+        }
+    }
+    return total;
+}
+
+// 字节区间 [from, to) 对应的连续内存段（环绕时为两段）
+int Buffer::bytes_iovecs(size_t from, size_t to, struct iovec *iov, int max) const {
+    int n = 0;
+    while (from < to && n < max) {
+        size_t real_pos = (head + from) % capacity;
+        size_t len = to - from;
+        if (real_pos + len > capacity) {
+            len = capacity - real_pos;
+        }
+        iov[n].iov_base = data + real_pos;
+        iov[n].iov_len = len;
+        n++;
+        from += len;
+    }
+    return n;
+}
+
+// 按顺序导出待发送的数据（字节段与外部字符串交错），供 writev() 使用
+int Buffer::get_iovecs(struct iovec *iov, int max) const {
+    int n = 0;
+    size_t pos = 0;
+    for (const Splice &s : splices) {
+        size_t upto = (size_t)(s.pos - consumed);
+        n += bytes_iovecs(pos, upto, iov + n, max - n);
+        pos = upto;
+        if (n == max) {
+            return n;
+        }
+        iov[n].iov_base = s.str->data() + s.off;
+        iov[n].iov_len = s.str->len - s.off;
+        n++;
+        if (n == max) {
+            return n;
+        }
+    }
+    n += bytes_iovecs(pos, _size, iov + n, max - n);
+    return n;
+}
+
+// 消费 len 字节的输出流，包括外部字符串
+void Buffer::advance(size_t len) {
+    while (len > 0) {
+        if (splices.empty()) {
+            consume(len);
+            return;
+        }
+        Splice &s = splices.front();
+        size_t upto = (size_t)(s.pos - consumed);
+        if (upto > 0) {
+            size_t k = len < upto ? len : upto;
+            consume(k);
+            len -= k;
+            continue;
+        }
+        size_t k = s.str->len - s.off;
+        k = len < k ? len : k;
+        s.off += k;
+        len -= k;
+        if (s.off == s.str->len) {
+            rcstr_unref(s.str);
+            splices.pop_front();
+        }
+    }
 }
 
 // 不移动数据，直接把data插入到head + pos位置，覆盖原有数据
@@ -4,13 +4,19 @@
 #include <cstring>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
+#include "rcstr.h"
 
 
 class Buffer {
     public:
         Buffer(size_t capacity=1024);
         ~Buffer();
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
         void append(const uint8_t *data, size_t len);
+        void append_buffer(const Buffer &src);
         void consume(size_t len);
         void append_u8(uint8_t data);
         void append_u32(uint32_t data);
@@ -23,17 +29,36 @@ class Buffer {
         uint32_t peek_u32(size_t pos) const;
         void get_continuous_data(size_t pos, uint8_t **data, size_t *size) const;
         void copy_data(uint8_t *dst, size_t len) const;
+        void reserve_tail(size_t len, uint8_t **data, size_t *size);
+        void commit(size_t len);
         void resize(size_t new_capacity);
+        void truncate(size_t len);
+        // 引用外部字符串（零拷贝），用于输出缓冲区
+        void append_ref(RcStr *str);
+        size_t ext_size(size_t pos) const;
+        int get_iovecs(struct iovec *iov, int max) const;
+        void advance(size_t len);
         uint8_t& operator[](size_t pos);
         const uint8_t& operator[](size_t pos) const;
 
         
     private:
+        // 插入在字节流 pos 处的外部字符串，off 为已发送的字节数
+        struct Splice {
+            uint64_t pos;
+            size_t off;
+            RcStr *str;
+        };
+        int bytes_iovecs(size_t from, size_t to, struct iovec *iov, int max) const;
+        void push_splice(uint64_t pos, size_t off, RcStr *str);
+
         size_t head;
         size_t tail;
         size_t capacity;
         size_t _size;
         uint8_t* data;
+        uint64_t consumed;              // 累计消费的字节数，即 head 的绝对位置
+        std::deque<Splice> splices;
         
 };
 
@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>     // memcpy()
+#include <atomic>
 
 
 // intrusive data structure
@@ -9,11 +11,93 @@
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type, member) );})
 
-// FNV hash
+// key equality for the hashtables, which have compared the hashes already.
+// the cheap checks go first: the length, then the first and last bytes,
+// since keys often share a prefix.
+inline bool key_eq(const char *a, size_t alen, const char *b, size_t blen) {
+    return alen == blen
+        && (alen == 0 || (a[0] == b[0] && a[alen - 1] == b[alen - 1]))
+        && memcmp(a, b, alen) == 0;
+}
+
+// bytes held by the keyspace and the buffers, counted by the modules that
+// allocate them, for the maxmemory limit. freed by other threads too.
+inline std::atomic<int64_t> g_used_memory{0};
+
+inline void mem_track(int64_t delta) {
+    g_used_memory.fetch_add(delta, std::memory_order_relaxed);
+}
+
+// the hash seed, randomized at startup against hash flooding.
+// a fork()ed child inherits it, nothing persists the hashes.
+inline uint64_t g_hash_seed = 0x2d358dccaa6c78a5ull;
+
+// wyhash (final version 4): 64-bit output, 8 or 16 bytes per step
+const uint64_t k_wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+inline void wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+// 1 to 3 bytes
+inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
 inline uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
+    const uint8_t *p = data;
+    uint64_t seed = g_hash_seed ^ wymix(g_hash_seed ^ k_wyp[0], k_wyp[1]);
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            a = (wyr4(p) << 32) | wyr4(p + off);
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - off);
+        } else if (len > 0) {
+            a = wyr3(p, len);
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // 3 independent lanes
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ k_wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ k_wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ k_wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ k_wyp[1], wyr8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
     }
-    return h;
+    a ^= k_wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ k_wyp[0] ^ len, b ^ k_wyp[1]);
 }
@@ -1,12 +1,31 @@
 #include <assert.h>
 #include <stdlib.h>     // calloc(), free()
+#include <string.h>     // memset()
+#include <atomic>
+#include <utility>      // std::swap()
 #include "hashtable.h"
+#include "common.h"     // mem_track()
 
 
+// the slot arrays, counted in the used memory
+static HNode **h_alloc(size_t n, bool zeroed) {
+    HNode **tab = (HNode **)(zeroed ? calloc(n, sizeof(HNode *)) : malloc(n * sizeof(HNode *)));
+    assert(tab);
+    mem_track((int64_t)(n * sizeof(HNode *)));
+    return tab;
+}
+
+static void h_free(HNode **tab, size_t n) {
+    if (tab) {
+        mem_track(-(int64_t)(n * sizeof(HNode *)));
+        free(tab);
+    }
+}
+
 // n must be a power of 2
 static void h_init(HTab *htab, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);
-    htab->tab = (HNode **)calloc(n, sizeof(HNode *));
+    htab->tab = h_alloc(n, true);
     htab->mask = n - 1;
     htab->size = 0;
 }
@@ -20,42 +39,80 @@ static void h_insert(HTab *htab, HNode *node) {
     htab->size++;
 }
 
-// hashtable look up subroutine.
-// Pay attention to the return value. It returns the address of
-// the parent pointer that owns the target node,
-// which can be used to delete the target node.
-static HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    if (!htab->tab) {
-        return NULL;
-    }
+// tunable at runtime, read by all threads
+static std::atomic<size_t> g_rehashing_work{128};
+const size_t k_slots_per_work = 32;     // slots scanned or cleared per unit
+const size_t k_max_load_factor = 8;     // grow above this
+const size_t k_min_slots = 4;
 
-    size_t pos = key->hcode & htab->mask;
-    HNode **from = &htab->tab[pos];     // incoming pointer to the target
-    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
-        if (cur->hcode == key->hcode && eq(cur, key)) {
-            return from;                // may be a node, may be a slot
-        }
+void hm_set_rehash_work(size_t work) {
+    g_rehashing_work.store(work > 0 ? work : 1, std::memory_order_relaxed);
+}
+
+size_t hm_rehash_work() {
+    return g_rehashing_work.load(std::memory_order_relaxed);
+}
+
+// (newer, older) <- (new_table, newer)
+static void hm_start_migration(HMap *hmap, HNode **tab, size_t slots) {
+    hmap->older = hmap->newer;
+    hmap->newer = HTab{tab, slots - 1, 0};
+    hmap->migrate_pos = 0;
+}
+
+// the new table is used once it's cleared. a small one is cleared now,
+// a large one is malloc()ed and cleared in steps, see hm_help_rehashing().
+static void hm_trigger_rehashing(HMap *hmap, size_t slots) {
+    assert(hmap->older.tab == NULL && hmap->next_tab == NULL);
+    const size_t k_clear_now = 1024;
+    if (slots <= k_clear_now) {
+        return hm_start_migration(hmap, h_alloc(slots, true), slots);
     }
-    return NULL;
+    hmap->next_tab = h_alloc(slots, false);
+    hmap->next_slots = slots;
+    hmap->next_cleared = 0;
 }
 
-// remove a node from the chain
-static HNode *h_detach(HTab *htab, HNode **from) {
-    HNode *node = *from;    // the target node
-    *from = node->next;     // update the incoming pointer to the target
-    htab->size--;
-    return node;
+// shrink when the load factor is under 1, to a load factor of about 4
+static void hm_check_shrinking(HMap *hmap) {
+    size_t slots = hmap->newer.mask + 1;
+    if (!hmap->newer.tab || slots <= k_min_slots || hmap->newer.size >= slots) {
+        return;
+    }
+    size_t target = k_min_slots;
+    while (target * k_max_load_factor / 2 < hmap->newer.size) {
+        target *= 2;
+    }
+    hm_trigger_rehashing(hmap, target);
 }
 
-const size_t k_rehashing_work = 128;    // constant work
+// the bounded work of each operation: clear a part of the next table,
+// or move some keys from the older table.
+void hm_help_rehashing(HMap *hmap) {
+    size_t work = g_rehashing_work.load(std::memory_order_relaxed);
+    size_t max_scan = work * k_slots_per_work;
+    if (hmap->next_tab) {
+        size_t n = hmap->next_slots - hmap->next_cleared;
+        n = n < max_scan ? n : max_scan;
+        memset(&hmap->next_tab[hmap->next_cleared], 0, n * sizeof(HNode *));
+        hmap->next_cleared += n;
+        if (hmap->next_cleared == hmap->next_slots) {
+            hm_start_migration(hmap, hmap->next_tab, hmap->next_slots);
+            hmap->next_tab = NULL;
+        }
+        return;
+    }
+    if (!hmap->older.tab) {
+        return hm_check_shrinking(hmap);
+    }
 
-static void hm_help_rehashing(HMap *hmap) {
-    size_t nwork = 0;
-    while (nwork < k_rehashing_work && hmap->older.size > 0) {
+    size_t nwork = 0, nscan = 0;
+    while (nwork < work && nscan < max_scan && hmap->older.size > 0) {
         // find a non-empty slot
         HNode **from = &hmap->older.tab[hmap->migrate_pos];
         if (!*from) {
             hmap->migrate_pos++;
+            nscan++;
             continue;   // empty slot
         }
         // move the first list item to the newer table
@@ -64,59 +121,44 @@ static void hm_help_rehashing(HMap *hmap) {
     }
     // discard the old table if done
     if (hmap->older.size == 0 && hmap->older.tab) {
-        free(hmap->older.tab);
+        h_free(hmap->older.tab, hmap->older.mask + 1);
         hmap->older = HTab{};
     }
 }
 
-static void hm_trigger_rehashing(HMap *hmap) {
-    assert(hmap->older.tab == NULL);
-    // (newer, older) <- (new_table, newer)
-    hmap->older = hmap->newer;
-    h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
-    hmap->migrate_pos = 0;
-}
-
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
-    HNode **from = h_lookup(&hmap->newer, key, eq);
-    if (!from) {
-        from = h_lookup(&hmap->older, key, eq);
-    }
-    return from ? *from : NULL;
+    return hm_lookup_t(hmap, key, eq);
 }
 
-const size_t k_max_load_factor = 8;
+void hm_lookup_many(HMap *hmap, HNode **keys, size_t n,
+                    bool (*eq)(HNode *, HNode *), HNode **out)
+{
+    hm_lookup_many_t(hmap, keys, n, eq, out);
+}
 
 void hm_insert(HMap *hmap, HNode *node) {
     if (!hmap->newer.tab) {
-        h_init(&hmap->newer, 4);    // initialize it if empty
+        h_init(&hmap->newer, k_min_slots);  // initialize it if empty
     }
     h_insert(&hmap->newer, node);   // always insert to the newer table
 
-    if (!hmap->older.tab) {         // check whether we need to rehash
+    if (!hmap->older.tab && !hmap->next_tab) {  // check whether we need to rehash
         size_t shreshold = (hmap->newer.mask + 1) * k_max_load_factor;
         if (hmap->newer.size >= shreshold) {
-            hm_trigger_rehashing(hmap);
+            hm_trigger_rehashing(hmap, (hmap->newer.mask + 1) * 2);
         }
     }
     hm_help_rehashing(hmap);        // migrate some keys
 }
 
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
-    if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
-        return h_detach(&hmap->newer, from);
-    }
-    if (HNode **from = h_lookup(&hmap->older, key, eq)) {
-        return h_detach(&hmap->older, from);
-    }
-    return NULL;
+    return hm_delete_t(hmap, key, eq);
 }
 
 void hm_clear(HMap *hmap) {
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    h_free(hmap->newer.tab, hmap->newer.mask + 1);
+    h_free(hmap->older.tab, hmap->older.mask + 1);
+    h_free(hmap->next_tab, hmap->next_slots);
     *hmap = HMap{};
 }
 
@@ -124,6 +166,18 @@ size_t hm_size(HMap *hmap) {
     return hmap->newer.size + hmap->older.size;
 }
 
+void hm_reserve(HMap *hmap, size_t n) {
+    if (hmap->newer.tab || hmap->older.tab || hmap->next_tab) {
+        return;     // only for empty maps
+    }
+    // stay well below the load factor that triggers rehashing
+    size_t slots = k_min_slots;
+    while (slots * k_max_load_factor / 2 < n) {
+        slots *= 2;
+    }
+    h_init(&hmap->newer, slots);
+}
+
 static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
     for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {
         for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
@@ -138,3 +192,74 @@ static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
 }
+
+static void h_scan_slot(HTab *htab, size_t pos, void (*f)(HNode *, void *), void *arg) {
+    for (HNode *node = htab->tab[pos]; node != NULL; node = node->next) {
+        f(node, arg);
+    }
+}
+
+static uint64_t rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increment the masked bits of the cursor from the high end
+static uint64_t cursor_next(uint64_t cursor, size_t mask) {
+    cursor |= ~(uint64_t)mask;
+    return rev_bits(rev_bits(cursor) + 1);
+}
+
+// the cursor is a slot index counted up from the high bits. the slots
+// i and i + size/2 of a table both come from the slot i of a table half
+// its size, so a slot visited before a resize is also covered after it.
+// while rehashing, a slot of the smaller table and all its expansions in
+// the larger one are visited together.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg) {
+    HTab *small = &hmap->newer;
+    HTab *large = &hmap->older;
+    if (!small->tab) {
+        return 0;
+    }
+    if (!large->tab) {
+        h_scan_slot(small, cursor & small->mask, f, arg);
+        return cursor_next(cursor, small->mask);
+    }
+    if (small->mask > large->mask) {
+        std::swap(small, large);
+    }
+    h_scan_slot(small, cursor & small->mask, f, arg);
+    do {
+        h_scan_slot(large, cursor & large->mask, f, arg);
+        cursor = cursor_next(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
+}
+
+// xorshift64*, per thread
+static uint64_t h_rand() {
+    static thread_local uint64_t state = 0x9E3779B97F4A7C15ull;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
+
+// pick random slots and take their chains. the tries are bounded, so a
+// sparse table may give fewer keys.
+size_t hm_sample(HMap *hmap, HNode **out, size_t n) {
+    size_t got = 0;
+    for (size_t tries = 0; tries < n * 8 && got < n && hm_size(hmap) > 0; tries++) {
+        uint64_t r = h_rand();
+        HTab *htab = (hmap->older.tab && (r & 1)) ? &hmap->older : &hmap->newer;
+        if (!htab->tab) {
+            continue;
+        }
+        for (HNode *node = htab->tab[(r >> 1) & htab->mask]; node && got < n; node = node->next) {
+            out[got++] = node;
+        }
+    }
+    return got;
+}
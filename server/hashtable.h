@@ -18,17 +18,163 @@ struct HTab {
 };
 
 // the real hashtable interface.
-// it uses 2 hashtables for progressive rehashing.
+// it uses 2 hashtables for progressive rehashing, in both directions:
+// it grows when the chains get long and shrinks when they get sparse.
+// a large new table is cleared in steps before the keys move over,
+// so no single operation pays for zeroing the whole array.
 struct HMap {
     HTab newer;
     HTab older;
     size_t migrate_pos = 0;
+    // the next table, not yet in use while being cleared
+    HNode **next_tab = NULL;
+    size_t next_slots = 0;
+    size_t next_cleared = 0;
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// look up n hashed keys together; out[i] is the node of keys[i] or NULL
+void   hm_lookup_many(HMap *hmap, HNode **keys, size_t n,
+                      bool (*eq)(HNode *, HNode *), HNode **out);
 void   hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_clear(HMap *hmap);
 size_t hm_size(HMap *hmap);
+// presize an empty map for `n` keys, so that bulk loading won't rehash
+void   hm_reserve(HMap *hmap, size_t n);
 // invoke the callback on each node until it returns false
 void   hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// invoke the callback on the keys of a cursor, returns the next cursor.
+// start with 0, done when it returns 0. the keys present from start to
+// end are visited at least once, even across resizes; some may repeat.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
+// up to `n` random keys, for the approximated eviction
+size_t hm_sample(HMap *hmap, HNode **out, size_t n);
+// the units of resizing work done by each operation, shared by all maps.
+// a unit moves 1 key, or scans or clears a few slots.
+void   hm_set_rehash_work(size_t work);
+size_t hm_rehash_work();
+
+
+// implementation details, shared with the templated variants below
+void hm_help_rehashing(HMap *hmap);
+const size_t k_prefetch_batch = 16;     // keys in flight, see hm_lookup_many()
+
+// hashtable look up subroutine.
+// Pay attention to the return value. It returns the address of
+// the parent pointer that owns the target node,
+// which can be used to delete the target node.
+// `eq` is a function pointer for HMap, or a functor that inlines for HMapT.
+template <class Eq>
+inline HNode **h_lookup(HTab *htab, HNode *key, Eq eq) {
+    if (!htab->tab) {
+        return NULL;
+    }
+
+    size_t pos = key->hcode & htab->mask;
+    HNode **from = &htab->tab[pos];     // incoming pointer to the target
+    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
+        if (cur->hcode == key->hcode && eq(cur, key)) {
+            return from;                // may be a node, may be a slot
+        }
+    }
+    return NULL;
+}
+
+// remove a node from the chain
+inline HNode *h_detach(HTab *htab, HNode **from) {
+    HNode *node = *from;    // the target node
+    *from = node->next;     // update the incoming pointer to the target
+    htab->size--;
+    return node;
+}
+
+template <class Eq>
+inline HNode *hm_lookup_t(HMap *hmap, HNode *key, Eq eq) {
+    hm_help_rehashing(hmap);
+    HNode **from = h_lookup(&hmap->newer, key, eq);
+    if (!from) {
+        from = h_lookup(&hmap->older, key, eq);
+    }
+    return from ? *from : NULL;
+}
+
+// a lookup without the rehashing work, so that concurrent readers are
+// safe while nobody writes
+template <class Eq>
+inline HNode *hm_peek_t(HMap *hmap, HNode *key, Eq eq) {
+    HNode **from = h_lookup(&hmap->newer, key, eq);
+    if (!from) {
+        from = h_lookup(&hmap->older, key, eq);
+    }
+    return from ? *from : NULL;
+}
+
+template <class Eq>
+inline HNode *hm_delete_t(HMap *hmap, HNode *key, Eq eq) {
+    hm_help_rehashing(hmap);
+    if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
+        return h_detach(&hmap->newer, from);
+    }
+    if (HNode **from = h_lookup(&hmap->older, key, eq)) {
+        return h_detach(&hmap->older, from);
+    }
+    return NULL;
+}
+
+// the lookups of a batch miss the cache at the same time, rather than
+// one after another: first prefetch the slots of all the keys, then the
+// chain heads they point to, then do the lookups with the caches warm.
+template <class Eq>
+inline void hm_lookup_many_t(HMap *hmap, HNode **keys, size_t n, Eq eq, HNode **out) {
+    hm_help_rehashing(hmap);
+    HTab *tabs[2] = {&hmap->newer, &hmap->older};
+    for (size_t base = 0; base < n; base += k_prefetch_batch) {
+        size_t end = n - base < k_prefetch_batch ? n : base + k_prefetch_batch;
+        for (HTab *htab : tabs) {
+            for (size_t i = base; htab->tab && i < end; i++) {
+                __builtin_prefetch(&htab->tab[keys[i]->hcode & htab->mask]);
+            }
+        }
+        for (HTab *htab : tabs) {
+            for (size_t i = base; htab->tab && i < end; i++) {
+                if (HNode *head = htab->tab[keys[i]->hcode & htab->mask]) {
+                    __builtin_prefetch(head);
+                }
+            }
+        }
+        for (size_t i = base; i < end; i++) {
+            HNode **from = h_lookup(&hmap->newer, keys[i], eq);
+            if (!from) {
+                from = h_lookup(&hmap->older, keys[i], eq);
+            }
+            out[i] = from ? *from : NULL;
+        }
+    }
+}
+
+// HMap with the key comparison known at compile time: `Eq()(node, key)`
+// is inlined into the chain walk instead of an indirect call per node.
+// the untyped functions above work on it as well.
+template <class Eq>
+struct HMapT : HMap {};
+
+template <class Eq>
+HNode *hm_lookup(HMapT<Eq> *hmap, HNode *key) {
+    return hm_lookup_t(hmap, key, Eq());
+}
+
+template <class Eq>
+HNode *hm_peek(HMapT<Eq> *hmap, HNode *key) {
+    return hm_peek_t(hmap, key, Eq());
+}
+
+template <class Eq>
+HNode *hm_delete(HMapT<Eq> *hmap, HNode *key) {
+    return hm_delete_t(hmap, key, Eq());
+}
+
+template <class Eq>
+void hm_lookup_many(HMapT<Eq> *hmap, HNode **keys, size_t n, HNode **out) {
+    hm_lookup_many_t(hmap, keys, n, Eq(), out);
+}
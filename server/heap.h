@@ -6,7 +6,7 @@
 
 struct HeapItem {
     uint64_t val = 0;
-    size_t *ref = NULL;
+    uint32_t *ref = NULL;   // the index kept by the owner
 };
 
 void heap_update(HeapItem *a, size_t pos, size_t len);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+
+// intrusive node, should be embedded into the payload
+struct MPSCNode {
+    std::atomic<MPSCNode *> next{NULL};
+};
+
+// lock-free multi-producer single-consumer queue (Vyukov).
+// push() is wait-free; only the owner thread may pop().
+struct MPSCQueue {
+    std::atomic<MPSCNode *> head{NULL};    // the newest node, for producers
+    MPSCNode *tail = NULL;                  // the oldest node, for the consumer
+    MPSCNode stub;
+};
+
+inline void mpsc_init(MPSCQueue *q) {
+    q->stub.next.store(NULL, std::memory_order_relaxed);
+    q->head.store(&q->stub, std::memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+inline void mpsc_push(MPSCQueue *q, MPSCNode *node) {
+    node->next.store(NULL, std::memory_order_relaxed);
+    MPSCNode *prev = q->head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+// returns NULL if empty, or if a producer is in the middle of a push().
+// the producer is expected to wake up the consumer after the push.
+inline MPSCNode *mpsc_pop(MPSCQueue *q) {
+    MPSCNode *tail = q->tail;
+    MPSCNode *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->tail = next;     // skip the stub
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != q->head.load(std::memory_order_acquire)) {
+        return NULL;        // a push() is not finished yet
+    }
+    // `tail` is the last node; put the stub behind it so it can be popped
+    mpsc_push(q, &q->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <string_view>
+
+
+// an immutable, reference counted string. a stored value can be shared
+// with the output buffers, so a large value is sent without copying.
+// the count is atomic because a forwarded reply is released by another
+// reactor.
+struct RcStr {
+    std::atomic<uint32_t> refs{1};
+    uint32_t len = 0;
+
+    char *data() { return (char *)(this + 1); }
+    std::string_view view() { return std::string_view(data(), len); }
+};
+
+inline RcStr *rcstr_new(const char *data, size_t len) {
+    RcStr *s = new (malloc(sizeof(RcStr) + len + 1)) RcStr();
+    s->len = (uint32_t)len;
+    memcpy(s->data(), data, len);
+    s->data()[len] = '\0';
+    return s;
+}
+
+inline RcStr *rcstr_ref(RcStr *s) {
+    s->refs.fetch_add(1, std::memory_order_relaxed);
+    return s;
+}
+
+inline void rcstr_unref(RcStr *s) {
+    if (s && s->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        s->~RcStr();
+        free(s);
+    }
+}
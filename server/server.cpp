@@ -3,19 +3,31 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>  // strncasecmp
+#include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
 #include <math.h>   // isnan
 // system
 #include <time.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/ip.h>
 // C++
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <vector>
 // proj
 #include "common.h"
@@ -25,6 +37,9 @@
 #include "heap.h"
 #include "thread_pool.h"
 #include "buffer.h"
+#include "uring.h"
+#include "mpsc_queue.h"
+#include "slab.h"
 
 
 static void msg(const char *msg) {
@@ -46,6 +61,13 @@ static uint64_t get_monotonic_msec() {
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+// for the timestamps stored in files, which outlive the process
+static int64_t get_wall_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
 static void fd_set_nb(int fd) {
     errno = 0;
     int flags = fcntl(fd, F_GETFL, 0);
@@ -64,6 +86,9 @@ static void fd_set_nb(int fd) {
 }
 
 const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
+const size_t k_min_ref_size = 16 << 10; // values sent without copying
+const size_t k_rewrite_chunk = 4 << 20; // AOF rewrite output per write()
+const size_t k_zload_batch = 1024;      // zset members per AOF rewrite record
 
 // typedef std::vector<uint8_t> Buffer;
 
@@ -76,46 +101,240 @@ const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
 //     buf.erase(buf.begin(), buf.begin() + n);
 // }
 
+const int k_max_iov = 16;   // iovecs per writev()
+
+struct Forward;
+
 struct Conn {
     int fd = -1;
     // application's intention, for the event loop
     bool want_read = false;
     bool want_write = false;
     bool want_close = false;
+    uint32_t events = 0;    // interest currently registered in the epoll set
+    uint32_t inflight = 0;  // pending io_uring operations
+    bool fwd_pending = false;   // waiting for a command forwarded to another reactor
+    Forward *fwd_reply = NULL;  // the reply, held back while io_uring sends
     // buffered input and output
     Buffer incoming;    // data to be parsed by the application
     Buffer outgoing;    // responses generated by the application
+    // the pending io_uring SENDMSG, must be stable until it completes
+    struct iovec send_iov[k_max_iov];
+    struct msghdr send_msg;
     // timer
     uint64_t last_active_ms = 0;
     DList idle_node;
+    // appendfsync always: the replies wait until the AOF reaches `aof_wait`
+    uint64_t aof_wait = 0;
+    DList aof_node;
 };
 
-// global states
-static struct {
-    HMap db;
+// I/O backends of the event loop
+enum {
+    IO_EPOLL = 0,   // readiness-based, one syscall per read or write
+    IO_URING = 1,   // completion-based, one io_uring_enter() per iteration
+};
+
+const size_t k_max_cmds = 64;   // capacity of the command table
+
+// compares an Entry with a LookupKey, see the definition
+struct EntryEq {
+    bool operator()(HNode *node, HNode *key) const;
+};
+
+// an event loop thread. it owns its connections and a shard of the keyspace.
+struct Reactor {
+    size_t id = 0;
+    pthread_t thread;
+    // the keyspace shard, chosen by the key hash
+    HMapT<EntryEq> db;
+    // timers for TTLs
+    std::vector<HeapItem> heap;
+    // the clock of Entry::lru in seconds, updated once per iteration
+    uint32_t lru_clock = 0;
+    std::atomic<uint64_t> evicted_keys{0};
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
     // timers for idle connections
     DList idle_list;
-    // timers for TTLs
-    std::vector<HeapItem> heap;
+    // I/O
+    int listen_fd = -1;
+    int epfd = -1;
+    URing ring;
+    struct sockaddr_in accept_addr = {};
+    socklen_t accept_addrlen = 0;
+    // commands forwarded from other reactors, or replies to them
+    MPSCQueue inbox;
+    int wake_fd = -1;                       // eventfd
+    std::atomic<bool> wake_pending{false};  // coalesce the wakeups
+    uint64_t wake_val = 0;                  // io_uring read target
+    // reused by the request parser
+    std::vector<std::string_view> cmd;
+    std::vector<uint8_t> scratch;   // for requests that wrap around
+    // number of calls per command, indexed like k_commands
+    std::atomic<uint64_t> cmd_calls[k_max_cmds] = {};
+    // the AOF offset after the last command logged by this reactor
+    uint64_t aof_seq = 0;
+    // connections whose replies wait for the fsync
+    DList aof_waiters;
+};
+
+// background child processes
+enum {
+    CHILD_NONE = 0,
+    CHILD_AOF = 1,  // AOF rewrite
+    CHILD_RDB = 2,  // BGSAVE
+};
+
+// maxmemory policies
+enum {
+    EVICT_NONE          = 0,    // noeviction: refuse the writes
+    EVICT_ALLKEYS_LRU   = 1,    // the least recently used of a sample
+    EVICT_ALLKEYS_LFU   = 2,    // the least frequently used of a sample
+    EVICT_VOLATILE_TTL  = 3,    // the nearest expiration, from the TTL heap
+};
+
+// appendfsync policies
+enum {
+    AOF_FSYNC_NO = 0,       // leave it to the OS
+    AOF_FSYNC_EVERYSEC = 1, // by the fsync thread, once per second
+    AOF_FSYNC_ALWAYS = 2,   // before replying to the writes
+};
+
+// the reactor of the current thread
+static thread_local Reactor *g_reactor = NULL;
+
+// global states
+static struct {
+    // the I/O backend of the event loop
+    int io_backend = IO_EPOLL;
+    // all the event loop threads
+    std::vector<Reactor *> reactors;
     // the thread pool
     TheadPool thread_pool;
+    // the other reactors park while the 1st one forks, see reactors_pause()
+    pthread_mutex_t pause_mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+    size_t pause_parked = 0;    // reactors waiting for `pause_gen` to move
+    uint64_t pause_gen = 0;     // bumped by reactors_resume()
 
     // aof related
     int aof_fd = -1;
-    uint64_t aof_last_save_ms = 0;
+    int aof_fsync = AOF_FSYNC_EVERYSEC;
     Buffer aof_buf;
+    pthread_mutex_t aof_mu = PTHREAD_MUTEX_INITIALIZER;   // for `aof_buf`
+    // offsets in the AOF stream, protected by `aof_mu` except `aof_synced`
+    uint64_t aof_seq = 0;       // appended to `aof_buf`
+    uint64_t aof_written = 0;   // written to `aof_fd`
+    std::atomic<uint64_t> aof_synced{0};    // made durable by the fsync thread
+    pthread_cond_t aof_cond = PTHREAD_COND_INITIALIZER; // `aof_written` moved
+    pthread_t aof_fsync_thread;
+    // io_uring: the AOF data being written, moved out of `aof_buf`
+    std::vector<uint8_t> aof_wbuf;
+    size_t aof_woff = 0;
+    bool aof_inflight = false;
+    uint32_t aof_gen = 0;   // bumped when `aof_fd` is reopened
+    uint32_t aof_wgen = 0;  // `aof_gen` of the in-flight write
     std::string aof_filename = "redis.aof";
     bool aof_enabled = true;
     // AOF rewrite related
     int aof_rewrite_fd = -1;          // 重写AOF文件的文件描述符
     std::string aof_rewrite_filename; // 重写AOF文件的临时文件名
     bool aof_rewriting = false;       // 是否正在进行AOF重写
-    size_t aof_rewrite_progress = 0;  // 重写进度 
+    bool aof_rdb_preamble = true;     // 重写时以快照作为AOF文件的开头
+    Buffer aof_rewrite_buf;           // 重写期间的新命令（差异缓冲区），受 aof_mu 保护
+    // snapshot (RDB) related
+    std::string rdb_filename = "dump.rdb";
+    std::string rdb_tmp_filename;     // BGSAVE 写入的临时文件
+    // 后台子进程（AOF重写或BGSAVE），同一时间只有一个
+    int child_type = 0;               // CHILD_*
+    pid_t child_pid = -1;
+    int child_progress_fd = -1;       // 子进程报告进度的管道（读端）
+    uint64_t child_poll_ms = 0;       // 下次检查子进程的时间
+    size_t child_progress = 0;        // 子进程已处理的键数
+    size_t child_total = 0;           // fork 时的键数
+    // memory limit, set by CONFIG from any reactor
+    std::atomic<int64_t> maxmemory{0};      // bytes, 0 for no limit
+    std::atomic<int> maxmemory_policy{0};   // EVICT_*
+    std::atomic<int64_t> maxmemory_samples{5};  // keys sampled per eviction
+    bool loading = false;   // replaying the AOF, the limit isn't enforced
 } g_data;
 
 
+// sync the epoll interest with the application's intention.
+// only issues a syscall when `want_read` or `want_write` has changed.
+static void conn_update_events(Conn *conn) {
+    uint32_t events = 0;
+    if (conn->want_read) {
+        events |= EPOLLIN;
+    }
+    if (conn->want_write) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = events;     // EPOLLERR is always reported
+    ev.data.fd = conn->fd;
+    int rv = epoll_ctl(g_reactor->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    if (rv < 0) {
+        msg_errno("epoll_ctl() error");
+        conn->want_close = true;
+        return;
+    }
+    conn->events = events;
+}
+
+static void log_new_client(const struct sockaddr_in &client_addr) {
+    uint32_t ip = client_addr.sin_addr.s_addr;
+    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
+        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+        ntohs(client_addr.sin_port)
+    );
+}
+
+// create a `struct Conn` and put it into the map
+static Conn *conn_new(int connfd) {
+    Conn *conn = new Conn();
+    conn->fd = connfd;
+    conn->want_read = true;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_reactor->idle_list, &conn->idle_node);
+    dlist_init(&conn->aof_node);
+
+    if (g_reactor->fd2conn.size() <= (size_t)conn->fd) {
+        g_reactor->fd2conn.resize(conn->fd + 1);
+    }
+    assert(!g_reactor->fd2conn[conn->fd]);
+    g_reactor->fd2conn[conn->fd] = conn;
+    return conn;
+}
+
+static void conn_destroy(Conn *conn) {
+    if (g_data.io_backend == IO_URING && conn->inflight > 0) {
+        // the kernel still references the buffers; wake up the pending
+        // operations and free the `Conn` when the last one completes.
+        (void)shutdown(conn->fd, SHUT_RDWR);
+    }
+    (void)close(conn->fd);  // also removes it from the epoll set
+    g_reactor->fd2conn[conn->fd] = NULL;
+    dlist_detach(&conn->idle_node);
+    dlist_detach(&conn->aof_node);
+    if (conn->inflight > 0 || conn->fwd_pending) {
+        conn->fd = -1;      // mark it as dead
+        return;
+    }
+    delete conn;
+}
+
+// free a dead `Conn` once nothing refers to it
+static void conn_release_dead(Conn *conn) {
+    assert(conn->fd < 0);
+    if (conn->inflight == 0 && !conn->fwd_pending) {
+        delete conn;
+    }
+}
 
 // application callback when the listening socket is ready
 static int32_t handle_accept(int fd) {
@@ -127,38 +346,27 @@ static int32_t handle_accept(int fd) {
         msg_errno("accept() error");
         return -1;
     }
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-        ntohs(client_addr.sin_port)
-    );
+    log_new_client(client_addr);
 
     // set the new connection fd to nonblocking mode
     fd_set_nb(connfd);
 
     // create a `struct Conn`
-    Conn *conn = new Conn();
-    conn->fd = connfd;
-    conn->want_read = true;
-    conn->last_active_ms = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    Conn *conn = conn_new(connfd);
 
-    // put it into the map
-    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
-        g_data.fd2conn.resize(conn->fd + 1);
+    // register it in the epoll set
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(g_reactor->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        msg_errno("epoll_ctl() error");
+        conn_destroy(conn);
+        return -1;
     }
-    assert(!g_data.fd2conn[conn->fd]);
-    g_data.fd2conn[conn->fd] = conn;
+    conn->events = EPOLLIN;
     return 0;
 }
 
-static void conn_destroy(Conn *conn) {
-    (void)close(conn->fd);
-    g_data.fd2conn[conn->fd] = NULL;
-    dlist_detach(&conn->idle_node);
-    delete conn;
-}
-
 const size_t k_max_args = 200 * 1000;
 
 static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
@@ -171,11 +379,11 @@ static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
 }
 
 static bool
-read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out) {
+read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string_view &out) {
     if (cur + n > end) {
         return false;
     }
-    out.assign(cur, cur + n);
+    out = std::string_view((const char *)cur, n);    // no copy
     cur += n;
     return true;
 }
@@ -184,8 +392,9 @@ read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out) {
 // | nstr | len | str1 | len | str2 | ... | len | strn |
 // +------+-----+------+-----+------+-----+-----+------+
 
+// the output points into `data`, which must outlive it
 static int32_t
-parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
+parse_req(const uint8_t *data, size_t size, std::vector<std::string_view> &out) {
     const uint8_t *end = data + size;
     uint32_t nstr = 0;
     if (!read_u32(data, end, nstr)) {
@@ -200,7 +409,7 @@ parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
         if (!read_u32(data, end, len)) {
             return -1;
         }
-        out.push_back(std::string());
+        out.push_back(std::string_view());
         if (!read_str(data, end, len, out.back())) {
             return -1;
         }
@@ -217,6 +426,7 @@ enum {
     ERR_TOO_BIG = 2,    // response too big
     ERR_BAD_TYP = 3,    // unexpected value type
     ERR_BAD_ARG = 4,    // bad arguments
+    ERR_OOM     = 5,    // over maxmemory
 };
 
 // data types of serialized data
@@ -270,7 +480,16 @@ static void out_dbl(Buffer &out, double val) {
     buf_append_u8(out, TAG_DBL);
     buf_append_dbl(out, val);
 }
-static void out_err(Buffer &out, uint32_t code, const std::string &msg) {
+// a stored value; a large one is referenced instead of copied
+static void out_value(Buffer &out, RcStr *str) {
+    if (str->len < k_min_ref_size) {
+        return out_str(out, str->data(), str->len);
+    }
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, str->len);
+    out.append_ref(str);
+}
+static void out_err(Buffer &out, uint32_t code, std::string_view msg) {
     buf_append_u8(out, TAG_ERR);
     buf_append_u32(out, code);
     buf_append_u32(out, (uint32_t)msg.size());
@@ -290,6 +509,11 @@ static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
     assert(out[ctx - 1] == TAG_ARR);
     memcpy(&out[ctx], &n, 4);
 }
+// overwrite an int written at `pos` by out_int()
+static void out_set_int(Buffer &out, size_t pos, int64_t val) {
+    assert(out[pos] == TAG_INT);
+    memcpy(&out[pos + 1], &val, 8);
+}
 
 // value types
 enum {
@@ -298,32 +522,242 @@ enum {
     T_ZSET  = 2,    // sorted set
 };
 
-// KV pair for the top-level hashtable
+// string encodings
+enum {
+    ENC_INLINE  = 0,    // in the room after the key
+    ENC_RCSTR   = 1,    // Entry::str
+    ENC_INT     = 2,    // Entry::ival, formatted when read
+};
+
+// KV pair for the top-level hashtable, in 1 allocation:
+//   | Entry | key | room for a short string value |
+// a string value is stored as an int if it's a canonical integer, inline
+// if it fits the room, otherwise in a separate RcStr.
+// the zset is allocated only for the zset type.
 struct Entry {
     struct HNode node;      // hashtable node
-    std::string key;
     // for TTL
-    size_t heap_idx = -1;   // array index to the heap item
-    // value
-    uint32_t type = 0;
-    // one of the following
-    std::string str;
-    ZSet zset;
+    uint32_t heap_idx = -1; // array index to the heap item
+    uint32_t lru = 0;       // for eviction, see entry_touch()
+    uint32_t klen = 0;      // key length
+    uint8_t type = 0;
+    uint8_t vcap = 0;       // room for the inline value
+    uint8_t vlen = 0;       // inline value length
+    uint8_t enc = ENC_INLINE;   // of the string value
+    // the value, by type and encoding
+    union {
+        RcStr *str = NULL;
+        ZSet *zset;
+        int64_t ival;
+    };
+    char key[0];            // the key, then the inline value
+
+    std::string_view view_key() const { return std::string_view(key, klen); }
+    char *inline_val() { return key + klen; }
 };
 
-static Entry *entry_new(uint32_t type) {
-    Entry *ent = new Entry();
-    ent->type = type;
+const size_t k_max_inline_val = 64;     // longer values go to RcStr
+
+// xorshift32, per thread
+static uint32_t fast_rand() {
+    static thread_local uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Entry::lru is the access time in seconds, or with the LFU policy:
+//   | 8 bits unused | 16 bits minutes of the last access | 8 bits counter |
+// the counter is logarithmic and decays by 1 per idle minute.
+const uint32_t k_lfu_init = 5;          // new keys aren't evicted right away
+const uint32_t k_lfu_log_factor = 10;
+
+static bool policy_is_lfu() {
+    return g_data.maxmemory_policy.load(std::memory_order_relaxed) == EVICT_ALLKEYS_LFU;
+}
+
+static uint32_t lfu_minutes() {
+    return (g_reactor->lru_clock / 60) & 0xFFFF;
+}
+
+static uint32_t lfu_counter(uint32_t lru) {
+    uint32_t counter = lru & 0xFF;
+    uint32_t idle = (lfu_minutes() - (lru >> 8)) & 0xFFFF;
+    return idle < counter ? counter - idle : 0;
+}
+
+static uint32_t entry_lru_init() {
+    return policy_is_lfu() ? (lfu_minutes() << 8 | k_lfu_init) : g_reactor->lru_clock;
+}
+
+// record an access. the entry was just compared with the key, so its
+// cache line is at hand; it's not written again within the same second.
+static void entry_touch(Entry *ent) {
+    uint32_t lru = g_reactor->lru_clock;
+    if (policy_is_lfu()) {
+        uint32_t counter = lfu_counter(ent->lru);
+        // increment with the probability 1/((counter - init) * factor + 1)
+        uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+        if (counter < 255 && fast_rand() % (base * k_lfu_log_factor + 1) == 0) {
+            counter++;
+        }
+        lru = lfu_minutes() << 8 | counter;
+    }
+    if (ent->lru != lru) {
+        ent->lru = lru;
+    }
+}
+
+// larger is a better candidate for eviction
+static uint32_t entry_evict_score(Entry *ent) {
+    if (policy_is_lfu()) {
+        return 255 - lfu_counter(ent->lru);
+    }
+    return g_reactor->lru_clock - ent->lru;     // idle seconds
+}
+
+// a canonical int64 like "-12"; not "+12", "012", "-0", " 12", or out of
+// range, so that formatting the int gives back the same string.
+static bool str2int_exact(std::string_view s, int64_t &out) {
+    bool neg = !s.empty() && s[0] == '-';
+    size_t i = neg;
+    if (i == s.size() || s.size() > 20 || (s[i] == '0' && (neg || s.size() > 1))) {
+        return false;
+    }
+    uint64_t val = 0;
+    for (; i < s.size(); i++) {
+        if (s[i] < '0' || s[i] > '9' || val > (UINT64_MAX - 9) / 10) {
+            return false;
+        }
+        val = val * 10 + (uint64_t)(s[i] - '0');
+    }
+    if (val > (uint64_t)INT64_MAX + neg) {
+        return false;
+    }
+    out = neg ? (int64_t)(0 - val) : (int64_t)val;
+    return true;
+}
+
+const size_t k_int_str_size = 24;   // formatted int64 with the sign and '\0'
+
+static size_t int2str(int64_t val, char *buf) {
+    return (size_t)snprintf(buf, k_int_str_size, "%lld", (long long)val);
+}
+
+// `vlen` is the length of the string value to reserve room for
+static Entry *entry_new(uint32_t type, std::string_view key, uint64_t hcode, size_t vlen = 0) {
+    size_t size = sizeof(Entry) + key.size();
+    if (type == T_STR && vlen <= k_max_inline_val) {
+        size = (size + vlen + 7) & ~(size_t)7;  // keep the padding as room
+    }
+    Entry *ent = new (slab_alloc(size)) Entry();
+    mem_track((int64_t)size);
+    ent->node.hcode = hcode;
+    ent->lru = entry_lru_init();
+    ent->klen = (uint32_t)key.size();
+    ent->type = (uint8_t)type;
+    ent->vcap = (uint8_t)std::min<size_t>(size - sizeof(Entry) - key.size(), 255);
+    memcpy(ent->key, key.data(), key.size());
+    if (type == T_ZSET) {
+        ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+        mem_track(sizeof(ZSet));
+    }
+    return ent;
+}
+
+// an RcStr owned by an entry
+static RcStr *entry_rcstr_new(std::string_view val) {
+    mem_track((int64_t)(sizeof(RcStr) + val.size() + 1));
+    return rcstr_new(val.data(), val.size());
+}
+
+static void entry_rcstr_unref(RcStr *str) {
+    mem_track(-(int64_t)(sizeof(RcStr) + str->len + 1));
+    rcstr_unref(str);
+}
+
+// the string value; `buf` of k_int_str_size holds a formatted int
+static std::string_view entry_str(Entry *ent, char *buf) {
+    assert(ent->type == T_STR);
+    switch (ent->enc) {
+    case ENC_INT:
+        return std::string_view(buf, int2str(ent->ival, buf));
+    case ENC_RCSTR:
+        return ent->str->view();
+    default:
+        return std::string_view(ent->inline_val(), ent->vlen);
+    }
+}
+
+static void entry_set_int(Entry *ent, int64_t val) {
+    assert(ent->type == T_STR);
+    if (ent->enc == ENC_RCSTR) {
+        entry_rcstr_unref(ent->str);
+    }
+    ent->enc = ENC_INT;
+    ent->ival = val;
+}
+
+static void entry_set_str(Entry *ent, std::string_view val) {
+    int64_t ival = 0;
+    if (str2int_exact(val, ival)) {
+        return entry_set_int(ent, ival);
+    }
+    assert(ent->type == T_STR);
+    // replace, not modify: the old RcStr may be still being sent.
+    // the inline value is short enough to be always copied to the output.
+    if (ent->enc == ENC_RCSTR) {
+        entry_rcstr_unref(ent->str);
+    }
+    if (val.size() <= ent->vcap) {
+        ent->enc = ENC_INLINE;
+        memcpy(ent->inline_val(), val.data(), val.size());
+        ent->vlen = (uint8_t)val.size();
+    } else {
+        ent->enc = ENC_RCSTR;
+        ent->str = entry_rcstr_new(val);
+    }
+}
+
+// a string entry, with room for the value unless it's stored as an int
+static Entry *entry_new_str(std::string_view key, uint64_t hcode, std::string_view val) {
+    int64_t ival = 0;
+    bool is_int = str2int_exact(val, ival);
+    Entry *ent = entry_new(T_STR, key, hcode, is_int ? 0 : val.size());
+    if (is_int) {
+        entry_set_int(ent, ival);
+    } else {
+        entry_set_str(ent, val);
+    }
     return ent;
 }
 
+static void out_entry_str(Buffer &out, Entry *ent) {
+    if (ent->enc == ENC_RCSTR) {
+        return out_value(out, ent->str);
+    }
+    char buf[k_int_str_size];
+    std::string_view val = entry_str(ent, buf);
+    return out_str(out, val.data(), val.size());
+}
+
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms);
+static void aof_append(const std::vector<std::string_view> &cmd);
 
 static void entry_del_sync(Entry *ent) {
     if (ent->type == T_ZSET) {
-        zset_clear(&ent->zset);
+        zset_clear(ent->zset);
+        ent->zset->~ZSet();
+        slab_free(ent->zset, sizeof(ZSet));
+        mem_track(-(int64_t)sizeof(ZSet));
+    } else if (ent->enc == ENC_RCSTR) {
+        entry_rcstr_unref(ent->str);
     }
-    delete ent;
+    size_t size = sizeof(Entry) + ent->klen + ent->vcap;
+    mem_track(-(int64_t)size);
+    ent->~Entry();
+    slab_free(ent, size);     // maybe another thread's pool
 }
 
 static void entry_del_func(void *arg) {
@@ -334,7 +768,7 @@ static void entry_del(Entry *ent) {
     // unlink it from any data structures
     entry_set_ttl(ent, -1); // remove from the heap data structure
     // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
+    size_t set_size = (ent->type == T_ZSET) ? zset_size(ent->zset) : 0;
     const size_t k_large_container_size = 1000;
     if (set_size > k_large_container_size) {
         thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
@@ -345,23 +779,31 @@ static void entry_del(Entry *ent) {
 
 struct LookupKey {
     struct HNode node;  // hashtable node
-    std::string key;
+    std::string_view key;
 };
 
-// equality comparison for the top-level hashstable
-static bool entry_eq(HNode *node, HNode *key) {
+// equality comparison for the top-level hashstable,
+// inlined into the hashtable lookups
+inline bool EntryEq::operator()(HNode *node, HNode *key) const {
     struct Entry *ent = container_of(node, struct Entry, node);
     struct LookupKey *keydata = container_of(key, struct LookupKey, node);
-    return ent->key == keydata->key;
+    return key_eq(ent->key, ent->klen, keydata->key.data(), keydata->key.size());
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
-    // a dummy struct just for the lookup
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// a lookup by a command, counted as an access for the eviction
+static HNode *db_lookup(LookupKey *key) {
+    HNode *node = hm_lookup(&g_reactor->db, &key->node);
+    if (node) {
+        entry_touch(container_of(node, Entry, node));
+    }
+    return node;
+}
+
+static bool hnode_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+static void out_get(Buffer &out, HNode *node) {
     if (!node) {
         return out_nil(out);
     }
@@ -370,47 +812,169 @@ static void do_get(std::vector<std::string> &cmd, Buffer &out) {
     if (ent->type != T_STR) {
         return out_err(out, ERR_BAD_TYP, "not a string value");
     }
-    return out_str(out, ent->str.data(), ent->str.size());
+    return out_entry_str(out, ent);
 }
 
-static void do_set(std::vector<std::string> &cmd, Buffer &out) {
+static void do_get(std::vector<std::string_view> &cmd, Buffer &out) {
     // a dummy struct just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
     // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode *node = db_lookup(&key);
+    return out_get(out, node);
+}
+
+// set the string value, false if the key holds another type
+static bool str_set(std::string_view name, std::string_view val) {
+    // a dummy struct just for the lookup
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    // hashtable lookup
+    HNode *node = db_lookup(&key);
     if (node) {
         // found, update the value
         Entry *ent = container_of(node, Entry, node);
         if (ent->type != T_STR) {
-            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+            return false;
         }
-        ent->str.swap(cmd[2]);
+        entry_set_str(ent, val);
     } else {
         // not found, allocate & insert a new pair
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+        Entry *ent = entry_new_str(key.key, key.node.hcode, val);
+        hm_insert(&g_reactor->db, &ent->node);
+    }
+    return true;
+}
+
+static void do_set(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (!str_set(cmd[1], cmd[2])) {
+        return out_err(out, ERR_BAD_TYP, "a non-string value exists");
     }
     return out_nil(out);
 }
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out) {
+static void do_del(std::vector<std::string_view> &cmd, Buffer &out) {
     // a dummy struct just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
     // hashtable delete
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
+    HNode *node = hm_delete(&g_reactor->db, &key.node);
     if (node) { // deallocate the pair
         entry_del(container_of(node, Entry, node));
     }
     return out_int(out, node ? 1 : 0);
 }
 
+// look up every `step`th key of the array together, see hm_lookup_many().
+// `keys` and `pkeys` are the scratch space for `n` keys, from the caller.
+static void db_lookup_keys(const std::string_view *names, size_t n, size_t step,
+                           LookupKey *keys, HNode **pkeys, HNode **out)
+{
+    for (size_t i = 0; i < n; i++) {
+        keys[i].key = names[i * step];
+        keys[i].node.hcode = str_hash((uint8_t *)keys[i].key.data(), keys[i].key.size());
+        pkeys[i] = &keys[i].node;
+    }
+    hm_lookup_many(&g_reactor->db, pkeys, n, out);
+    for (size_t i = 0; i < n; i++) {
+        if (out[i]) {
+            entry_touch(container_of(out[i], Entry, node));
+        }
+    }
+}
+
+// the same for any number of keys (MGET, MSET, MDEL)
+static void db_lookup_many(const std::string_view *names, size_t n, size_t step,
+                           std::vector<HNode *> &out)
+{
+    std::vector<LookupKey> keys(n);
+    std::vector<HNode *> pkeys(n);
+    out.resize(n);
+    db_lookup_keys(names, n, step, keys.data(), pkeys.data(), out.data());
+}
+
+// mget key [key ...]
+static void do_mget(std::vector<std::string_view> &cmd, Buffer &out) {
+    std::vector<HNode *> nodes;
+    db_lookup_many(&cmd[1], cmd.size() - 1, 1, nodes);
+    out_arr(out, (uint32_t)nodes.size());
+    for (HNode *node : nodes) {
+        Entry *ent = node ? container_of(node, Entry, node) : NULL;
+        if (ent && ent->type == T_STR) {
+            out_entry_str(out, ent);
+        } else {
+            out_nil(out);   // not a string
+        }
+    }
+}
+
+// the multi-key writes are logged as the single-key commands,
+// so that the replay doesn't depend on the sharding of the keys
+static void aof_append_key(const char *name, std::string_view key, std::string_view *val) {
+    if (!g_data.aof_enabled) {
+        return;
+    }
+    std::vector<std::string_view> rec = {name, key};
+    if (val) {
+        rec.push_back(*val);
+    }
+    aof_append(rec);
+}
+
+// mset key value [key value ...]
+static void do_mset(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 1) {
+        return out_err(out, ERR_BAD_ARG, "wrong number of arguments.");
+    }
+    size_t n = cmd.size() / 2;
+    std::vector<HNode *> nodes;
+    db_lookup_many(&cmd[1], n, 2, nodes);
+    // all or nothing
+    for (HNode *node : nodes) {
+        if (node && container_of(node, Entry, node)->type != T_STR) {
+            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        std::string_view key = cmd[1 + 2 * i], val = cmd[2 + 2 * i];
+        if (nodes[i]) {
+            entry_set_str(container_of(nodes[i], Entry, node), val);
+        } else {
+            // look it up again, the key may be repeated in this command
+            str_set(key, val);
+        }
+        aof_append_key("set", key, &val);
+    }
+    return out_nil(out);
+}
+
+// mdel key [key ...]
+static void do_mdel(std::vector<std::string_view> &cmd, Buffer &out) {
+    size_t n = cmd.size() - 1;
+    std::vector<LookupKey> keys(n);
+    std::vector<HNode *> pkeys(n);
+    std::vector<HNode *> nodes(n);
+    db_lookup_keys(&cmd[1], n, 1, keys.data(), pkeys.data(), nodes.data());  // prefetch
+    int64_t deleted = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!nodes[i]) {
+            continue;
+        }
+        // the key may be repeated: `nodes[i]` may be freed by an earlier
+        // iteration, so delete it by the lookup key, not by the node.
+        HNode *node = hm_delete(&g_reactor->db, &keys[i].node);
+        if (node) {
+            entry_del(container_of(node, Entry, node));
+            aof_append_key("del", keys[i].key, NULL);
+            deleted++;
+        }
+    }
+    return out_int(out, deleted);
+}
+
 static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
     // swap the erased item with the last item
     a[pos] = a.back();
@@ -433,36 +997,111 @@ static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
 
 // set or remove the TTL
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+    if (ttl_ms < 0 && ent->heap_idx != (uint32_t)-1) {
         // setting a negative TTL means removing the TTL
-        heap_delete(g_data.heap, ent->heap_idx);
+        heap_delete(g_reactor->heap, ent->heap_idx);
         ent->heap_idx = -1;
     } else if (ttl_ms >= 0) {
         // add or update the heap data structure
         uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
         HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
+        heap_upsert(g_reactor->heap, ent->heap_idx, item);
+    }
+}
+
+const size_t k_max_evict_samples = 64;
+
+// the victim of the policy, NULL if there is none in this shard
+static Entry *evict_pick(int policy) {
+    if (policy == EVICT_VOLATILE_TTL) {
+        const std::vector<HeapItem> &heap = g_reactor->heap;
+        return heap.empty() ? NULL : container_of(heap[0].ref, Entry, heap_idx);
+    }
+    if (policy != EVICT_ALLKEYS_LRU && policy != EVICT_ALLKEYS_LFU) {
+        return NULL;
+    }
+    // the best of a few random keys approximates the exact order
+    HNode *nodes[k_max_evict_samples];
+    size_t nsamples = (size_t)g_data.maxmemory_samples.load(std::memory_order_relaxed);
+    size_t n = hm_sample(&g_reactor->db, nodes, std::min(nsamples, k_max_evict_samples));
+    Entry *best = NULL;
+    uint32_t best_score = 0;
+    for (size_t i = 0; i < n; i++) {
+        Entry *ent = container_of(nodes[i], Entry, node);
+        uint32_t score = entry_evict_score(ent);
+        if (!best || score > best_score) {
+            best = ent;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// delete keys of this shard until the memory is under the limit.
+// false if it's over the limit and nothing could be evicted.
+static bool evict_for_write() {
+    int64_t limit = g_data.maxmemory.load(std::memory_order_relaxed);
+    if (limit <= 0 || g_data.loading) {
+        return true;
+    }
+    int policy = g_data.maxmemory_policy.load(std::memory_order_relaxed);
+    // bounded per command; the memory of a large zset is freed later by
+    // the thread pool, so this may run short, and the next command goes on.
+    const size_t k_max_evict = 64;
+    size_t nevicted = 0;
+    while (g_used_memory.load(std::memory_order_relaxed) > limit && nevicted < k_max_evict) {
+        Entry *ent = evict_pick(policy);
+        if (!ent) {
+            break;
+        }
+        HNode *node = hm_delete(&g_reactor->db, &ent->node, &hnode_same);
+        assert(node == &ent->node);
+        (void)node;
+        aof_append_key("del", ent->view_key(), NULL);   // for the replay
+        entry_del(ent);
+        nevicted++;
+    }
+    std::atomic<uint64_t> &evicted = g_reactor->evicted_keys;
+    evicted.store(evicted.load(std::memory_order_relaxed) + nevicted, std::memory_order_relaxed);
+    return nevicted > 0 || g_used_memory.load(std::memory_order_relaxed) <= limit;
+}
+
+// the arguments are not NUL-terminated; numbers are short, so copy them
+static bool str2cstr(std::string_view s, char *buf, size_t size) {
+    if (s.size() >= size) {
+        return false;
     }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    return true;
+}
+
+static bool str_ieq(std::string_view s, const char *name) {
+    return strlen(name) == s.size() && strncasecmp(name, s.data(), s.size()) == 0;
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
+static bool str2int(std::string_view s, int64_t &out) {
+    char buf[32];
+    if (!str2cstr(s, buf, sizeof(buf))) {
+        return false;
+    }
     char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
 }
 
 // PEXPIRE key ttl_ms
-static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
+static void do_expire(std::vector<std::string_view> &cmd, Buffer &out) {
     int64_t ttl_ms = 0;
     if (!str2int(cmd[2], ttl_ms)) {
         return out_err(out, ERR_BAD_ARG, "expect int64");
     }
 
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode *node = db_lookup(&key);
     if (node) {
         Entry *ent = container_of(node, Entry, node);
         entry_set_ttl(ent, ttl_ms);
@@ -471,230 +1110,858 @@ static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
 }
 
 // PTTL key
-static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
+static void do_ttl(std::vector<std::string_view> &cmd, Buffer &out) {
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode *node = db_lookup(&key);
     if (!node) {
         return out_int(out, -2);    // not found
     }
 
     Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
+    if (ent->heap_idx == (uint32_t)-1) {
         return out_int(out, -1);    // no TTL
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t expire_at = g_reactor->heap[ent->heap_idx].val;
     uint64_t now_ms = get_monotonic_msec();
     return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
 }
 
 static bool cb_keys(HNode *node, void *arg) {
     Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
+    std::string_view key = container_of(node, Entry, node)->view_key();
     out_str(out, key.data(), key.size());
     return true;
 }
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+static void do_keys(std::vector<std::string_view> &, Buffer &out) {
+    if (g_data.reactors.size() > 1) {
+        return out_err(out, ERR_BAD_ARG, "keys is not supported with multiple reactors");
+    }
+    out_arr(out, (uint32_t)hm_size(&g_reactor->db));
+    hm_foreach(&g_reactor->db, &cb_keys, (void *)&out);
 }
 
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+// one character against a [...] set, `p` is after the '['.
+// ranges like a-z, negated by a leading ^ or !, \ escapes.
+static bool glob_set(std::string_view pat, size_t &p, uint8_t c) {
+    bool neg = p < pat.size() && (pat[p] == '^' || pat[p] == '!');
+    p += neg;
+    bool hit = false;
+    while (p < pat.size() && pat[p] != ']') {
+        if (pat[p] == '\\' && p + 1 < pat.size()) {
+            p++;
+        }
+        uint8_t lo = pat[p++], hi = lo;
+        if (p + 1 < pat.size() && pat[p] == '-' && pat[p + 1] != ']') {
+            p++;
+            if (pat[p] == '\\' && p + 1 < pat.size()) {
+                p++;
+            }
+            hi = pat[p++];
+        }
+        if (lo > hi) {
+            std::swap(lo, hi);
+        }
+        hit = hit || (lo <= c && c <= hi);
+    }
+    p += p < pat.size();    // the ']'
+    return hit != neg;
 }
 
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect float");
+// glob-style matching: * ? [set] and \ escapes.
+// backtracks to the last * only, since a * can absorb any earlier choice.
+static bool glob_match(std::string_view pat, std::string_view str) {
+    size_t p = 0, s = 0;
+    size_t star_p = std::string_view::npos, star_s = 0;
+    while (s < str.size()) {
+        if (p < pat.size() && pat[p] == '*') {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < pat.size()) {
+            size_t next = p + 1;
+            bool ok = true;
+            if (pat[p] == '[') {
+                ok = glob_set(pat, next, str[s]);
+            } else if (pat[p] != '?') {
+                if (pat[p] == '\\' && next < pat.size()) {
+                    p = next++;
+                }
+                ok = pat[p] == str[s];
+            }
+            if (ok) {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if (star_p == std::string_view::npos) {
+            return false;
+        }
+        p = star_p;         // let the * take one more character
+        s = ++star_s;
     }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
+}
 
-    // look up or create the zset
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// the state of a SCAN or ZSCAN call
+struct ScanCtx {
+    Buffer *out = NULL;
+    std::string_view pattern;   // empty for no MATCH
+    int64_t count = 10;         // keys wanted, before the MATCH filter
+    int64_t nvisited = 0;
+    uint32_t nout = 0;          // array items written
+};
 
-    Entry *ent = NULL;
-    if (!hnode) {   // insert a new key
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &ent->node);
-    } else {        // check the existing key
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            return out_err(out, ERR_BAD_TYP, "expect zset");
+// a larger COUNT is clamped, so that a call stays short and its reply small
+const int64_t k_scan_max_count = 1 << 16;
+
+// [MATCH pattern] [COUNT count], starting from cmd[pos]
+static bool scan_parse_opts(std::vector<std::string_view> &cmd, size_t pos, ScanCtx &ctx) {
+    for (; pos + 1 < cmd.size(); pos += 2) {
+        if (str_ieq(cmd[pos], "match")) {
+            ctx.pattern = cmd[pos + 1];
+        } else if (str_ieq(cmd[pos], "count")) {
+            if (!str2int(cmd[pos + 1], ctx.count) || ctx.count < 1) {
+                return false;
+            }
+            ctx.count = std::min(ctx.count, k_scan_max_count);
+        } else {
+            return false;
         }
     }
+    return pos == cmd.size();
+}
 
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+static bool scan_match(ScanCtx &ctx, const char *key, size_t len) {
+    ctx.nvisited++;
+    return ctx.pattern.empty() || glob_match(ctx.pattern, std::string_view(key, len));
 }
 
-static void aof_write_command(Buffer &buf, const std::vector<std::string> &cmd);
-static void aof_flush_and_sync();
+// visit slots until COUNT keys are seen. the number of slots is bounded
+// as well, so a sparse table or a selective MATCH can't stall the loop.
+// `step(cursor)` visits the slots of a cursor and returns the next one.
+template <class Step>
+static uint64_t scan_run(uint64_t cursor, ScanCtx &ctx, Step step) {
+    const int64_t k_calls_per_key = 10;
+    int64_t max_calls = ctx.count > INT64_MAX / k_calls_per_key
+        ? INT64_MAX : ctx.count * k_calls_per_key;
+    do {
+        cursor = step(cursor);
+    } while (cursor != 0 && ctx.nvisited < ctx.count && --max_calls > 0);
+    return cursor;
+}
 
-// 将条目写入AOF重写文件
-static void aof_rewrite_entry(Entry *ent, int fd) {
-    Buffer buf;
-    
-    if (ent->type == T_STR) {
-        // 为字符串类型构建SET命令
-        std::vector<std::string> cmd = {"set", ent->key, ent->str};
-        aof_write_command(buf, cmd);
-        
-        // 如果有TTL，添加PEXPIRE命令
-        if (ent->heap_idx != (size_t)-1) {
-            int64_t ttl = g_data.heap[ent->heap_idx].val - get_monotonic_msec();
-            if (ttl > 0) {
-                std::vector<std::string> expire_cmd = {
-                    "pexpire", 
-                    ent->key, 
-                    std::to_string(ttl)
-                };
-                aof_write_command(buf, expire_cmd);
+static bool scan_parse_cursor(std::string_view s, uint64_t &cursor) {
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0) {
+        return false;
+    }
+    cursor = (uint64_t)val;
+    return true;
+}
+
+// with multiple reactors, the cursor also selects the shard:
+// cursor = slot_cursor * nshards + shard, the shards are scanned in turn.
+static Reactor *scan_owner(std::string_view s) {
+    uint64_t cursor = 0;
+    if (!scan_parse_cursor(s, cursor)) {
+        return NULL;
+    }
+    return g_data.reactors[cursor % g_data.reactors.size()];
+}
+
+static void cb_scan_key(HNode *node, void *arg) {
+    ScanCtx &ctx = *(ScanCtx *)arg;
+    std::string_view key = container_of(node, Entry, node)->view_key();
+    if (scan_match(ctx, key.data(), key.size())) {
+        out_str(*ctx.out, key.data(), key.size());
+        ctx.nout++;
+    }
+}
+
+// scan cursor [MATCH pattern] [COUNT count]
+// returns [next_cursor, [key ...]], the next cursor is 0 at the end.
+static void do_scan(std::vector<std::string_view> &cmd, Buffer &out) {
+    ScanCtx ctx;
+    ctx.out = &out;
+    uint64_t cursor = 0;
+    if (!scan_parse_cursor(cmd[1], cursor)) {
+        return out_err(out, ERR_BAD_ARG, "invalid cursor");
+    }
+    if (!scan_parse_opts(cmd, 2, ctx)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    uint64_t nshards = g_data.reactors.size();
+    uint64_t shard = cursor % nshards;
+    assert(g_data.reactors[shard] == g_reactor);    // routed by scan_owner()
+
+    out_arr(out, 2);
+    size_t cursor_pos = out.size();
+    out_int(out, 0);    // filled below
+    size_t arr = out_begin_arr(out);
+    cursor = scan_run(cursor / nshards, ctx, [&](uint64_t cursor) {
+        return hm_scan(&g_reactor->db, cursor, &cb_scan_key, &ctx);
+    });
+    out_end_arr(out, arr, ctx.nout);
+
+    // this shard is done, continue with the next one
+    if (cursor == 0) {
+        cursor = shard + 1 < nshards ? shard + 1 : 0;
+    } else {
+        cursor = cursor * nshards + shard;
+    }
+    out_set_int(out, cursor_pos, (int64_t)cursor);
+}
+
+static bool str2dbl(std::string_view s, double &out) {
+    char buf[64];
+    if (!str2cstr(s, buf, sizeof(buf))) {
+        return false;
+    }
+    char *endp = NULL;
+    out = strtod(buf, &endp);
+    return endp == buf + s.size() && !isnan(out);
+}
+
+// look up a string entry for a counter, or create one holding the int 0.
+// NULL if the key holds another type.
+static Entry *counter_lookup_or_create(std::string_view name) {
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    if (node) {
+        Entry *ent = container_of(node, Entry, node);
+        return ent->type == T_STR ? ent : NULL;
+    }
+    Entry *ent = entry_new(T_STR, key.key, key.node.hcode);
+    entry_set_int(ent, 0);
+    hm_insert(&g_reactor->db, &ent->node);
+    return ent;
+}
+
+static void counter_incr(std::string_view name, int64_t delta, Buffer &out) {
+    Entry *ent = counter_lookup_or_create(name);
+    if (!ent) {
+        return out_err(out, ERR_BAD_TYP, "expect string");
+    }
+    int64_t val = 0;
+    char buf[k_int_str_size];
+    if (ent->enc == ENC_INT) {
+        val = ent->ival;
+    } else if (!str2int_exact(entry_str(ent, buf), val)) {
+        return out_err(out, ERR_BAD_ARG, "value is not an integer or out of range");
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    entry_set_int(ent, val);
+    return out_int(out, val);
+}
+
+// incr key / decr key
+static void do_incr(std::vector<std::string_view> &cmd, Buffer &out) {
+    return counter_incr(cmd[1], 1, out);
+}
+
+static void do_decr(std::vector<std::string_view> &cmd, Buffer &out) {
+    return counter_incr(cmd[1], -1, out);
+}
+
+// incrby key delta / decrby key delta
+static void do_incrby(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int_exact(cmd[2], delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    return counter_incr(cmd[1], delta, out);
+}
+
+static void do_decrby(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int_exact(cmd[2], delta) || delta == INT64_MIN) {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    return counter_incr(cmd[1], -delta, out);
+}
+
+// the shortest of %.15g .. %.17g that reads back as the same double
+static std::string_view dbl2str(double val, char *buf, size_t size) {
+    int n = 0;
+    for (int prec = 15; prec <= 17; prec++) {
+        n = snprintf(buf, size, "%.*g", prec, val);
+        if (strtod(buf, NULL) == val) {
+            break;
+        }
+    }
+    return std::string_view(buf, (size_t)n);
+}
+
+// incrbyfloat key delta
+// the result is stored as a string, and logged to the AOF as a SET of it,
+// so that the replay doesn't depend on the float formatting.
+static void do_incrbyfloat(std::vector<std::string_view> &cmd, Buffer &out) {
+    double delta = 0;
+    if (!str2dbl(cmd[2], delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    double val = 0;
+    if (ent) {
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_BAD_TYP, "expect string");
+        }
+        char buf[k_int_str_size];
+        if (ent->enc == ENC_INT) {
+            val = (double)ent->ival;
+        } else if (!str2dbl(entry_str(ent, buf), val)) {
+            return out_err(out, ERR_BAD_ARG, "value is not a valid float");
+        }
+    }
+    val += delta;
+    if (isnan(val) || isinf(val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+    }
+
+    char buf[32];
+    std::string_view res = dbl2str(val, buf, sizeof(buf));
+    if (ent) {
+        entry_set_str(ent, res);
+    } else {
+        ent = entry_new_str(key.key, key.node.hcode, res);
+        hm_insert(&g_reactor->db, &ent->node);
+    }
+    aof_append_key("set", key.key, &res);
+    return out_str(out, res.data(), res.size());
+}
+
+// look up or create the zset, NULL if the key holds another type
+static ZSet *zset_lookup_or_create(std::string_view name) {
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+
+    Entry *ent = NULL;
+    if (!hnode) {   // insert a new key
+        ent = entry_new(T_ZSET, key.key, key.node.hcode);
+        hm_insert(&g_reactor->db, &ent->node);
+    } else {        // check the existing key
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_ZSET) {
+            return NULL;
+        }
+    }
+    return ent->zset;
+}
+
+static ZSet *expect_zset(std::string_view s);
+
+// zadd flags
+enum {
+    ZADD_NX     = 1 << 0,   // only add new members
+    ZADD_XX     = 1 << 1,   // only update the existing members
+    ZADD_GT     = 1 << 2,   // only update to a greater score
+    ZADD_LT     = 1 << 3,   // only update to a lesser score
+    ZADD_CH     = 1 << 4,   // count the updated members as well
+    ZADD_INCR   = 1 << 5,   // add to the score, like ZINCRBY
+};
+
+static uint32_t zadd_flag(std::string_view s) {
+    static const struct { const char *name; uint32_t flag; } k_flags[] = {
+        {"nx", ZADD_NX}, {"xx", ZADD_XX}, {"gt", ZADD_GT}, {"lt", ZADD_LT},
+        {"ch", ZADD_CH}, {"incr", ZADD_INCR},
+    };
+    for (const auto &f : k_flags) {
+        if (str_ieq(s, f.name)) {
+            return f.flag;
+        }
+    }
+    return 0;
+}
+
+// a pair of the command, the name points into the request
+struct ZAddPair {
+    double score = 0;
+    std::string_view name;
+};
+
+// by (score, name), the order of a zset
+static bool zmember_less(const ZMember &a, const ZMember &b) {
+    if (a.score != b.score) {
+        return a.score < b.score;
+    }
+    return std::string_view(a.name, a.len) < std::string_view(b.name, b.len);
+}
+
+// into an empty zset: each name once, then sorted for the O(n) build
+// rather than n inserts. a repeated name is an update of the same
+// command, like in the one-by-one path.
+static int64_t zadd_load(ZSet *zset, std::vector<ZAddPair> &pairs, uint32_t flags) {
+    std::stable_sort(pairs.begin(), pairs.end(), [](const ZAddPair &a, const ZAddPair &b) {
+        return a.name < b.name;
+    });
+    std::vector<ZMember> members;
+    int64_t updated = 0;
+    for (size_t i = 0; i < pairs.size(); ) {
+        double score = pairs[i].score;
+        size_t j = i + 1;
+        for (; j < pairs.size() && pairs[j].name == pairs[i].name; j++) {
+            if (!(flags & ZADD_NX) && pairs[j].score != score) {
+                score = pairs[j].score;
+                updated++;
             }
         }
-        
-        // 写入文件
-        uint8_t *data = NULL;
-        size_t data_size;
-        buf.get_continuous_data(0, &data, &data_size);
-        if (data && data_size > 0) {
-            write(fd, data, data_size);
+        members.push_back(ZMember{score, pairs[i].name.data(), pairs[i].name.size()});
+        i = j;
+    }
+    std::sort(members.begin(), members.end(), &zmember_less);
+    zset_clear(zset);   // may keep the tree of the removed members
+    zset_load(zset, members.data(), members.size());
+    int64_t added = (int64_t)members.size();
+    return (flags & ZADD_CH) ? added + updated : added;
+}
+
+// the outcome of a pair
+enum {
+    ZADD_SKIPPED,   // by the flags
+    ZADD_SAME,      // the same score
+    ZADD_UPDATED,
+    ZADD_ADDED,
+};
+
+// 1 pair, `score` is the resulting score
+static int zadd_one(ZSet *zset, const ZAddPair &p, uint32_t flags, double &score) {
+    std::string_view name = p.name;
+    double old = 0;
+    bool exists = zset_lookup(zset, name.data(), name.size(), &old);
+    score = (exists && (flags & ZADD_INCR)) ? old + p.score : p.score;
+    if ((exists && (flags & ZADD_NX)) || (!exists && (flags & ZADD_XX))) {
+        return ZADD_SKIPPED;
+    }
+    if (!exists) {
+        zset_insert(zset, name.data(), name.size(), score);
+        return ZADD_ADDED;
+    }
+    if (((flags & ZADD_GT) && !(score > old)) || ((flags & ZADD_LT) && !(score < old))) {
+        return ZADD_SKIPPED;
+    }
+    if (score == old) {
+        return ZADD_SAME;
+    }
+    zset_insert(zset, name.data(), name.size(), score);
+    return ZADD_UPDATED;
+}
+
+// zadd zset [NX|XX] [GT|LT] [CH] [INCR] score name [score name ...]
+static void do_zadd(std::vector<std::string_view> &cmd, Buffer &out) {
+    size_t pos = 2;
+    uint32_t flags = 0;
+    for (; pos < cmd.size(); pos++) {
+        uint32_t f = zadd_flag(cmd[pos]);
+        if (!f) {
+            break;
+        }
+        flags |= f;
+    }
+    size_t npairs = (cmd.size() - pos) / 2;
+    if (npairs == 0 || (cmd.size() - pos) % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    if ((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT))) {
+        return out_err(out, ERR_BAD_ARG, "NX is not compatible with XX, GT or LT");
+    }
+    if ((flags & ZADD_GT) && (flags & ZADD_LT)) {
+        return out_err(out, ERR_BAD_ARG, "GT and LT are not compatible");
+    }
+    if ((flags & ZADD_INCR) && npairs != 1) {
+        return out_err(out, ERR_BAD_ARG, "INCR supports a single score-name pair");
+    }
+    // all or nothing
+    std::vector<ZAddPair> pairs(npairs);
+    for (size_t i = 0; i < npairs; i++) {
+        if (!str2dbl(cmd[pos + 2 * i], pairs[i].score)) {
+            return out_err(out, ERR_BAD_ARG, "expect float");
+        }
+        pairs[i].name = cmd[pos + 2 * i + 1];
+    }
+
+    // XX adds nothing, so a missing key is left alone
+    ZSet *zset = (flags & ZADD_XX) ? expect_zset(cmd[1]) : zset_lookup_or_create(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    if (flags & ZADD_INCR) {
+        const ZAddPair &p = pairs[0];
+        double old = 0;
+        if (zset_lookup(zset, p.name.data(), p.name.size(), &old) && isnan(old + p.score)) {
+            return out_err(out, ERR_BAD_ARG, "resulting score is not a number (NaN)");
+        }
+        double score = 0;
+        int rv = zadd_one(zset, p, flags, score);
+        return rv == ZADD_SKIPPED ? out_nil(out) : out_dbl(out, score);
+    }
+    if (zset_size(zset) == 0 && !(flags & (ZADD_XX | ZADD_GT | ZADD_LT))) {
+        return out_int(out, zadd_load(zset, pairs, flags));
+    }
+    int64_t added = 0, changed = 0;
+    for (const ZAddPair &p : pairs) {
+        double score = 0;
+        int rv = zadd_one(zset, p, flags, score);
+        added += rv == ZADD_ADDED;
+        changed += rv >= ZADD_UPDATED;
+    }
+    return out_int(out, (flags & ZADD_CH) ? changed : added);
+}
+
+// zload zset score name [score name ...]
+// bulk load with 8-byte binary scores, emitted by the AOF rewrite so that
+// the scores round-trip exactly.
+static void do_zload(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "wrong number of arguments.");
+    }
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        if (cmd[i].size() != sizeof(double)) {
+            return out_err(out, ERR_BAD_ARG, "expect binary double");
+        }
+    }
+
+    ZSet *zset = zset_lookup_or_create(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        double score = 0;
+        memcpy(&score, cmd[i].data(), sizeof(score));
+        std::string_view name = cmd[i + 1];
+        added += zset_insert(zset, name.data(), name.size(), score);
+    }
+    return out_int(out, added);
+}
+
+static void aof_write_command(Buffer &buf, const std::vector<std::string_view> &cmd);
+static void child_poll();
+static void reactors_pause();
+static void reactors_resume();
+static void aof_flush();
+static void aof_flush_locked();
+
+// 把整个缓冲区写入文件（阻塞）
+static bool buf_write_all(int fd, Buffer &buf) {
+    while (!buf.empty()) {
+        struct iovec iov[2];
+        int iovcnt = buf.get_iovecs(iov, 2);
+        ssize_t rv = writev(fd, iov, iovcnt);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return false;
         }
+        buf.consume((size_t)rv);
+    }
+    return true;
+}
+
+// 后台子进程的输出：记录先累积到一个大缓冲区，再按块写入文件
+struct RewriteCtx {
+    int fd = -1;
+    int progress_fd = -1;           // -1 表示不报告进度（SAVE）
+    uint64_t processed = 0;
+    bool failed = false;
+    int64_t clock_delta = 0;        // 墙上时钟减去单调时钟，用于换算过期时间
+    Buffer buf{k_rewrite_chunk + (1 << 20)};
+    std::vector<ZMember> batch;     // 当前 zload 记录的成员
+};
+
+static void rewrite_flush(RewriteCtx *ctx, bool force) {
+    if (ctx->failed || (!force && ctx->buf.size() < k_rewrite_chunk)) {
+        return;
+    }
+    if (!buf_write_all(ctx->fd, ctx->buf)) {
+        ctx->failed = true;
+    }
+}
+
+static void rewrite_str(Buffer &buf, const void *data, size_t len) {
+    buf_append_u32(buf, (uint32_t)len);
+    buf_append(buf, (const uint8_t *)data, len);
+}
+
+// 每处理 k_progress_step 个键，通过管道向父进程报告一次进度
+static void rewrite_progress(RewriteCtx *ctx) {
+    const uint64_t k_progress_step = 1024;
+    if (++ctx->processed % k_progress_step == 0 && ctx->progress_fd >= 0) {
+        // 管道是非阻塞的，写满时丢弃这次报告即可
+        (void)write(ctx->progress_fd, &ctx->processed, sizeof(ctx->processed));
+    }
+}
+
+// 快照（RDB）格式，小端序：
+//   "BYORDB01" | u64 键数 | i64 保存时间
+//   每种类型一节：u8 类型 | u64 键数 | 条目 ...
+//     字符串：  i64 过期时间 | u32 长度 | key | u32 长度 | value
+//     有序集合：i64 过期时间 | u32 长度 | key | u64 成员数 | 成员 ...
+//     成员：    f64 分数 | u32 长度 | name，按 (分数, 名字) 排序
+//   u8 0xFF 结束
+// 时间为墙上时钟的毫秒数，过期时间为 -1 表示没有 TTL
+const char k_rdb_magic[] = "BYORDB01";
+const size_t k_rdb_magic_len = 8;
+const uint8_t k_rdb_eof = 0xFF;
+
+static void rdb_write_entry(Entry *ent, RewriteCtx *ctx) {
+    Buffer &buf = ctx->buf;
+    int64_t expire_at = -1;
+    if (ent->heap_idx != (uint32_t)-1) {
+        expire_at = (int64_t)g_reactor->heap[ent->heap_idx].val + ctx->clock_delta;
+    }
+    buf_append_i64(buf, expire_at);
+    rewrite_str(buf, ent->key, ent->klen);
+    if (ent->type == T_STR) {
+        char ibuf[k_int_str_size];
+        std::string_view val = entry_str(ent, ibuf);
+        rewrite_str(buf, val.data(), val.size());
     } else if (ent->type == T_ZSET) {
-        // 为有序集合构建ZADD命令
-        ZSet *zset = &ent->zset;
-        std::string key = ent->key; // 在外部保存key，避免在Lambda中访问可能无效的ent
-        
-        // 遍历有序集合的所有成员
-        struct ForeachData {
-            int fd;
-            std::string key;
-        };
-        
-        ForeachData foreach_data = {fd, key};
-        
-        hm_foreach(&zset->hmap, [](HNode *node, void *arg) {
-            auto *data = static_cast<ForeachData*>(arg);
-            ZNode *znode = container_of(node, ZNode, hmap);
-            
-            // 安全检查
-            if (!znode || znode->len == 0) {
-                return true; // 跳过无效的节点
+        buf_append_i64(buf, (int64_t)zset_size(ent->zset));
+        zset_foreach(ent->zset, [](const ZMember *m, void *arg) {
+            RewriteCtx *ctx = (RewriteCtx *)arg;
+            buf_append_dbl(ctx->buf, m->score);
+            rewrite_str(ctx->buf, m->name, m->len);
+            rewrite_flush(ctx, false);
+            return !ctx->failed;
+        }, ctx);
+    }
+    rewrite_flush(ctx, false);
+}
+
+// 遍历所有分片的键，其他 reactor 已暂停（或在子进程中不存在）。
+// 回调期间 g_reactor 是键的所属 reactor，以便读取它的 TTL 堆。
+static void db_foreach_shards(bool (*f)(HNode *, void *), void *arg) {
+    Reactor *self = g_reactor;
+    for (Reactor *r : g_data.reactors) {
+        g_reactor = r;
+        hm_foreach(&r->db, f, arg);
+    }
+    g_reactor = self;
+}
+
+static size_t db_size_shards() {
+    size_t n = 0;
+    for (Reactor *r : g_data.reactors) {
+        n += hm_size(&r->db);
+    }
+    return n;
+}
+
+// 写出所有 reactor 键空间的快照
+static void rdb_write(RewriteCtx *ctx) {
+    // 先统计每种类型的键数，作为各节的头部
+    uint64_t counts[T_ZSET + 1] = {};
+    db_foreach_shards([](HNode *node, void *arg) {
+        Entry *ent = container_of(node, Entry, node);
+        ((uint64_t *)arg)[ent->type]++;
+        return true;
+    }, counts);
+
+    Buffer &buf = ctx->buf;
+    ctx->clock_delta = get_wall_msec() - (int64_t)get_monotonic_msec();
+    buf_append(buf, (const uint8_t *)k_rdb_magic, k_rdb_magic_len);
+    buf_append_i64(buf, (int64_t)(counts[T_STR] + counts[T_ZSET]));
+    buf_append_i64(buf, get_wall_msec());
+
+    struct Section {
+        RewriteCtx *ctx;
+        uint32_t type;
+    };
+    for (uint32_t type : {T_STR, T_ZSET}) {
+        buf_append_u8(buf, (uint8_t)type);
+        buf_append_i64(buf, (int64_t)counts[type]);
+        Section sec = {ctx, type};
+        db_foreach_shards([](HNode *node, void *arg) {
+            Section *sec = (Section *)arg;
+            Entry *ent = container_of(node, Entry, node);
+            if (ent->type == sec->type) {
+                rdb_write_entry(ent, sec->ctx);
+                rewrite_progress(sec->ctx);
             }
-            
-            Buffer cmd_buf;
-            
-            // 安全地创建ZADD命令，确保使用正确的字符串长度
-            std::string name(znode->name, znode->len);
-            std::vector<std::string> cmd = {
-                "zadd", 
-                data->key,
-                std::to_string(znode->score),
-                name
-            };
-            
-            aof_write_command(cmd_buf, cmd);
-            
-            // 写入文件
-            uint8_t *buf_data = NULL;
-            size_t data_size;
-            cmd_buf.get_continuous_data(0, &buf_data, &data_size);
-            if (buf_data && data_size > 0) {
-                write(data->fd, buf_data, data_size);
+            return !sec->ctx->failed;
+        }, &sec);
+    }
+    buf_append_u8(buf, k_rdb_eof);
+}
+
+// 写入快照文件：先写临时文件并落盘，再原子地 rename。
+// SAVE 在事件循环中直接调用，BGSAVE 在子进程中调用。
+static int32_t rdb_save(int progress_fd) {
+    std::string tmp = g_data.rdb_filename + ".temp";
+    RewriteCtx ctx;
+    ctx.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ctx.fd < 0) {
+        msg_errno("snapshot open() error");
+        return -1;
+    }
+    ctx.progress_fd = progress_fd;
+    rdb_write(&ctx);
+    rewrite_flush(&ctx, true);
+
+    int32_t rv = 0;
+    if (ctx.failed || fsync(ctx.fd) < 0) {
+        msg_errno("snapshot write() error");
+        rv = -1;
+    }
+    close(ctx.fd);
+    if (rv == 0 && rename(tmp.c_str(), g_data.rdb_filename.c_str()) < 0) {
+        msg_errno("snapshot rename() error");
+        rv = -1;
+    }
+    if (rv < 0) {
+        unlink(tmp.c_str());
+    }
+    return rv;
+}
+
+// 一条 zload 记录包含一批成员，分数为8字节二进制
+static void rewrite_zload(RewriteCtx *ctx, std::string_view key) {
+    Buffer &buf = ctx->buf;
+    buf_append_u32(buf, (uint32_t)(2 + 2 * ctx->batch.size()));
+    rewrite_str(buf, "zload", 5);
+    rewrite_str(buf, key.data(), key.size());
+    for (const ZMember &m : ctx->batch) {
+        buf_append_u32(buf, sizeof(double));
+        buf_append_dbl(buf, m.score);
+        rewrite_str(buf, m.name, m.len);
+    }
+    ctx->batch.clear();
+    rewrite_flush(ctx, false);
+}
+
+// 将条目写入AOF重写文件
+static void aof_rewrite_entry(Entry *ent, RewriteCtx *ctx) {
+    Buffer &buf = ctx->buf;
+    if (ent->type == T_STR) {
+        // 为字符串类型构建SET命令
+        buf_append_u32(buf, 3);
+        rewrite_str(buf, "set", 3);
+        rewrite_str(buf, ent->key, ent->klen);
+        char ibuf[k_int_str_size];
+        std::string_view val = entry_str(ent, ibuf);
+        rewrite_str(buf, val.data(), val.size());
+    } else if (ent->type == T_ZSET) {
+        // 按分数顺序遍历有序集合，每 k_zload_batch 个成员一条记录
+        struct ZCtx {
+            RewriteCtx *ctx;
+            std::string_view key;
+        };
+        ZCtx zctx = {ctx, ent->view_key()};
+        zset_foreach(ent->zset, [](const ZMember *m, void *arg) {
+            ZCtx *zctx = (ZCtx *)arg;
+            zctx->ctx->batch.push_back(*m);
+            if (zctx->ctx->batch.size() == k_zload_batch) {
+                rewrite_zload(zctx->ctx, zctx->key);
             }
-            
             return true;
-        }, &foreach_data);
-        
-        // 如果有TTL，添加PEXPIRE命令
-        if (ent->heap_idx != (size_t)-1) {
-            Buffer ttl_buf;
-            int64_t ttl = g_data.heap[ent->heap_idx].val - get_monotonic_msec();
-            if (ttl > 0) {
-                std::vector<std::string> expire_cmd = {
-                    "pexpire", 
-                    key,  // 使用保存的key
-                    std::to_string(ttl)
-                };
-                aof_write_command(ttl_buf, expire_cmd);
-                
-                // 写入文件
-                uint8_t *data = NULL;
-                size_t data_size;
-                ttl_buf.get_continuous_data(0, &data, &data_size);
-                if (data && data_size > 0) {
-                    write(fd, data, data_size);
-                }
-            }
+        }, &zctx);
+        if (!ctx->batch.empty()) {
+            rewrite_zload(ctx, ent->view_key());
+        }
+    }
+
+    // 如果有TTL，添加PEXPIRE命令
+    if (ent->heap_idx != (uint32_t)-1) {
+        int64_t ttl = g_reactor->heap[ent->heap_idx].val - get_monotonic_msec();
+        if (ttl > 0) {
+            std::string ttl_str = std::to_string(ttl);
+            buf_append_u32(buf, 3);
+            rewrite_str(buf, "pexpire", 7);
+            rewrite_str(buf, ent->key, ent->klen);
+            rewrite_str(buf, ttl_str.data(), ttl_str.size());
         }
     }
+    rewrite_flush(ctx, false);
 }
 
-// 执行AOF重写
-static int32_t aof_rewrite_do() {
-    if (!g_data.aof_rewriting || g_data.aof_rewrite_fd < 0) {
+// 执行AOF重写（在子进程中）：遍历 fork 时的快照，写入临时文件。
+// 默认以二进制快照开头，父进程随后追加差异缓冲区中的命令。
+static int32_t aof_rewrite_do(int progress_fd) {
+    msg("Rewriting AOF file...");
+
+    RewriteCtx ctx;
+    ctx.fd = g_data.aof_rewrite_fd;
+    ctx.progress_fd = progress_fd;
+    if (g_data.aof_rdb_preamble) {
+        rdb_write(&ctx);
+    } else {
+        db_foreach_shards([](HNode *node, void *arg) {
+            RewriteCtx *ctx = (RewriteCtx *)arg;
+            Entry *ent = container_of(node, Entry, node);
+            // 写入条目到AOF重写文件
+            aof_rewrite_entry(ent, ctx);
+            rewrite_progress(ctx);
+            return !ctx->failed;
+        }, &ctx);
+    }
+
+    rewrite_flush(&ctx, true);
+    if (ctx.failed) {
+        msg_errno("AOF rewrite write() error");
         return -1;
     }
-    
-    msg("Rewriting AOF file...");
-    
-    // 遍历数据库中的所有条目
-    size_t total_entries = hm_size(&g_data.db);
-    size_t processed = 0;
-    
-    hm_foreach(&g_data.db, [](HNode *node, void *arg) {
-        Entry *ent = container_of(node, Entry, node);
-        int fd = g_data.aof_rewrite_fd;
-        
-        // 写入条目到AOF重写文件
-        aof_rewrite_entry(ent, fd);
-        
-        return true;
-    }, nullptr);
-    
-    fsync(g_data.aof_rewrite_fd);
-    return 0;
+    return fsync(ctx.fd) == 0 ? 0 : -1;
+}
+
+// 放弃这次重写：删除临时文件，丢弃差异缓冲区
+static void aof_rewrite_abort() {
+    pthread_mutex_lock(&g_data.aof_mu);
+    g_data.aof_rewriting = false;
+    g_data.aof_rewrite_buf.consume(g_data.aof_rewrite_buf.size());
+    pthread_mutex_unlock(&g_data.aof_mu);
+    close(g_data.aof_rewrite_fd);
+    g_data.aof_rewrite_fd = -1;
+    unlink(g_data.aof_rewrite_filename.c_str());
 }
 
-// 完成AOF重写
+// 完成AOF重写：子进程成功退出后，在父进程中执行
 static void aof_rewrite_finish() {
-    if (!g_data.aof_rewriting) {
-        return;
-    }
-    
     msg("Finishing AOF rewrite...");
-    
-    // 关闭临时文件
-    if (g_data.aof_rewrite_fd >= 0) {
-        close(g_data.aof_rewrite_fd);
-        g_data.aof_rewrite_fd = -1;
+
+    // 持有 aof_mu，期间不会有新的命令写入两个缓冲区；
+    // fsync 线程也通过 aof_mu 读取 aof_fd
+    pthread_mutex_lock(&g_data.aof_mu);
+    // 确保AOF缓冲区已写入旧文件
+    aof_flush_locked();
+    // 追加 fork 之后的命令（差异缓冲区）
+    int fd = g_data.aof_rewrite_fd;
+    if (!buf_write_all(fd, g_data.aof_rewrite_buf) || fsync(fd) < 0) {
+        msg_errno("AOF rewrite write() error");
+        pthread_mutex_unlock(&g_data.aof_mu);
+        return aof_rewrite_abort();
     }
-    
-    // 确保AOF缓冲区已刷新
-    aof_flush_and_sync();
-    
     // 使用临时文件替换原AOF文件
     if (rename(g_data.aof_rewrite_filename.c_str(), g_data.aof_filename.c_str()) < 0) {
         msg_errno("rename() error during AOF rewrite");
-        unlink(g_data.aof_rewrite_filename.c_str());
-        g_data.aof_rewriting = false;
-        return;
+        pthread_mutex_unlock(&g_data.aof_mu);
+        return aof_rewrite_abort();
     }
-    
-    // 重新打开新的AOF文件
+    // 关闭临时文件，重新打开新的AOF文件
+    close(fd);
+    g_data.aof_rewrite_fd = -1;
     close(g_data.aof_fd);
     g_data.aof_fd = open(g_data.aof_filename.c_str(), O_WRONLY | O_APPEND, 0644);
     if (g_data.aof_fd < 0) {
@@ -703,183 +1970,1207 @@ static void aof_rewrite_finish() {
     } else {
         fd_set_nb(g_data.aof_fd);
     }
-    
+    g_data.aof_gen++;
     g_data.aof_rewriting = false;
+    pthread_mutex_unlock(&g_data.aof_mu);
+
     msg("AOF rewrite completed");
 }
 
-static int32_t aof_rewrite() {
-    if (g_data.aof_rewriting) {
-        return -1; // 重写已经在进行中
+static void rdb_bgsave_done(bool ok) {
+    if (ok) {
+        msg("Background saving completed");
+    } else {
+        msg("Background saving failed");
+        unlink((g_data.rdb_filename + ".temp").c_str());
     }
-    msg("AOF rewrite started");
-    g_data.aof_rewriting = true;
-    g_data.aof_rewrite_progress = 0;
-    g_data.aof_rewrite_filename = g_data.aof_filename + ".temp";
-    // 创建临时AOF文件
-    g_data.aof_rewrite_fd = open(g_data.aof_rewrite_filename.c_str(), 
-                                O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (g_data.aof_rewrite_fd < 0) {
-        msg_errno("AOF rewrite open() error");
-        g_data.aof_rewriting = false;
-        return -1;
+}
+
+// 父进程：读取子进程的进度，子进程退出后完成或放弃它的工作。
+// 由定时器调用，见 next_timer_ms()。
+static void child_poll() {
+    uint64_t now_ms = get_monotonic_msec();
+    if (g_data.child_pid < 0 || now_ms < g_data.child_poll_ms) {
+        return;
+    }
+    const uint64_t k_child_poll_ms = 100;
+    g_data.child_poll_ms = now_ms + k_child_poll_ms;
+
+    uint64_t processed = 0;
+    while (read(g_data.child_progress_fd, &processed, sizeof(processed)) == sizeof(processed)) {
+        g_data.child_progress = (size_t)processed;
+    }
+    int status = 0;
+    pid_t rv = waitpid(g_data.child_pid, &status, WNOHANG);
+    if (rv == 0) {
+        return;     // 仍在运行
+    }
+    close(g_data.child_progress_fd);
+    g_data.child_progress_fd = -1;
+    g_data.child_pid = -1;
+    int type = g_data.child_type;
+    g_data.child_type = CHILD_NONE;
+
+    bool ok = rv > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (ok) {
+        g_data.child_progress = g_data.child_total;
+    }
+    if (type == CHILD_AOF && ok) {
+        aof_rewrite_finish();
+    } else if (type == CHILD_AOF) {
+        msg("AOF rewrite child failed");
+        aof_rewrite_abort();
+    } else if (type == CHILD_RDB) {
+        rdb_bgsave_done(ok);
+    }
+}
+
+// fork 一个子进程处理写时复制的快照，父进程继续服务。
+// 子进程执行 work() 后退出，通过非阻塞管道报告进度。
+// 调用者已暂停其他 reactor，子进程看到的各分片是一致的。
+static int32_t child_start(int type, int32_t (*work)(int progress_fd)) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        msg_errno("pipe2() error");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        msg_errno("fork() error");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // 子进程：只使用 fork 时的内存快照，不返回事件循环
+        close(pipefd[0]);
+        int32_t rv = work(pipefd[1]);
+        _exit(rv == 0 ? 0 : 1);
+    }
+    close(pipefd[1]);
+    g_data.child_type = type;
+    g_data.child_pid = pid;
+    g_data.child_progress_fd = pipefd[0];
+    g_data.child_progress = 0;
+    g_data.child_total = db_size_shards();
+    return 0;
+}
+
+// 重写期间的新命令同时记录到差异缓冲区
+static int32_t aof_rewrite() {
+    if (g_data.child_pid >= 0) {
+        return -1; // 已经有子进程在运行
+    }
+    msg("AOF rewrite started");
+    g_data.aof_rewrite_filename = g_data.aof_filename + ".temp";
+    // 创建临时AOF文件
+    g_data.aof_rewrite_fd = open(g_data.aof_rewrite_filename.c_str(),
+                                O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (g_data.aof_rewrite_fd < 0) {
+        msg_errno("AOF rewrite open() error");
+        return -1;
+    }
+
+    // 暂停其他 reactor：暂停前的命令在快照中，之后的命令进入差异缓冲区
+    reactors_pause();
+    pthread_mutex_lock(&g_data.aof_mu);
+    g_data.aof_rewriting = true;
+    pthread_mutex_unlock(&g_data.aof_mu);
+
+    int32_t rv = child_start(CHILD_AOF, &aof_rewrite_do);
+    reactors_resume();
+    if (rv < 0) {
+        aof_rewrite_abort();
+        return -1;
+    }
+    return 0;
+}
+
+
+static void do_aof_rewrite(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (!g_data.aof_enabled) {
+        return out_err(out, ERR_BAD_ARG, "AOF is not enabled");
+    }
+    
+    if (g_data.aof_rewriting) {
+        return out_err(out, ERR_BAD_ARG, "AOF rewrite already in progress");
+    }
+    if (g_data.child_pid >= 0) {
+        return out_err(out, ERR_BAD_ARG, "background saving in progress");
+    }
+    
+    int32_t rv = aof_rewrite();
+    if (rv < 0) {
+        return out_err(out, ERR_UNKNOWN, "AOF rewrite failed");
+    }
+    
+    return out_int(out, 1);
+}
+
+// save: write the snapshot, blocking all the event loops
+static void do_save(std::vector<std::string_view> &, Buffer &out) {
+    if (g_data.child_pid >= 0) {
+        return out_err(out, ERR_BAD_ARG, "a background child is running");
+    }
+    reactors_pause();
+    int32_t rv = rdb_save(-1);
+    reactors_resume();
+    if (rv < 0) {
+        return out_err(out, ERR_UNKNOWN, "SAVE failed");
+    }
+    return out_int(out, 1);
+}
+
+// bgsave: write the snapshot in a forked child
+static void do_bgsave(std::vector<std::string_view> &, Buffer &out) {
+    if (g_data.child_pid >= 0) {
+        return out_err(out, ERR_BAD_ARG, "a background child is running");
+    }
+    msg("Background saving started");
+    reactors_pause();
+    int32_t rv = child_start(CHILD_RDB, &rdb_save);
+    reactors_resume();
+    if (rv < 0) {
+        return out_err(out, ERR_UNKNOWN, "BGSAVE failed");
+    }
+    return out_int(out, 1);
+}
+
+// the runtime parameters, shared by the reactors
+struct ConfigParam {
+    const char *name;
+    int64_t min;
+    int64_t max;
+    const char *const *names;   // an enum's value names, NULL for ints
+    int64_t (*get)();
+    void (*set)(int64_t val);
+};
+
+// indexed by EVICT_*
+static const char *const k_policy_names[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl", NULL,
+};
+
+// indexed by ZINDEX_*
+static const char *const k_zindex_names[] = {"avl", "btree", NULL};
+
+static const ConfigParam k_config_params[] = {
+    // keys moved per hashtable operation while resizing
+    {"rehash-work", 1, INT64_MAX, NULL,
+        []() { return (int64_t)hm_rehash_work(); },
+        [](int64_t val) { hm_set_rehash_work((size_t)val); }},
+    // the memory limit in bytes, 0 for none
+    {"maxmemory", 0, INT64_MAX, NULL,
+        []() { return g_data.maxmemory.load(std::memory_order_relaxed); },
+        [](int64_t val) { g_data.maxmemory.store(val, std::memory_order_relaxed); }},
+    {"maxmemory-policy", EVICT_NONE, EVICT_VOLATILE_TTL, k_policy_names,
+        []() { return (int64_t)g_data.maxmemory_policy.load(std::memory_order_relaxed); },
+        [](int64_t val) { g_data.maxmemory_policy.store((int)val, std::memory_order_relaxed); }},
+    // keys sampled for each LRU or LFU eviction
+    {"maxmemory-samples", 1, (int64_t)k_max_evict_samples, NULL,
+        []() { return g_data.maxmemory_samples.load(std::memory_order_relaxed); },
+        [](int64_t val) { g_data.maxmemory_samples.store(val, std::memory_order_relaxed); }},
+    // a zset uses the compact encoding up to these limits
+    {"zset-max-listpack-entries", 0, 1 << 20, NULL,
+        []() { return (int64_t)zset_list_max_entries(); },
+        [](int64_t val) { zset_set_list_limits((size_t)val, zset_list_max_len()); }},
+    {"zset-max-listpack-value", 0, 255, NULL,
+        []() { return (int64_t)zset_list_max_len(); },
+        [](int64_t val) { zset_set_list_limits(zset_list_max_entries(), (size_t)val); }},
+    // the order index of the large zsets, for those converted from now on
+    {"zset-index", ZINDEX_AVL, ZINDEX_BTREE, k_zindex_names,
+        []() { return (int64_t)zset_index(); },
+        [](int64_t val) { zset_set_index((uint8_t)val); }},
+};
+
+// an int with an optional unit: k, kb, m, mb, g, gb (powers of 1024)
+static bool str2size(std::string_view s, int64_t &out) {
+    static const struct { const char *unit; int64_t mul; } k_units[] = {
+        {"kb", 1 << 10}, {"k", 1 << 10}, {"mb", 1 << 20}, {"m", 1 << 20},
+        {"gb", 1 << 30}, {"g", 1 << 30},
+    };
+    for (const auto &u : k_units) {
+        size_t n = strlen(u.unit);
+        if (s.size() > n && str_ieq(s.substr(s.size() - n), u.unit)) {
+            int64_t val = 0;
+            if (!str2int(s.substr(0, s.size() - n), val) || val < 0 || val > INT64_MAX / u.mul) {
+                return false;
+            }
+            out = val * u.mul;
+            return true;
+        }
+    }
+    return str2int(s, out);
+}
+
+// parse and apply a value, false if it's invalid
+static bool config_set(const ConfigParam *p, std::string_view s) {
+    int64_t val = -1;
+    if (p->names) {
+        for (int64_t i = 0; p->names[i]; i++) {
+            if (str_ieq(s, p->names[i])) {
+                val = i;
+            }
+        }
+    } else if (!str2size(s, val)) {
+        return false;
+    }
+    if (val < p->min || val > p->max) {
+        return false;
+    }
+    p->set(val);
+    return true;
+}
+
+static void out_config(Buffer &out, const ConfigParam *p) {
+    int64_t val = p->get();
+    if (p->names) {
+        return out_str(out, p->names[val], strlen(p->names[val]));
+    }
+    return out_int(out, val);
+}
+
+static const ConfigParam *config_lookup(std::string_view name) {
+    for (const ConfigParam &p : k_config_params) {
+        if (str_ieq(name, p.name)) {
+            return &p;
+        }
+    }
+    return NULL;
+}
+
+// config get name
+// config set name value
+static void do_config(std::vector<std::string_view> &cmd, Buffer &out) {
+    const ConfigParam *p = config_lookup(cmd[2]);
+    if (!p) {
+        return out_err(out, ERR_BAD_ARG, "unknown parameter");
+    }
+    if (cmd.size() == 3 && str_ieq(cmd[1], "get")) {
+        return out_config(out, p);
+    }
+    if (cmd.size() == 4 && str_ieq(cmd[1], "set")) {
+        if (!config_set(p, cmd[3])) {
+            return out_err(out, ERR_BAD_ARG, "bad value");
+        }
+        return out_config(out, p);
+    }
+    return out_err(out, ERR_BAD_ARG, "expect CONFIG GET|SET");
+}
+
+static const ZSet k_empty_zset;
+
+static ZSet *expect_zset(std::string_view s) {
+    LookupKey key;
+    key.key = s;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    if (!hnode) {   // a non-existent key is treated as an empty zset
+        return (ZSet *)&k_empty_zset;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_ZSET ? ent->zset : NULL;
+}
+
+// zrem zset name
+static void do_zrem(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    std::string_view name = cmd[2];
+    bool removed = zset_remove(zset, name.data(), name.size());
+    return out_int(out, removed ? 1 : 0);
+}
+
+// zscore zset name
+static void do_zscore(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    std::string_view name = cmd[2];
+    double score = 0;
+    bool found = zset_lookup(zset, name.data(), name.size(), &score);
+    return found ? out_dbl(out, score) : out_nil(out);
+}
+
+// zquery zset score name offset limit
+static void do_zquery(std::vector<std::string_view> &cmd, Buffer &out) {
+    // parse args
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    std::string_view name = cmd[3];
+    int64_t offset = 0, limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+
+    // get the zset
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    // seek to the key
+    if (limit <= 0) {
+        return out_arr(out, 0);
+    }
+    ZIter it;
+    zset_seekge(zset, score, name.data(), name.size(), &it);
+    ziter_offset(&it, offset);
+
+    // output
+    size_t ctx = out_begin_arr(out);
+    int64_t n = 0;
+    while (it.valid && n < limit) {
+        ZMember m = ziter_get(&it);
+        out_str(out, m.name, m.len);
+        out_dbl(out, m.score);
+        ziter_offset(&it, +1);
+        n += 2;
+    }
+    out_end_arr(out, ctx, (uint32_t)n);
+}
+
+// zrank zset name
+// zrevrank zset name
+static void zrank(std::vector<std::string_view> &cmd, Buffer &out, bool rev) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    std::string_view name = cmd[2];
+    double score = 0;
+    if (!zset_lookup(zset, name.data(), name.size(), &score)) {
+        return out_nil(out);
+    }
+    ZIter it;
+    zset_seekge(zset, score, name.data(), name.size(), &it);
+    int64_t rank = ziter_rank(&it);
+    return out_int(out, rev ? (int64_t)zset_size(zset) - 1 - rank : rank);
+}
+
+static void do_zrank(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zrank(cmd, out, false);
+}
+
+static void do_zrevrank(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zrank(cmd, out, true);
+}
+
+// a score bound: "1.5", "(1.5" for exclusive, "-inf", "+inf"
+struct ScoreBound {
+    double score = 0;
+    bool excl = false;
+};
+
+static bool parse_score_bound(std::string_view s, ScoreBound &out) {
+    out.excl = !s.empty() && s[0] == '(';
+    return str2dbl(out.excl ? s.substr(1) : s, out.score);
+}
+
+// the rank of the first member whose score is >= the score, or > it
+static int64_t zrank_of_score(ZSet *zset, double score, bool after) {
+    int64_t size = (int64_t)zset_size(zset);
+    if (after) {
+        if (score == INFINITY) {
+            return size;
+        }
+        score = nextafter(score, INFINITY);
+    }
+    // the empty name sorts first among the same score
+    ZIter it;
+    zset_seekge(zset, score, "", 0, &it);
+    return it.valid ? ziter_rank(&it) : size;
+}
+
+// the ranks [lo, hi) of the members in the score range
+static void zrank_range(ZSet *zset, const ScoreBound &min, const ScoreBound &max,
+                        int64_t &lo, int64_t &hi)
+{
+    lo = zrank_of_score(zset, min.score, min.excl);
+    hi = zrank_of_score(zset, max.score, !max.excl);
+    hi = hi > lo ? hi : lo;
+}
+
+// the ranks [lo, hi) of an inclusive index range; a negative index
+// counts from the end
+static void zindex_range(int64_t size, int64_t start, int64_t stop, int64_t &lo, int64_t &hi) {
+    start = start < 0 ? start + size : start;
+    stop = stop < 0 ? stop + size : stop;
+    lo = start < 0 ? 0 : start;
+    hi = stop >= size ? size : stop + 1;
+    hi = hi > lo ? hi : lo;
+}
+
+// [WITHSCORES] [LIMIT offset count]
+struct ZRangeOpts {
+    bool withscores = false;
+    int64_t offset = 0;
+    int64_t count = -1;     // negative for all
+};
+
+static bool parse_zrange_opts(std::vector<std::string_view> &cmd, size_t pos,
+                              bool limit, ZRangeOpts &opts)
+{
+    for (; pos < cmd.size(); pos++) {
+        if (str_ieq(cmd[pos], "withscores")) {
+            opts.withscores = true;
+        } else if (limit && str_ieq(cmd[pos], "limit") && pos + 2 < cmd.size()) {
+            if (!str2int(cmd[pos + 1], opts.offset) || !str2int(cmd[pos + 2], opts.count)) {
+                return false;
+            }
+            pos += 2;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void out_zmember(Buffer &out, const ZMember &m, const ZRangeOpts &opts) {
+    out_str(out, m.name, m.len);
+    if (opts.withscores) {
+        out_dbl(out, m.score);
+    }
+}
+
+// members walked forward at a time by a reverse range
+const int64_t k_zrange_rev_chunk = 64;
+
+// output the ranks [bottom, top) in the reverse order. the compact encoding
+// can't step backwards without a rescan, so they are walked forward a chunk
+// at a time, from the lowest rank of the chunk, and each chunk is reversed.
+static void out_zrange_rev(Buffer &out, ZSet *zset, int64_t bottom, int64_t top,
+                           const ZRangeOpts &opts)
+{
+    ZMember chunk[k_zrange_rev_chunk];
+    while (top > bottom) {
+        int64_t k = std::min(top - bottom, k_zrange_rev_chunk);
+        ZIter it;
+        zset_seek_rank(zset, top - k, &it);
+        for (int64_t i = 0; i < k; i++) {
+            chunk[i] = ziter_get(&it);
+            ziter_offset(&it, +1);
+        }
+        for (int64_t i = k - 1; i >= 0; i--) {
+            out_zmember(out, chunk[i], opts);
+        }
+        top -= k;
+    }
+}
+
+// output the members of the ranks [lo, hi), after skipping and limiting
+// in the order of the output
+static void out_zrange(Buffer &out, ZSet *zset, int64_t lo, int64_t hi, bool rev,
+                       const ZRangeOpts &opts)
+{
+    int64_t n = opts.offset < 0 ? 0 : hi - lo - opts.offset;
+    n = n < 0 ? 0 : n;
+    n = opts.count >= 0 && opts.count < n ? opts.count : n;
+    size_t ctx = out_begin_arr(out);
+    if (n <= 0) {
+        // the offset is out of the range, it may overflow the rank
+        return out_end_arr(out, ctx, 0);
+    }
+    if (rev) {
+        out_zrange_rev(out, zset, hi - opts.offset - n, hi - opts.offset, opts);
+    } else {
+        ZIter it;
+        zset_seek_rank(zset, lo + opts.offset, &it);
+        for (int64_t i = 0; i < n; i++) {
+            out_zmember(out, ziter_get(&it), opts);
+            ziter_offset(&it, +1);
+        }
+    }
+    out_end_arr(out, ctx, (uint32_t)(opts.withscores ? 2 * n : n));
+}
+
+// zrange zset start stop [WITHSCORES]
+// zrevrange zset start stop [WITHSCORES]
+static void zrange(std::vector<std::string_view> &cmd, Buffer &out, bool rev) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZRangeOpts opts;
+    if (!parse_zrange_opts(cmd, 4, false, opts)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t size = (int64_t)zset_size(zset);
+    int64_t lo = 0, hi = 0;
+    zindex_range(size, start, stop, lo, hi);
+    if (rev) {  // the indexes count from the last member
+        int64_t rlo = size - hi;
+        hi = size - lo;
+        lo = rlo;
+    }
+    return out_zrange(out, zset, lo, hi, rev, opts);
+}
+
+static void do_zrange(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zrange(cmd, out, false);
+}
+
+static void do_zrevrange(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zrange(cmd, out, true);
+}
+
+// zrangebyscore zset min max [WITHSCORES] [LIMIT offset count]
+// zrevrangebyscore zset max min [WITHSCORES] [LIMIT offset count]
+static void zrangebyscore(std::vector<std::string_view> &cmd, Buffer &out, bool rev) {
+    ScoreBound min, max;
+    if (!parse_score_bound(cmd[rev ? 3 : 2], min) || !parse_score_bound(cmd[rev ? 2 : 3], max)) {
+        return out_err(out, ERR_BAD_ARG, "min or max is not a float");
+    }
+    ZRangeOpts opts;
+    if (!parse_zrange_opts(cmd, 4, true, opts)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t lo = 0, hi = 0;
+    zrank_range(zset, min, max, lo, hi);
+    return out_zrange(out, zset, lo, hi, rev, opts);
+}
+
+static void do_zrangebyscore(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zrangebyscore(cmd, out, false);
+}
+
+static void do_zrevrangebyscore(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zrangebyscore(cmd, out, true);
+}
+
+// zcount zset min max
+// the difference of 2 ranks, without visiting the members
+static void do_zcount(std::vector<std::string_view> &cmd, Buffer &out) {
+    ScoreBound min, max;
+    if (!parse_score_bound(cmd[2], min) || !parse_score_bound(cmd[3], max)) {
+        return out_err(out, ERR_BAD_ARG, "min or max is not a float");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t lo = 0, hi = 0;
+    zrank_range(zset, min, max, lo, hi);
+    return out_int(out, hi - lo);
+}
+
+// zremrangebyrank zset start stop
+static void do_zremrangebyrank(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t lo = 0, hi = 0;
+    zindex_range((int64_t)zset_size(zset), start, stop, lo, hi);
+    return out_int(out, (int64_t)zset_remove_range(zset, lo, (size_t)(hi - lo)));
+}
+
+// zremrangebyscore zset min max
+static void do_zremrangebyscore(std::vector<std::string_view> &cmd, Buffer &out) {
+    ScoreBound min, max;
+    if (!parse_score_bound(cmd[2], min) || !parse_score_bound(cmd[3], max)) {
+        return out_err(out, ERR_BAD_ARG, "min or max is not a float");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t lo = 0, hi = 0;
+    zrank_range(zset, min, max, lo, hi);
+    return out_int(out, (int64_t)zset_remove_range(zset, lo, (size_t)(hi - lo)));
+}
+
+static void cb_scan_zmember(const ZMember *m, void *arg) {
+    ScanCtx &ctx = *(ScanCtx *)arg;
+    if (scan_match(ctx, m->name, m->len)) {
+        out_str(*ctx.out, m->name, m->len);
+        out_dbl(*ctx.out, m->score);
+        ctx.nout += 2;
+    }
+}
+
+// zscan zset cursor [MATCH pattern] [COUNT count]
+// returns [next_cursor, [name, score, ...]]
+static void do_zscan(std::vector<std::string_view> &cmd, Buffer &out) {
+    ScanCtx ctx;
+    ctx.out = &out;
+    uint64_t cursor = 0;
+    if (!scan_parse_cursor(cmd[2], cursor)) {
+        return out_err(out, ERR_BAD_ARG, "invalid cursor");
+    }
+    if (!scan_parse_opts(cmd, 3, ctx)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    out_arr(out, 2);
+    size_t cursor_pos = out.size();
+    out_int(out, 0);    // filled below
+    size_t arr = out_begin_arr(out);
+    cursor = scan_run(cursor, ctx, [&](uint64_t cursor) {
+        return zset_scan(zset, cursor, &cb_scan_zmember, &ctx);
+    });
+    out_end_arr(out, arr, ctx.nout);
+    out_set_int(out, cursor_pos, (int64_t)cursor);
+}
+
+static void do_request(std::vector<std::string_view> &cmd, Buffer &out);
+static Reactor *cmd_owner(const std::vector<std::string_view> &cmd);
+static Reactor *key_owner(std::string_view key);
+
+// zunionstore, zinterstore, zdiffstore
+enum {
+    ZSTORE_UNION,
+    ZSTORE_INTER,
+    ZSTORE_DIFF,
+};
+
+enum {
+    ZAGG_SUM,
+    ZAGG_MIN,
+    ZAGG_MAX,
+};
+
+struct ZStoreJob;
+
+// a part of the work: the ranks [lo, hi) of an input
+struct ZStoreTask {
+    ZStoreJob *job = NULL;
+    size_t input = 0;
+    int64_t lo = 0;
+    int64_t hi = 0;
+    std::vector<ZMember> out;   // sorted, the names are in the inputs
+};
+
+struct ZStoreJob {
+    uint32_t op = ZSTORE_UNION;
+    uint32_t agg = ZAGG_SUM;
+    std::vector<ZSet *> zsets;
+    std::vector<double> weights;
+    // the tasks on the thread pool
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+    size_t pending = 0;
+};
+
+// members iterated per task of the thread pool, fewer are done inline
+const int64_t k_zstore_task_min = 1 << 15;
+
+static double zstore_weigh(double score, double weight) {
+    double val = score * weight;
+    return isnan(val) ? 0 : val;    // 0 * inf
+}
+
+static double zstore_agg(uint32_t agg, double acc, double val) {
+    if (agg == ZAGG_MIN) {
+        return val < acc ? val : acc;
+    }
+    if (agg == ZAGG_MAX) {
+        return val > acc ? val : acc;
+    }
+    double sum = acc + val;
+    return isnan(sum) ? 0 : sum;    // inf - inf
+}
+
+// the result score of a member of the input `i`, false if not in the
+// result. a member of several inputs is owned by the first of them, and
+// the scores are aggregated in the input order whoever computes it, so
+// the result doesn't depend on the partitioning.
+static bool zstore_member(ZStoreJob *job, size_t i, const ZMember &m, double &score) {
+    size_t n = job->zsets.size();
+    double val = 0;
+    if (job->op == ZSTORE_DIFF) {
+        for (size_t j = 1; j < n; j++) {
+            if (zset_peek(job->zsets[j], m.name, m.len, &val)) {
+                return false;
+            }
+        }
+        score = m.score;
+        return true;
+    }
+    size_t first = job->op == ZSTORE_UNION ? i : 0;
+    for (size_t j = 0; j < first; j++) {
+        if (zset_peek(job->zsets[j], m.name, m.len, &val)) {
+            return false;   // owned by an earlier input
+        }
+    }
+    for (size_t j = first; j < n; j++) {
+        if (j == i) {
+            val = m.score;
+        } else if (!zset_peek(job->zsets[j], m.name, m.len, &val)) {
+            if (job->op == ZSTORE_INTER) {
+                return false;
+            }
+            continue;
+        }
+        val = zstore_weigh(val, job->weights[j]);
+        score = j == first ? val : zstore_agg(job->agg, score, val);
     }
-    
-    // 设置为非阻塞模式
-    fd_set_nb(g_data.aof_rewrite_fd);
-    // 在线程池中执行重写任务
-    // thread_pool_queue(&g_data.thread_pool, [](void* arg) {
-    //     aof_rewrite_do();
-    //     aof_rewrite_finish();
-    // }, nullptr);
-    aof_rewrite_do();
-    aof_rewrite_finish();
-
-    // todo
-    return 0;
+    return true;
 }
 
+// only reads the inputs, which don't change until all tasks are done:
+// the owning reactor waits for them
+static void zstore_run(ZStoreTask *task) {
+    ZStoreJob *job = task->job;
+    ZIter it;
+    zset_seek_rank(job->zsets[task->input], task->lo, &it);
+    for (int64_t r = task->lo; r < task->hi; r++) {
+        ZMember m = ziter_get(&it);
+        double score = 0;
+        if (zstore_member(job, task->input, m, score)) {
+            task->out.push_back(ZMember{score, m.name, m.len});
+        }
+        ziter_offset(&it, +1);
+    }
+    std::sort(task->out.begin(), task->out.end(), &zmember_less);
+}
 
-static void do_aof_rewrite(std::vector<std::string> &cmd, Buffer &out) {
-    if (!g_data.aof_enabled) {
-        return out_err(out, ERR_BAD_ARG, "AOF is not enabled");
+static void zstore_task_func(void *arg) {
+    ZStoreTask *task = (ZStoreTask *)arg;
+    zstore_run(task);
+    ZStoreJob *job = task->job;
+    pthread_mutex_lock(&job->mu);
+    if (--job->pending == 0) {
+        pthread_cond_signal(&job->done);
     }
-    
-    if (g_data.aof_rewriting) {
-        return out_err(out, ERR_BAD_ARG, "AOF rewrite already in progress");
+    pthread_mutex_unlock(&job->mu);
+}
+
+// the sorted members of the result
+static void zstore_compute(ZStoreJob *job, std::vector<ZMember> &result) {
+    // the inputs to iterate: all of them for the union; the smallest for
+    // the intersection; the first for the difference
+    std::vector<size_t> iter;
+    if (job->op == ZSTORE_UNION) {
+        for (size_t i = 0; i < job->zsets.size(); i++) {
+            iter.push_back(i);
+        }
+    } else if (job->op == ZSTORE_INTER) {
+        size_t small = 0;
+        for (size_t i = 1; i < job->zsets.size(); i++) {
+            if (zset_size(job->zsets[i]) < zset_size(job->zsets[small])) {
+                small = i;
+            }
+        }
+        iter.push_back(small);
+    } else {
+        iter.push_back(0);
     }
-    
-    int32_t rv = aof_rewrite();
-    if (rv < 0) {
-        return out_err(out, ERR_UNKNOWN, "AOF rewrite failed");
+    // split into about 1 task per thread, the reactor takes one as well
+    int64_t total = 0;
+    for (size_t i : iter) {
+        total += (int64_t)zset_size(job->zsets[i]);
+    }
+    int64_t nthreads = (int64_t)g_data.thread_pool.threads.size() + 1;
+    int64_t chunk = (total + nthreads - 1) / nthreads;
+    chunk = chunk > k_zstore_task_min ? chunk : k_zstore_task_min;
+    std::vector<ZStoreTask> tasks;
+    for (size_t i : iter) {
+        int64_t size = (int64_t)zset_size(job->zsets[i]);
+        for (int64_t lo = 0; lo < size; lo += chunk) {
+            ZStoreTask task;
+            task.job = job;
+            task.input = i;
+            task.lo = lo;
+            task.hi = lo + chunk < size ? lo + chunk : size;
+            tasks.push_back(std::move(task));
+        }
+    }
+    if (tasks.empty()) {
+        return;
+    }
+    job->pending = tasks.size() - 1;
+    for (size_t t = 1; t < tasks.size(); t++) {
+        thread_pool_queue(&g_data.thread_pool, &zstore_task_func, &tasks[t]);
+    }
+    zstore_run(&tasks[0]);
+    pthread_mutex_lock(&job->mu);
+    while (job->pending > 0) {
+        pthread_cond_wait(&job->done, &job->mu);
+    }
+    pthread_mutex_unlock(&job->mu);
+    // merge the sorted runs
+    for (ZStoreTask &task : tasks) {
+        size_t mid = result.size();
+        result.insert(result.end(), task.out.begin(), task.out.end());
+        std::inplace_merge(result.begin(), result.begin() + mid, result.end(), &zmember_less);
     }
-    
-    return out_int(out, 1);
 }
 
-static const ZSet k_empty_zset;
+// zunionstore dst numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]
+// zinterstore dst numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]
+// zdiffstore dst numkeys key [key ...]
+static void zstore(std::vector<std::string_view> &cmd, Buffer &out, uint32_t op) {
+    int64_t numkeys = 0;
+    if (!str2int(cmd[2], numkeys) || numkeys < 1 || numkeys > (int64_t)cmd.size() - 3) {
+        return out_err(out, ERR_BAD_ARG, "bad numkeys");
+    }
+    ZStoreJob job;
+    job.op = op;
+    job.weights.assign((size_t)numkeys, 1.0);
+    for (size_t pos = 3 + (size_t)numkeys; pos < cmd.size(); ) {
+        if (op != ZSTORE_DIFF && str_ieq(cmd[pos], "weights")
+            && pos + (size_t)numkeys < cmd.size())
+        {
+            for (size_t i = 0; i < (size_t)numkeys; i++) {
+                if (!str2dbl(cmd[pos + 1 + i], job.weights[i])) {
+                    return out_err(out, ERR_BAD_ARG, "weight value is not a float");
+                }
+            }
+            pos += 1 + (size_t)numkeys;
+        } else if (op != ZSTORE_DIFF && str_ieq(cmd[pos], "aggregate") && pos + 1 < cmd.size()) {
+            if (str_ieq(cmd[pos + 1], "sum")) {
+                job.agg = ZAGG_SUM;
+            } else if (str_ieq(cmd[pos + 1], "min")) {
+                job.agg = ZAGG_MIN;
+            } else if (str_ieq(cmd[pos + 1], "max")) {
+                job.agg = ZAGG_MAX;
+            } else {
+                return out_err(out, ERR_BAD_ARG, "syntax error");
+            }
+            pos += 2;
+        } else {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+    // the table routes by the destination, the sources must be here too
+    for (size_t i = 0; i < (size_t)numkeys; i++) {
+        if (key_owner(cmd[3 + i]) != g_reactor) {
+            return out_err(out, ERR_BAD_ARG, "keys in different shards.");
+        }
+    }
+    for (size_t i = 0; i < (size_t)numkeys; i++) {
+        ZSet *zset = expect_zset(cmd[3 + i]);
+        if (!zset) {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+        job.zsets.push_back(zset);
+    }
+
+    // the names point into the inputs, one of which may be the destination,
+    // so the result is built before the destination is deleted
+    std::vector<ZMember> members;
+    zstore_compute(&job, members);
+    ZSet result;
+    zset_load(&result, members.data(), members.size());
 
-static ZSet *expect_zset(std::string &s) {
     LookupKey key;
-    key.key.swap(s);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {   // a non-existent key is treated as an empty zset
-        return (ZSet *)&k_empty_zset;
+    if (HNode *node = hm_delete(&g_reactor->db, &key.node)) {
+        entry_del(container_of(node, Entry, node));
     }
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    if (zset_size(&result) > 0) {
+        Entry *ent = entry_new(T_ZSET, key.key, key.node.hcode);
+        *ent->zset = result;    // moved
+        hm_insert(&g_reactor->db, &ent->node);
+    }
+    return out_int(out, (int64_t)members.size());
 }
 
-// zrem zset name
-static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
-    }
+static void do_zunionstore(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zstore(cmd, out, ZSTORE_UNION);
+}
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    if (znode) {
-        zset_delete(zset, znode);
+static void do_zinterstore(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zstore(cmd, out, ZSTORE_INTER);
+}
+
+static void do_zdiffstore(std::vector<std::string_view> &cmd, Buffer &out) {
+    return zstore(cmd, out, ZSTORE_DIFF);
+}
+
+// bounds-checked reads from a mapped snapshot
+struct RdbReader {
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL;
+    bool failed = false;
+};
+
+static const uint8_t *rdb_read(RdbReader *r, size_t n) {
+    if (r->failed || (size_t)(r->end - r->cur) < n) {
+        r->failed = true;
+        return NULL;
     }
-    return out_int(out, znode ? 1 : 0);
+    const uint8_t *p = r->cur;
+    r->cur += n;
+    return p;
 }
 
-// zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+static bool rdb_read_into(RdbReader *r, void *out, size_t n) {
+    const uint8_t *p = rdb_read(r, n);
+    if (p) {
+        memcpy(out, p, n);
     }
+    return p != NULL;
+}
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+static std::string_view rdb_read_str(RdbReader *r) {
+    uint32_t len = 0;
+    rdb_read_into(r, &len, sizeof(len));
+    const uint8_t *p = rdb_read(r, len);
+    return p ? std::string_view((const char *)p, len) : std::string_view();
 }
 
-// zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
-    // parse args
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect fp number");
+// build the entry in place and insert it into the owning shard
+static void rdb_load_entry(RdbReader *r, uint32_t type, int64_t now_ms,
+                           std::vector<ZMember> &members) {
+    int64_t expire_at = -1;
+    rdb_read_into(r, &expire_at, sizeof(expire_at));
+    std::string_view key = rdb_read_str(r);
+    uint64_t hcode = str_hash((const uint8_t *)key.data(), key.size());
+
+    Entry *ent = NULL;
+    if (type == T_STR) {
+        std::string_view val = rdb_read_str(r);
+        ent = entry_new_str(key, hcode, val);
+    } else {
+        ent = entry_new(T_ZSET, key, hcode);
+        uint64_t n = 0;
+        rdb_read_into(r, &n, sizeof(n));
+        members.clear();
+        for (uint64_t i = 0; i < n && !r->failed; i++) {
+            double score = 0;
+            rdb_read_into(r, &score, sizeof(score));
+            std::string_view name = rdb_read_str(r);
+            if (!r->failed) {   // the name stays in the mapped file
+                members.push_back(ZMember{score, name.data(), name.size()});
+            }
+        }
+        // the members are stored in order, so the tree is built in O(n)
+        zset_load(ent->zset, members.data(), members.size());
     }
-    const std::string &name = cmd[3];
-    int64_t offset = 0, limit = 0;
-    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
-        return out_err(out, ERR_BAD_ARG, "expect int");
+    if (r->failed || (expire_at >= 0 && expire_at <= now_ms)) {
+        entry_del_sync(ent);    // truncated or already expired
+        return;
     }
 
-    // get the zset
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+    g_reactor = key_owner(key);
+    hm_insert(&g_reactor->db, &ent->node);
+    if (expire_at >= 0) {
+        entry_set_ttl(ent, expire_at - now_ms);
     }
+}
 
-    // seek to the key
-    if (limit <= 0) {
-        return out_arr(out, 0);
+// load a snapshot without going through the command parser. the keys
+// are assumed to be unique. `consumed` is the size of the snapshot; an
+// AOF continues with the commands logged after it.
+static int32_t rdb_load(const uint8_t *data, size_t size, size_t *consumed) {
+    RdbReader r;
+    r.cur = data;
+    r.end = data + size;
+    const uint8_t *magic = rdb_read(&r, k_rdb_magic_len);
+    if (!magic || memcmp(magic, k_rdb_magic, k_rdb_magic_len) != 0) {
+        msg("not a snapshot file");
+        return -1;
+    }
+    uint64_t nkeys = 0;
+    int64_t saved_ms = 0;
+    rdb_read_into(&r, &nkeys, sizeof(nkeys));
+    rdb_read_into(&r, &saved_ms, sizeof(saved_ms));
+    // presize the shards; an entry takes at least 16 bytes
+    if (nkeys <= size / 16) {
+        size_t nshards = g_data.reactors.size();
+        for (Reactor *rt : g_data.reactors) {
+            hm_reserve(&rt->db, nkeys / nshards + 1);
+        }
     }
-    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
 
-    // output
-    size_t ctx = out_begin_arr(out);
-    int64_t n = 0;
-    while (znode && n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
+    int64_t now_ms = get_wall_msec();
+    std::vector<ZMember> members;
+    while (!r.failed) {
+        uint8_t type = 0;
+        if (!rdb_read_into(&r, &type, sizeof(type)) || type == k_rdb_eof) {
+            break;
+        }
+        uint64_t count = 0;
+        rdb_read_into(&r, &count, sizeof(count));
+        if (type != T_STR && type != T_ZSET) {
+            r.failed = true;
+        }
+        for (uint64_t i = 0; i < count && !r.failed; i++) {
+            rdb_load_entry(&r, type, now_ms, members);
+        }
     }
-    out_end_arr(out, ctx, (uint32_t)n);
+    g_reactor = g_data.reactors[0];
+    if (r.failed) {
+        msg("snapshot file is corrupted");
+        return -1;
+    }
+    *consumed = (size_t)(r.cur - data);
+    return 0;
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out);
+// map a whole file for reading, NULL if it's missing or empty
+static const uint8_t *map_file(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st = {};
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = (size_t)st.st_size;
+        map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            msg_errno("mmap() error");
+        }
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, *size, MADV_SEQUENTIAL);   // read once, front to back
+    return (const uint8_t *)map;
+}
+
+// without the AOF, the dataset is restored from the last snapshot
+static int32_t load_rdb_file() {
+    size_t size = 0;
+    const uint8_t *data = map_file(g_data.rdb_filename.c_str(), &size);
+    if (!data) {
+        return 0;
+    }
+    size_t consumed = 0;
+    int32_t rv = rdb_load(data, size, &consumed);
+    munmap((void *)data, size);
+    if (rv == 0) {
+        msg("DB loaded from the snapshot");
+    }
+    return rv;
+}
 
+// 映射整个AOF文件，命令的参数直接指向映射的内存，不再逐个拷贝
 static int32_t load_aof_file() {
     if (!g_data.aof_enabled) {
         return 0;
     }
+    size_t size = 0;
+    const uint8_t *data = map_file(g_data.aof_filename.c_str(), &size);
+    if (!data) {
+        return 0;
+    }
     bool aof_was_enabled = g_data.aof_enabled;
     g_data.aof_enabled = false;  // disable AOF during loading
-    FILE *fp = fopen(g_data.aof_filename.c_str(), "r");
-    if (!fp) {
-        msg_errno("AOF file not found");
-        return 0;
+    g_data.loading = true;
+
+    int32_t rv = 0;
+    const uint8_t *cur = data;
+    const uint8_t *end = data + size;
+    // 重写后的AOF文件以快照开头
+    if (size >= k_rdb_magic_len && memcmp(data, k_rdb_magic, k_rdb_magic_len) == 0) {
+        size_t consumed = 0;
+        rv = rdb_load(data, size, &consumed);
+        cur = rv == 0 ? cur + consumed : end;
     }
 
-    while (true) {
-        std::vector<std::string> cmd;
+    std::vector<std::string_view> cmd;
+    Buffer out;
+    while (cur < end) {
+        cmd.clear();
         uint32_t nstr = 0;
-        if (fread(&nstr, 4, 1, fp) != 1) {
-            break;
+        bool ok = read_u32(cur, end, nstr) && nstr <= k_max_args;
+        while (ok && cmd.size() < nstr) {
+            uint32_t len = 0;
+            cmd.push_back(std::string_view());
+            ok = read_u32(cur, end, len) && read_str(cur, end, len, cmd.back());
         }
-        if (nstr > k_max_args) {
+        if (!ok) {
             msg("AOF file is corrupted");
+            rv = -1;
             break;
         }
-        for (uint32_t i = 0; i < nstr; ++i) {
-            uint32_t len = 0;
-            if (fread(&len, 4, 1, fp) != 1) {
-                msg("AOF file is corrupted");
-                break;
+        // replay it on the shard owning the key
+        Reactor *owner = cmd_owner(cmd);
+        g_reactor = owner ? owner : g_data.reactors[0];
+        do_request(cmd, out);
+        out.consume(out.size());
+    }
+    g_reactor = g_data.reactors[0];
+    // the replay doesn't count as command calls
+    for (Reactor *r : g_data.reactors) {
+        for (std::atomic<uint64_t> &calls : r->cmd_calls) {
+            calls.store(0, std::memory_order_relaxed);
+        }
+    }
+    munmap((void *)data, size);
+    g_data.aof_enabled = aof_was_enabled;
+    g_data.loading = false;
+    return rv;
+}
+
+static void reactor_wake(Reactor *r);
+
+// fsync in the background, so the event loops never wait for the disk.
+// the writes done while it runs are synced by the next round together.
+static void *aof_fsync_main(void *) {
+    pthread_mutex_lock(&g_data.aof_mu);
+    while (true) {
+        if (g_data.aof_fsync == AOF_FSYNC_ALWAYS) {
+            while (g_data.aof_written == g_data.aof_synced.load()) {
+                pthread_cond_wait(&g_data.aof_cond, &g_data.aof_mu);
+            }
+        } else {
+            struct timespec ts = {};
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            while (pthread_cond_timedwait(&g_data.aof_cond, &g_data.aof_mu, &ts) != ETIMEDOUT) {}
+            if (g_data.aof_written == g_data.aof_synced.load()) {
+                continue;
+            }
+        }
+        // the fd may be replaced by an AOF rewrite while syncing
+        uint64_t target = g_data.aof_written;
+        int fd = g_data.aof_fd >= 0 ? dup(g_data.aof_fd) : -1;
+        pthread_mutex_unlock(&g_data.aof_mu);
+
+        if (fd >= 0) {
+            if (fdatasync(fd) < 0) {
+                if (g_data.aof_fsync == AOF_FSYNC_ALWAYS) {
+                    die("fsync() error with appendfsync always");
+                }
+                msg_errno("fsync() error");
             }
-            std::string s(len, '\0');
-            if (fread(&s[0], 1, len, fp) != len) {
-                msg("AOF file is corrupted");
-                break;
+            close(fd);
+        }
+        g_data.aof_synced.store(target);
+        if (g_data.aof_fsync == AOF_FSYNC_ALWAYS) {
+            for (Reactor *r : g_data.reactors) {
+                reactor_wake(r);    // release the replies, see aof_release_waiters()
             }
-            cmd.push_back(std::move(s));
         }
-        Buffer out;
-        do_request(cmd, out);
+        pthread_mutex_lock(&g_data.aof_mu);
     }
-    // parse_req
-    fclose(fp);
-    g_data.aof_enabled = aof_was_enabled;
-    return 0;
+    return NULL;
 }
 
 static int32_t aof_init() {
@@ -899,89 +3190,301 @@ static int32_t aof_init() {
         // return -1;
         msg("Warning: AOF file loading failed, continue with empty DB\n");
     }
+    if (g_data.aof_fsync != AOF_FSYNC_NO) {
+        pthread_create(&g_data.aof_fsync_thread, NULL, &aof_fsync_main, NULL);
+    }
     return 0;
 }
 
 // 格式同输入格式，使写入的 AOF 文件可以直接被加载并被parse_req解析
-static void aof_write_command(Buffer &buf, const std::vector<std::string>& cmd) {
+static void aof_write_command(Buffer &buf, const std::vector<std::string_view> &cmd) {
     if (cmd.empty()) {
         return;
     }
     
     buf_append_u32(buf, (uint32_t)cmd.size());
-    for (const std::string &s : cmd) {
+    for (std::string_view s : cmd) {
         buf_append_u32(buf, (uint32_t)s.size());
         buf_append(buf, (const uint8_t *)s.data(), s.size());
     }
     
 }
 
-static void aof_flush_and_sync() {
-    if (!g_data.aof_enabled || g_data.aof_buf.empty() || g_data.aof_fd < 0) {
-        return;
+// the AOF buffer is shared by all reactors
+static void aof_append(const std::vector<std::string_view> &cmd) {
+    pthread_mutex_lock(&g_data.aof_mu);
+    size_t size = g_data.aof_buf.size();
+    aof_write_command(g_data.aof_buf, cmd);
+    g_data.aof_seq += g_data.aof_buf.size() - size;
+    if (g_data.aof_rewriting) {
+        aof_write_command(g_data.aof_rewrite_buf, cmd);   // 差异缓冲区
     }
+    g_reactor->aof_seq = g_data.aof_seq;
+    pthread_mutex_unlock(&g_data.aof_mu);
+}
 
-    uint8_t *data = NULL;
-    size_t data_size;
-    g_data.aof_buf.get_continuous_data(0, &data, &data_size);
+// io_uring batches the AOF writes of the single event loop
+static bool aof_use_uring() {
+    return g_data.io_backend == IO_URING && g_data.reactors.size() == 1;
+}
 
-    ssize_t rv = write(g_data.aof_fd, data, data_size);
-    if (rv < 0) {
-        msg_errno("write() error");
+// write the AOF records of an event loop iteration together
+static void aof_flush() {
+    if (!g_data.aof_enabled || g_data.aof_fd < 0) {
         return;
     }
-    g_data.aof_buf.consume(rv);
+    if (aof_use_uring()) {
+        return;     // batched by the event loop, see uring_queue_aof()
+    }
+    pthread_mutex_lock(&g_data.aof_mu);
+    aof_flush_locked();
+    pthread_mutex_unlock(&g_data.aof_mu);
+}
 
-    // fsync everysec
-    uint64_t now = get_monotonic_msec();
-    if (now - g_data.aof_last_save_ms > 1000) {
-        fsync(g_data.aof_fd);
-        g_data.aof_last_save_ms = now;
+// `aof_mu` is held
+static void aof_on_written(size_t len) {
+    g_data.aof_written += len;
+    if (g_data.aof_fsync == AOF_FSYNC_ALWAYS) {
+        pthread_cond_signal(&g_data.aof_cond);  // wake up the fsync thread
     }
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        if (g_data.aof_enabled) aof_write_command(g_data.aof_buf, cmd); // 写入 AOF
-        do_set(cmd, out);
-        if (g_data.aof_enabled) aof_flush_and_sync();              // 同步 AOF
-        return;
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        if (g_data.aof_enabled) aof_write_command(g_data.aof_buf, cmd);
-        do_del(cmd, out);
-        if (g_data.aof_enabled) aof_flush_and_sync();
-        return;
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        if (g_data.aof_enabled) aof_write_command(g_data.aof_buf, cmd);
-        do_expire(cmd, out);
-        if (g_data.aof_enabled) aof_flush_and_sync();
-        return;
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out); // pttl 是只读命令，不需要 AOF
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out); // keys 是只读命令
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        if (g_data.aof_enabled) aof_write_command(g_data.aof_buf, cmd);
-        do_zadd(cmd, out);
-        if (g_data.aof_enabled) aof_flush_and_sync();
-        return;
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        if (g_data.aof_enabled) aof_write_command(g_data.aof_buf, cmd);
-        do_zrem(cmd, out);
-        if (g_data.aof_enabled) aof_flush_and_sync();
-        return;
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out); // zscore 是只读命令
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out); // zquery 是只读命令
-    } else if (cmd.size() == 1 && cmd[0] == "bgrewriteaof") {
-        return do_aof_rewrite(cmd, out);
+static void aof_write_error() {
+    if (g_data.aof_fsync == AOF_FSYNC_ALWAYS) {
+        // the held replies would never be released
+        die("AOF write() error with appendfsync always");
+    }
+    msg_errno("write() error");
+}
 
-    } else {
+static void aof_flush_locked() {
+    while (!g_data.aof_buf.empty()) {
+        // both halves of the ring buffer in 1 syscall
+        struct iovec iov[2];
+        int iovcnt = g_data.aof_buf.get_iovecs(iov, 2);
+        ssize_t rv = writev(g_data.aof_fd, iov, iovcnt);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return aof_write_error();   // keep the data, retry later
+        }
+        g_data.aof_buf.consume((size_t)rv);
+        aof_on_written((size_t)rv);
+    }
+}
+
+static void conn_resume(Conn *conn);
+
+// appendfsync always: reply to the connections whose AOF records are durable
+static void aof_release_waiters() {
+    uint64_t synced = g_data.aof_synced.load();
+    DList *node = g_reactor->aof_waiters.next;
+    while (node != &g_reactor->aof_waiters) {
+        DList *next = node->next;
+        Conn *conn = container_of(node, Conn, aof_node);
+        if (conn->aof_wait <= synced) {
+            dlist_detach(node);
+            dlist_init(node);
+            // may have been sent already, if the fsync beat the wakeup
+            conn->want_write = !conn->outgoing.empty();
+            conn_resume(conn);
+        }
+        node = next;
+    }
+}
+
+// command flags
+enum {
+    CMD_WRITE       = 1 << 0,   // modifies the keyspace
+    CMD_READONLY    = 1 << 1,   // only reads the keyspace
+    CMD_AOF         = 1 << 2,   // propagated to the AOF when it succeeds
+    CMD_ADMIN       = 1 << 3,   // server management
+    CMD_DENYOOM     = 1 << 4,   // may grow the memory, refused over maxmemory
+    CMD_MAIN        = 1 << 5,   // executed by the 1st reactor, which owns the child
+};
+
+struct Command {
+    const char *name;
+    int32_t arity;      // number of args including the name, -N means >= N
+    uint32_t flags;
+    uint32_t first_key; // index of the 1st key argument, 0 for keyless commands
+    int32_t last_key;   // index of the last key, -N means the Nth from the end
+    uint32_t key_step;  // distance between the keys
+    void (*proc)(std::vector<std::string_view> &cmd, Buffer &out);
+};
+
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out);
+
+static const Command k_commands[] = {
+    {"get",                2, CMD_READONLY,                       1,  1, 1, &do_get},
+    {"set",                3, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_set},
+    {"del",                2, CMD_WRITE | CMD_AOF,                1,  1, 1, &do_del},
+    {"mget",              -2, CMD_READONLY,                       1, -1, 1, &do_mget},
+    {"mset",              -3, CMD_WRITE | CMD_DENYOOM,            1, -2, 2, &do_mset},   // logged per key
+    {"mdel",              -2, CMD_WRITE,                          1, -1, 1, &do_mdel},   // logged per key
+    {"incr",               2, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_incr},
+    {"decr",               2, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_decr},
+    {"incrby",             3, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_incrby},
+    {"decrby",             3, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_decrby},
+    {"incrbyfloat",        3, CMD_WRITE | CMD_DENYOOM,            1,  1, 1, &do_incrbyfloat},  // logged as set
+    {"pexpire",            3, CMD_WRITE | CMD_AOF,                1,  1, 1, &do_expire},
+    {"pttl",               2, CMD_READONLY,                       1,  1, 1, &do_ttl},
+    {"keys",               1, CMD_READONLY,                       0,  0, 0, &do_keys},
+    {"scan",              -2, CMD_READONLY,                       0,  0, 0, &do_scan},
+    {"zadd",              -4, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_zadd},
+    {"zload",             -4, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_zload},
+    {"zrem",               3, CMD_WRITE | CMD_AOF,                1,  1, 1, &do_zrem},
+    {"zscore",             3, CMD_READONLY,                       1,  1, 1, &do_zscore},
+    {"zquery",             6, CMD_READONLY,                       1,  1, 1, &do_zquery},
+    {"zscan",             -3, CMD_READONLY,                       1,  1, 1, &do_zscan},
+    {"zrank",              3, CMD_READONLY,                       1,  1, 1, &do_zrank},
+    {"zrevrank",           3, CMD_READONLY,                       1,  1, 1, &do_zrevrank},
+    {"zrange",            -4, CMD_READONLY,                       1,  1, 1, &do_zrange},
+    {"zrevrange",         -4, CMD_READONLY,                       1,  1, 1, &do_zrevrange},
+    {"zrangebyscore",     -4, CMD_READONLY,                       1,  1, 1, &do_zrangebyscore},
+    {"zrevrangebyscore",  -4, CMD_READONLY,                       1,  1, 1, &do_zrevrangebyscore},
+    {"zcount",             4, CMD_READONLY,                       1,  1, 1, &do_zcount},
+    {"zremrangebyrank",    4, CMD_WRITE | CMD_AOF,                1,  1, 1, &do_zremrangebyrank},
+    {"zremrangebyscore",   4, CMD_WRITE | CMD_AOF,                1,  1, 1, &do_zremrangebyscore},
+    {"zunionstore",       -4, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_zunionstore},
+    {"zinterstore",       -4, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_zinterstore},
+    {"zdiffstore",        -4, CMD_WRITE | CMD_AOF | CMD_DENYOOM,  1,  1, 1, &do_zdiffstore},
+    {"bgrewriteaof",       1, CMD_ADMIN | CMD_MAIN,               0,  0, 0, &do_aof_rewrite},
+    {"save",               1, CMD_ADMIN | CMD_MAIN,               0,  0, 0, &do_save},
+    {"bgsave",             1, CMD_ADMIN | CMD_MAIN,               0,  0, 0, &do_bgsave},
+    {"info",               1, CMD_ADMIN | CMD_MAIN,               0,  0, 0, &do_info},
+    {"config",            -3, CMD_ADMIN,                          0,  0, 0, &do_config},
+};
+const size_t k_num_cmds = sizeof(k_commands) / sizeof(k_commands[0]);
+static_assert(k_num_cmds <= k_max_cmds, "increase k_max_cmds");
+
+// case-insensitive lookup: open addressing on the lowercased name.
+// filled once by cmd_table_init(), read-only afterwards.
+const size_t k_cmd_slots = 64;  // power of 2, keep it sparse
+const size_t k_max_cmd_name = 16;
+static uint8_t g_cmd_slots[k_cmd_slots];    // index + 1, 0 for empty
+
+static uint32_t cmd_name_hash(const char *name, size_t len) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)tolower((uint8_t)name[i])) * 0x01000193;
+    }
+    return h;
+}
+
+static void cmd_table_init() {
+    for (size_t i = 0; i < k_num_cmds; i++) {
+        const char *name = k_commands[i].name;
+        assert(strlen(name) <= k_max_cmd_name);
+        size_t pos = cmd_name_hash(name, strlen(name)) & (k_cmd_slots - 1);
+        while (g_cmd_slots[pos]) {
+            pos = (pos + 1) & (k_cmd_slots - 1);
+        }
+        g_cmd_slots[pos] = (uint8_t)(i + 1);
+    }
+}
+
+static const Command *cmd_lookup(std::string_view name) {
+    if (name.size() > k_max_cmd_name) {
+        return NULL;
+    }
+    size_t pos = cmd_name_hash(name.data(), name.size()) & (k_cmd_slots - 1);
+    while (g_cmd_slots[pos]) {
+        const Command *c = &k_commands[g_cmd_slots[pos] - 1];
+        if (strlen(c->name) == name.size()
+            && strncasecmp(c->name, name.data(), name.size()) == 0)
+        {
+            return c;
+        }
+        pos = (pos + 1) & (k_cmd_slots - 1);
+    }
+    return NULL;
+}
+
+static bool cmd_arity_ok(const Command *c, size_t nargs) {
+    return c->arity >= 0 ? nargs == (size_t)c->arity : nargs >= (size_t)-c->arity;
+}
+
+// the keys of a multi-key command must be in the same shard
+static bool cmd_keys_local(const Command *c, const std::vector<std::string_view> &cmd) {
+    if (g_data.reactors.size() == 1 || c->last_key == (int32_t)c->first_key) {
+        return true;
+    }
+    size_t last = c->last_key < 0 ? cmd.size() + c->last_key : (size_t)c->last_key;
+    for (size_t i = c->first_key; i <= last; i += c->key_step) {
+        if (key_owner(cmd[i]) != g_reactor) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// per command stats, summed over the reactors
+static void do_info(std::vector<std::string_view> &, Buffer &out) {
+    std::string text;
+    for (size_t i = 0; i < k_num_cmds; i++) {
+        uint64_t calls = 0;
+        for (Reactor *r : g_data.reactors) {
+            calls += r->cmd_calls[i].load(std::memory_order_relaxed);
+        }
+        if (calls) {
+            text += "cmdstat_";
+            text += k_commands[i].name;
+            text += ":calls=" + std::to_string(calls) + "\n";
+        }
+    }
+    uint64_t evicted = 0;
+    for (Reactor *r : g_data.reactors) {
+        evicted += r->evicted_keys.load(std::memory_order_relaxed);
+    }
+    text += "used_memory:" + std::to_string(g_used_memory.load(std::memory_order_relaxed)) + "\n";
+    text += "maxmemory:" + std::to_string(g_data.maxmemory.load(std::memory_order_relaxed)) + "\n";
+    text += "maxmemory_policy:";
+    text += k_policy_names[g_data.maxmemory_policy.load(std::memory_order_relaxed)];
+    text += "\nevicted_keys:" + std::to_string(evicted) + "\n";
+    SlabStats slabs[k_slab_classes];
+    slab_stats(slabs);
+    for (const SlabStats &st : slabs) {
+        if (st.pages) {
+            text += "slab_" + std::to_string(st.size) + ":pages=" + std::to_string(st.pages)
+                + ",used=" + std::to_string(st.used) + ",free=" + std::to_string(st.free) + "\n";
+        }
+    }
+    if (g_data.child_pid >= 0) {
+        text += g_data.child_type == CHILD_AOF ? "aof_rewrite_progress:" : "rdb_bgsave_progress:";
+        text += std::to_string(g_data.child_progress)
+            + "/" + std::to_string(g_data.child_total) + "\n";
+    }
+    out_str(out, text.data(), text.size());
+}
+
+static void do_request(std::vector<std::string_view> &cmd, Buffer &out) {
+    const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c) {
         return out_err(out, ERR_UNKNOWN, "unknown command.");
     }
+    if (!cmd_arity_ok(c, cmd.size())) {
+        return out_err(out, ERR_BAD_ARG, "wrong number of arguments.");
+    }
+    if (!cmd_keys_local(c, cmd)) {
+        return out_err(out, ERR_BAD_ARG, "keys in different shards.");
+    }
+    // only the owning reactor writes its counters
+    std::atomic<uint64_t> &calls = g_reactor->cmd_calls[c - k_commands];
+    calls.store(calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if ((c->flags & CMD_DENYOOM) && !evict_for_write()) {
+        return out_err(out, ERR_OOM, "command not allowed when used memory > 'maxmemory'.");
+    }
+
+    size_t pos = out.size();
+    c->proc(cmd, out);
+    // 成功执行的写命令才写入 AOF
+    if ((c->flags & CMD_AOF) && g_data.aof_enabled && out[pos] != TAG_ERR) {
+        cmd[0] = c->name;   // normalize the case for the AOF
+        aof_append(cmd);    // written by aof_flush() later in this iteration
+    }
 }
 /*
 static void do_request(std::vector<std::string> &cmd, Buffer &out) {
@@ -1016,26 +3519,117 @@ static void response_begin(Buffer &out, size_t *header) {
     buf_append_u32(out, 0);     // reserve space
 }
 static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
+    return out.size() + out.ext_size(header) - header - 4;
 }
 static void response_end(Buffer &out, size_t header) {
     size_t msg_size = response_size(out, header);
     if (msg_size > k_max_msg) {
-        out.resize(header + 4);
+        out.truncate(header + 4);
         out_err(out, ERR_TOO_BIG, "response is too big.");
         msg_size = response_size(out, header);
     }
-    // message header
-    uint32_t len = (uint32_t)msg_size;
-    // memcpy(&out[header], &len, 4);
-    out.insert((uint8_t *)&len, 4, header);
-    
-    
+    // message header
+    uint32_t len = (uint32_t)msg_size;
+    // memcpy(&out[header], &len, 4);
+    out.insert((uint8_t *)&len, 4, header);
+    
+    
+}
+
+
+// a command executed by the reactor owning its key, on behalf of a
+// connection of another reactor. it travels there and back by the inboxes.
+struct Forward {
+    MPSCNode node;
+    Reactor *origin = NULL;
+    Conn *conn = NULL;
+    bool done = false;
+    std::vector<std::string> args;  // owns the data, the request frame is gone
+    Buffer out;     // the response, including the header
+    uint64_t aof_seq = 0;   // the AOF offset of the command, if logged
+    bool pause = false;     // no command, park the reactor, see reactors_pause()
+};
+
+static Reactor *key_owner(std::string_view key) {
+    size_t n = g_data.reactors.size();
+    if (n == 1) {
+        return g_data.reactors[0];
+    }
+    // use the high bits; the low bits of the hash select the hashtable slot
+    uint64_t h = str_hash((const uint8_t *)key.data(), key.size());
+    return g_data.reactors[((h * 0x9E3779B97F4A7C15ull) >> 32) % n];
+}
+
+// the reactor that owns the key of a command, NULL for keyless commands
+static Reactor *cmd_owner(const std::vector<std::string_view> &cmd) {
+    const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (c && c->proc == &do_scan && cmd_arity_ok(c, cmd.size())) {
+        return scan_owner(cmd[1]);  // the shard is in the cursor
+    }
+    if (c && (c->flags & CMD_MAIN)) {
+        return g_data.reactors[0];
+    }
+    if (!c || !c->first_key || !cmd_arity_ok(c, cmd.size())) {
+        return NULL;    // executed locally
+    }
+    return key_owner(cmd[c->first_key]);
+}
+
+static void reactor_wake(Reactor *r) {
+    if (!r->wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        (void)write(r->wake_fd, &one, sizeof(one));
+    }
+}
+
+static void forward_send(Reactor *to, Forward *fw) {
+    mpsc_push(&to->inbox, &fw->node);
+    reactor_wake(to);
+}
+
+// stop the other reactors between their commands, so that their shards
+// stay consistent while this one reads them or forks a snapshot of them.
+// only the 1st reactor pauses the others, see CMD_MAIN.
+static void reactors_pause() {
+    for (Reactor *r : g_data.reactors) {
+        if (r != g_reactor) {
+            Forward *fw = new Forward();
+            fw->pause = true;
+            forward_send(r, fw);
+        }
+    }
+    pthread_mutex_lock(&g_data.pause_mu);
+    while (g_data.pause_parked + 1 < g_data.reactors.size()) {
+        pthread_cond_wait(&g_data.pause_cond, &g_data.pause_mu);
+    }
+    pthread_mutex_unlock(&g_data.pause_mu);
+}
+
+static void reactors_resume() {
+    pthread_mutex_lock(&g_data.pause_mu);
+    g_data.pause_parked = 0;
+    g_data.pause_gen++;
+    pthread_cond_broadcast(&g_data.pause_cond);
+    pthread_mutex_unlock(&g_data.pause_mu);
 }
 
+// the other side of reactors_pause()
+static void reactor_park() {
+    pthread_mutex_lock(&g_data.pause_mu);
+    uint64_t gen = g_data.pause_gen;
+    g_data.pause_parked++;
+    pthread_cond_broadcast(&g_data.pause_cond);
+    while (g_data.pause_gen == gen) {
+        pthread_cond_wait(&g_data.pause_cond, &g_data.pause_mu);
+    }
+    pthread_mutex_unlock(&g_data.pause_mu);
+}
 
 // process 1 request if there is enough data
 static bool try_one_request(Conn *conn) {
+    if (conn->fwd_pending) {
+        return false;   // keep the responses in order
+    }
     // try to parse the protocol: message header
     if (conn->incoming.size() < 4) {
         return false;   // want read
@@ -1051,24 +3645,49 @@ static bool try_one_request(Conn *conn) {
     if (4 + len > conn->incoming.size()) {
         return false;   // want read
     }
-    // const uint8_t *request = &conn->incoming[4];
-    // 获取请求数据
-    uint8_t *request = new uint8_t[len];
-    conn->incoming.peek(request, 4, len);
+    // the request body: use it in place if it's contiguous in the buffer,
+    // otherwise copy it out once.
+    const uint8_t *request = NULL;
+    uint8_t *data = NULL;
+    size_t size = 0;
+    conn->incoming.get_continuous_data(4, &data, &size);
+    if (size >= len) {
+        request = data;
+    } else {
+        g_reactor->scratch.resize(len);
+        conn->incoming.peek(g_reactor->scratch.data(), 4, len);
+        request = g_reactor->scratch.data();
+    }
 
-    // got one request, do some application logic
-    std::vector<std::string> cmd;
+    // got one request, do some application logic.
+    // the arguments point into the request.
+    std::vector<std::string_view> &cmd = g_reactor->cmd;
+    cmd.clear();
     if (parse_req(request, len, cmd) < 0) {
-        delete[] request;
         msg("bad request");
         conn->want_close = true;
         return false;   // want close
     }
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
-    delete[] request;
+
+    Reactor *owner = cmd_owner(cmd);
+    if (owner && owner != g_reactor) {
+        // the key lives in another shard; copy the arguments
+        Forward *fw = new Forward();
+        fw->origin = g_reactor;
+        fw->conn = conn;
+        fw->args.assign(cmd.begin(), cmd.end());
+        conn->fwd_pending = true;
+        forward_send(owner, fw);
+    } else {
+        size_t header_pos = 0;
+        uint64_t aof_seq = g_reactor->aof_seq;
+        response_begin(conn->outgoing, &header_pos);
+        do_request(cmd, conn->outgoing);
+        response_end(conn->outgoing, header_pos);
+        if (g_reactor->aof_seq != aof_seq) {
+            conn->aof_wait = g_reactor->aof_seq;    // logged to the AOF
+        }
+    }
 
     // application logic done! remove the request message.
     // buf_consume(conn->incoming, 4 + len);
@@ -1079,14 +3698,11 @@ static bool try_one_request(Conn *conn) {
 
 // application callback when the socket is writable
 static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    // 获取连续的数据块用于写入
-    uint8_t *data_ptr;
-    size_t data_size;
-    conn->outgoing.get_continuous_data(0, &data_ptr, &data_size);
-    
-    ssize_t rv = write(conn->fd, data_ptr, data_size);
-    // ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    assert(!conn->outgoing.empty());
+    // 一次 writev() 发送环绕的两段数据以及引用的大 value
+    struct iovec iov[k_max_iov];
+    int iovcnt = conn->outgoing.get_iovecs(iov, k_max_iov);
+    ssize_t rv = writev(conn->fd, iov, iovcnt);
     if (rv < 0 && errno == EAGAIN) {
         return; // actually not ready
     }
@@ -1097,21 +3713,114 @@ static void handle_write(Conn *conn) {
     }
 
     // remove written data from `outgoing`
-    // buf_consume(conn->outgoing, (size_t)rv);
-    conn->outgoing.consume((size_t)rv);
+    conn->outgoing.advance((size_t)rv);
 
     // update the readiness intention
-    if (conn->outgoing.size() == 0) {   // all data written
+    if (conn->outgoing.empty()) {   // all data written
         conn->want_read = true;
         conn->want_write = false;
     } // else: want write
 }
 
+// parse the buffered requests and update the readiness intention
+const size_t k_get_batch = 16;  // pipelined GETs resolved together
+
+// a burst of pipelined GETs at the front of the input: look up the keys
+// together with hm_lookup_many(), so that their cache misses overlap.
+// only the contiguous requests for the local shard are taken.
+static bool try_get_batch(Conn *conn) {
+    if (conn->fwd_pending || conn->incoming.size() < 4) {
+        return false;
+    }
+    uint32_t len = conn->incoming.peek_u32(0);
+    if (len > k_max_msg || 4 + len >= conn->incoming.size()) {
+        return false;   // not a burst
+    }
+    std::vector<std::string_view> &cmd = g_reactor->cmd;
+    const Command *get = NULL;
+    std::string_view keys[k_get_batch];
+    size_t n = 0;
+    size_t pos = 0;
+    while (n < k_get_batch && pos + 4 <= conn->incoming.size()) {
+        len = conn->incoming.peek_u32(pos);
+        uint8_t *data = NULL;
+        size_t size = 0;
+        if (len > k_max_msg || pos + 4 + len > conn->incoming.size()) {
+            break;
+        }
+        conn->incoming.get_continuous_data(pos + 4, &data, &size);
+        cmd.clear();
+        if (size < len || parse_req(data, len, cmd) < 0 || cmd.size() != 2) {
+            break;
+        }
+        const Command *c = cmd_lookup(cmd[0]);
+        if (!c || c->proc != &do_get || key_owner(cmd[1]) != g_reactor) {
+            break;
+        }
+        get = c;
+        keys[n++] = cmd[1];
+        pos += 4 + len;
+    }
+    if (n < 2) {
+        return false;   // leave it to try_one_request()
+    }
+
+    // a small batch, no heap allocations
+    LookupKey lkeys[k_get_batch];
+    HNode *pkeys[k_get_batch];
+    HNode *nodes[k_get_batch];
+    db_lookup_keys(keys, n, 1, lkeys, pkeys, nodes);
+    for (size_t i = 0; i < n; i++) {
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        out_get(conn->outgoing, nodes[i]);
+        response_end(conn->outgoing, header_pos);
+    }
+    std::atomic<uint64_t> &calls = g_reactor->cmd_calls[get - k_commands];
+    calls.store(calls.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    conn->incoming.consume(pos);
+    return true;
+}
+
+static void handle_input(Conn *conn) {
+    // parse requests and generate responses
+    while (try_get_batch(conn) || try_one_request(conn)) {}
+    // Q: Why calling this in a loop? See the explanation of "pipelining".
+
+    // update the readiness intention
+    if (!conn->outgoing.empty()) {      // has a response
+        conn->want_read = false;
+        conn->want_write = true;
+    }   // else: want read
+    // appendfsync always: hold the replies until the writes are durable
+    if (g_data.aof_fsync == AOF_FSYNC_ALWAYS && conn->want_write
+        && conn->aof_wait > g_data.aof_synced.load())
+    {
+        conn->want_write = false;
+        if (dlist_empty(&conn->aof_node)) {
+            dlist_insert_before(&g_reactor->aof_waiters, &conn->aof_node);
+        }
+    }
+}
+
+static void handle_eof(Conn *conn) {
+    if (conn->incoming.size() == 0) {
+        msg("client closed");
+    } else {
+        msg("unexpected EOF");
+    }
+    conn->want_close = true;
+}
+
+const size_t k_read_size = 64 * 1024;
+
 // application callback when the socket is readable
 static void handle_read(Conn *conn) {
-    // read some data
-    uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    // read some data directly into the incoming buffer
+    uint8_t *buf = NULL;
+    size_t size = 0;
+    conn->incoming.reserve_tail(k_read_size, &buf, &size);
+    ssize_t rv = read(conn->fd, buf, size);
     if (rv < 0 && errno == EAGAIN) {
         return; // actually not ready
     }
@@ -1123,29 +3832,17 @@ static void handle_read(Conn *conn) {
     }
     // handle EOF
     if (rv == 0) {
-        if (conn->incoming.size() == 0) {
-            msg("client closed");
-        } else {
-            msg("unexpected EOF");
-        }
-        conn->want_close = true;
-        return; // want close
+        return handle_eof(conn);    // want close
     }
     // got some new data
-    buf_append(conn->incoming, buf, (size_t)rv);
-
-    // parse requests and generate responses
-    while (try_one_request(conn)) {}
-    // Q: Why calling this in a loop? See the explanation of "pipelining".
+    conn->incoming.commit((size_t)rv);
 
-    // update the readiness intention
-    if (conn->outgoing.size() > 0) {    // has a response
-        conn->want_read = false;
-        conn->want_write = true;
+    handle_input(conn);
+    if (conn->want_write) {
         // The socket is likely ready to write in a request-response protocol,
         // try to write it without waiting for the next iteration.
         return handle_write(conn);
-    }   // else: want read
+    }
 }
 
 const uint64_t k_idle_timeout_ms = 5 * 1000;
@@ -1154,13 +3851,18 @@ static uint32_t next_timer_ms() {
     uint64_t now_ms = get_monotonic_msec();
     uint64_t next_ms = (uint64_t)-1;
     // idle timers using a linked list
-    if (!dlist_empty(&g_data.idle_list)) {
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
+    if (!dlist_empty(&g_reactor->idle_list)) {
+        Conn *conn = container_of(g_reactor->idle_list.next, Conn, idle_node);
         next_ms = conn->last_active_ms + k_idle_timeout_ms;
     }
     // TTL timers using a heap
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
-        next_ms = g_data.heap[0].val;
+    if (!g_reactor->heap.empty() && g_reactor->heap[0].val < next_ms) {
+        next_ms = g_reactor->heap[0].val;
+    }
+    // poll the AOF rewrite child, it belongs to the 1st reactor
+    if (g_reactor == g_data.reactors[0]
+        && g_data.child_pid > 0 && g_data.child_poll_ms < next_ms) {
+        next_ms = g_data.child_poll_ms;
     }
     // timeout value
     if (next_ms == (uint64_t)-1) {
@@ -1172,15 +3874,12 @@ static uint32_t next_timer_ms() {
     return (int32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same(HNode *node, HNode *key) {
-    return node == key;
-}
-
 static void process_timers() {
     uint64_t now_ms = get_monotonic_msec();
+    g_reactor->lru_clock = (uint32_t)(now_ms / 1000);
     // idle timers using a linked list
-    while (!dlist_empty(&g_data.idle_list)) {
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
+    while (!dlist_empty(&g_reactor->idle_list)) {
+        Conn *conn = container_of(g_reactor->idle_list.next, Conn, idle_node);
         uint64_t next_ms = conn->last_active_ms + k_idle_timeout_ms;
         if (next_ms >= now_ms) {
             break;  // not expired
@@ -1192,12 +3891,12 @@ static void process_timers() {
     // TTL timers using a heap
     const size_t k_max_works = 2000;
     size_t nworks = 0;
-    const std::vector<HeapItem> &heap = g_data.heap;
+    const std::vector<HeapItem> &heap = g_reactor->heap;
     while (!heap.empty() && heap[0].val < now_ms) {
         Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+        HNode *node = hm_delete(&g_reactor->db, &ent->node, &hnode_same);
         assert(node == &ent->node);
-        // fprintf(stderr, "key expired: %s\n", ent->key.c_str());
+        // fprintf(stderr, "key expired: %.*s\n", (int)ent->klen, ent->key);
         // delete the key
         entry_del(ent);
         if (nworks++ >= k_max_works) {
@@ -1205,21 +3904,426 @@ static void process_timers() {
             break;
         }
     }
+    // the AOF rewrite child
+    if (g_reactor == g_data.reactors[0]) {
+        child_poll();
+    }
 }
 
-int main() {
-    // initialization
-    dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.thread_pool, 4);
-    aof_init();
+// update the idle timer by moving conn to the end of the list
+static void conn_touch(Conn *conn) {
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&g_reactor->idle_list, &conn->idle_node);
+}
+
+// deliver the reply of a forwarded command to its connection
+static void forward_reply(Conn *conn, Forward *fw) {
+    conn->fwd_pending = false;
+    if (conn->fd < 0) {
+        conn_release_dead(conn);
+    } else {
+        conn->outgoing.append_buffer(fw->out);
+        conn->aof_wait = std::max(conn->aof_wait, fw->aof_seq);
+        handle_input(conn);     // the rest of the pipelined requests
+        conn_resume(conn);
+    }
+    delete fw;
+}
+
+// handle the commands forwarded to this reactor, and the replies
+static void process_inbox() {
+    // clear it before draining, so that a later push wakes us up again
+    g_reactor->wake_pending.store(false);
+    while (MPSCNode *node = mpsc_pop(&g_reactor->inbox)) {
+        Forward *fw = container_of(node, Forward, node);
+        if (fw->pause) {
+            delete fw;
+            reactor_park();
+            continue;
+        }
+        if (!fw->done) {
+            // execute it on the keyspace shard of this reactor
+            std::vector<std::string_view> cmd(fw->args.begin(), fw->args.end());
+            size_t header_pos = 0;
+            uint64_t aof_seq = g_reactor->aof_seq;
+            response_begin(fw->out, &header_pos);
+            do_request(cmd, fw->out);
+            response_end(fw->out, header_pos);
+            if (g_reactor->aof_seq != aof_seq) {
+                fw->aof_seq = g_reactor->aof_seq;
+            }
+            fw->done = true;
+            forward_send(fw->origin, fw);
+            continue;
+        }
+        // the reply to a command forwarded by this reactor
+        Conn *conn = fw->conn;
+        if (conn->fd >= 0 && conn->inflight > 0) {
+            // io_uring is sending from `outgoing`; appending to it may
+            // reallocate it. continue when the send completes.
+            conn->fwd_reply = fw;
+            continue;
+        }
+        forward_reply(conn, fw);
+    }
+}
+
+static void epoll_event_loop() {
+    int fd = g_reactor->listen_fd;
+    g_reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_reactor->epfd < 0) {
+        die("epoll_create1()");
+    }
+    struct epoll_event lev = {};
+    lev.events = EPOLLIN;
+    lev.data.fd = fd;
+    if (epoll_ctl(g_reactor->epfd, EPOLL_CTL_ADD, fd, &lev) < 0) {
+        die("epoll_ctl()");
+    }
+    struct epoll_event wev = {};
+    wev.events = EPOLLIN;
+    wev.data.fd = g_reactor->wake_fd;
+    if (epoll_ctl(g_reactor->epfd, EPOLL_CTL_ADD, g_reactor->wake_fd, &wev) < 0) {
+        die("epoll_ctl()");
+    }
+
+    const int k_max_events = 1024;
+    std::vector<struct epoll_event> events(k_max_events);
+    while (true) {
+        // wait for readiness; only ready fds are reported
+        int32_t timeout_ms = next_timer_ms();
+        int rv = epoll_wait(g_reactor->epfd, events.data(), k_max_events, timeout_ms);
+        if (rv < 0 && errno == EINTR) {
+            continue;   // not an error
+        }
+        if (rv < 0) {
+            die("epoll_wait");
+        }
+
+        for (int i = 0; i < rv; ++i) {
+            uint32_t ready = events[i].events;
+            int cfd = events[i].data.fd;
+            // handle the listening socket
+            if (cfd == fd) {
+                handle_accept(fd);
+                continue;
+            }
+            // handle the other reactors
+            if (cfd == g_reactor->wake_fd) {
+                uint64_t val = 0;
+                (void)read(cfd, &val, sizeof(val));
+                process_inbox();
+                aof_release_waiters();
+                continue;
+            }
+            // the connection may have been closed by an earlier event
+            if ((size_t)cfd >= g_reactor->fd2conn.size() || !g_reactor->fd2conn[cfd]) {
+                continue;
+            }
+            Conn *conn = g_reactor->fd2conn[cfd];
+            conn_touch(conn);
+
+            // handle IO
+            if ((ready & EPOLLIN) && conn->want_read) {
+                handle_read(conn);  // application logic
+            }
+            if ((ready & EPOLLOUT) && conn->want_write) {
+                handle_write(conn); // application logic
+            }
+
+            // close the socket from socket error or application logic
+            if ((ready & EPOLLERR) || conn->want_close) {
+                conn_destroy(conn);
+                continue;
+            }
+            // register the new intention, if any
+            conn_update_events(conn);
+            if (conn->want_close) {
+                conn_destroy(conn);
+            }
+        }   // for each ready fd
+
+        // handle timers
+        process_timers();
+        // the AOF records of this iteration, in 1 write
+        aof_flush();
+    }   // the event loop
+}
+
+// io_uring operations, encoded in the low bits of `user_data`
+enum {
+    OP_ACCEPT       = 1,
+    OP_READ         = 2,
+    OP_WRITE        = 3,
+    OP_AOF_WRITE    = 4,
+    OP_WAKE         = 5,
+};
+
+static uint64_t uring_udata(void *ptr, uint32_t op) {
+    assert(((uintptr_t)ptr & 7) == 0);
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static struct io_uring_sqe *uring_sqe() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_reactor->ring);
+    if (!sqe) {
+        // the submission queue is full, flush it without waiting
+        (void)uring_submit_and_wait(&g_reactor->ring, 0, -1);
+        sqe = uring_get_sqe(&g_reactor->ring);
+    }
+    assert(sqe);
+    return sqe;
+}
+
+static void uring_queue_accept(int fd) {
+    g_reactor->accept_addrlen = sizeof(g_reactor->accept_addr);
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&g_reactor->accept_addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&g_reactor->accept_addrlen;
+    sqe->user_data = uring_udata(NULL, OP_ACCEPT);
+}
+
+// receive directly into the incoming buffer
+static void uring_queue_read(Conn *conn) {
+    uint8_t *buf = NULL;
+    size_t size = 0;
+    conn->incoming.reserve_tail(k_read_size, &buf, &size);
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)size;
+    sqe->user_data = uring_udata(conn, OP_READ);
+    conn->inflight++;
+}
+
+// send directly from the outgoing buffer, including the referenced values
+static void uring_queue_write(Conn *conn) {
+    memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+    conn->send_msg.msg_iov = conn->send_iov;
+    conn->send_msg.msg_iovlen = conn->outgoing.get_iovecs(conn->send_iov, k_max_iov);
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_udata(conn, OP_WRITE);
+    conn->inflight++;
+}
+
+static void uring_queue_wake() {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = g_reactor->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&g_reactor->wake_val;
+    sqe->len = sizeof(g_reactor->wake_val);
+    sqe->user_data = uring_udata(NULL, OP_WAKE);
+}
+
+// queue the next operation according to the application's intention.
+// there is at most 1 pending operation per connection.
+static void uring_conn_resume(Conn *conn) {
+    if (conn->want_close) {
+        return conn_destroy(conn);
+    }
+    if (conn->inflight > 0) {
+        return;
+    }
+    if (conn->want_write) {
+        uring_queue_write(conn);
+    } else if (conn->want_read && !conn->fwd_pending) {
+        // a pending read would hold back the forwarded reply
+        uring_queue_read(conn);
+    }
+}
+
+static void uring_on_accept(int32_t res) {
+    uring_queue_accept(g_reactor->listen_fd);   // keep accepting
+    if (res < 0) {
+        errno = -res;
+        msg_errno("accept() error");
+        return;
+    }
+    log_new_client(g_reactor->accept_addr);
+    Conn *conn = conn_new(res);
+    uring_conn_resume(conn);
+}
+
+static void uring_on_io(Conn *conn, uint32_t op, int32_t res) {
+    conn->inflight--;
+    if (conn->fd >= 0) {
+        conn_touch(conn);
+        if (res < 0) {
+            errno = -res;
+            msg_errno(op == OP_READ ? "read() error" : "write() error");
+            conn->want_close = true;
+        } else if (op == OP_READ) {
+            if (res == 0) {
+                handle_eof(conn);
+            } else {
+                conn->incoming.commit((size_t)res);
+                handle_input(conn);
+            }
+        } else {
+            conn->outgoing.advance((size_t)res);
+            if (conn->outgoing.empty()) {   // all data written
+                conn->want_read = true;
+                conn->want_write = false;
+            }
+        }
+    }
+    if (conn->fwd_reply && conn->inflight == 0) {
+        // the reply held back by process_inbox()
+        Forward *fw = conn->fwd_reply;
+        conn->fwd_reply = NULL;
+        return forward_reply(conn, fw);
+    }
+    if (conn->fd < 0) {     // closed while the operation was pending
+        return conn_release_dead(conn);
+    }
+    uring_conn_resume(conn);
+}
+
+// batch the buffered AOF data into the next io_uring_enter()
+static void uring_queue_aof() {
+    if (!g_data.aof_enabled || g_data.aof_fd < 0 || !aof_use_uring()) {
+        return;
+    }
+    if (g_data.aof_inflight || g_data.aof_buf.empty()) {
+        return;
+    }
+    // the in-flight data must not move, so take it out of the ring buffer
+    size_t size = g_data.aof_buf.size();
+    g_data.aof_wbuf.resize(size);
+    g_data.aof_buf.peek(g_data.aof_wbuf.data(), 0, size);
+    g_data.aof_buf.consume(size);
+    g_data.aof_woff = 0;
+    g_data.aof_wgen = g_data.aof_gen;
+
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = g_data.aof_fd;
+    sqe->off = (uint64_t)-1;    // the file position (O_APPEND)
+    sqe->addr = (uint64_t)(uintptr_t)g_data.aof_wbuf.data();
+    sqe->len = (uint32_t)size;
+    sqe->user_data = uring_udata(NULL, OP_AOF_WRITE);
+    g_data.aof_inflight = true;
+}
+
+static void uring_on_aof_write(int32_t res) {
+    g_data.aof_inflight = false;
+    if (g_data.aof_wgen != g_data.aof_gen) {
+        // the file was replaced by an AOF rewrite meanwhile, which has
+        // dumped and synced the data already
+        pthread_mutex_lock(&g_data.aof_mu);
+        aof_on_written(g_data.aof_wbuf.size() - g_data.aof_woff);
+        pthread_mutex_unlock(&g_data.aof_mu);
+        return;
+    }
+    if (res < 0) {
+        errno = -res;
+        return aof_write_error();
+    }
+    g_data.aof_woff += (size_t)res;
+    pthread_mutex_lock(&g_data.aof_mu);
+    aof_on_written((size_t)res);
+    pthread_mutex_unlock(&g_data.aof_mu);
+    if (g_data.aof_woff < g_data.aof_wbuf.size()) {
+        // short write, queue the rest
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = g_data.aof_fd;
+        sqe->off = (uint64_t)-1;
+        sqe->addr = (uint64_t)(uintptr_t)(g_data.aof_wbuf.data() + g_data.aof_woff);
+        sqe->len = (uint32_t)(g_data.aof_wbuf.size() - g_data.aof_woff);
+        sqe->user_data = uring_udata(NULL, OP_AOF_WRITE);
+        g_data.aof_inflight = true;
+    }
+}
+
+static void uring_event_loop() {
+    uring_queue_accept(g_reactor->listen_fd);
+    uring_queue_wake();
+    while (true) {
+        // the AOF records of the last iteration
+        aof_flush();
+        uring_queue_aof();
+        // submit all the queued operations and wait, in 1 syscall
+        int32_t timeout_ms = next_timer_ms();
+        int rv = uring_submit_and_wait(&g_reactor->ring, 1, timeout_ms);
+        if (rv < 0 && errno == EINTR) {
+            continue;   // not an error
+        }
+        if (rv < 0) {
+            die("io_uring_enter");
+        }
+
+        // handle all completions
+        while (struct io_uring_cqe *cqe = uring_peek_cqe(&g_reactor->ring)) {
+            uint64_t udata = cqe->user_data;
+            int32_t res = cqe->res;
+            uring_cqe_seen(&g_reactor->ring);
+
+            uint32_t op = udata & 7;
+            void *ptr = (void *)(uintptr_t)(udata & ~(uint64_t)7);
+            if (op == OP_ACCEPT) {
+                uring_on_accept(res);
+            } else if (op == OP_READ || op == OP_WRITE) {
+                uring_on_io((Conn *)ptr, op, res);
+            } else if (op == OP_WAKE) {
+                uring_queue_wake();
+                process_inbox();
+                aof_release_waiters();
+            } else if (op == OP_AOF_WRITE) {
+                uring_on_aof_write(res);
+            }
+        }
+
+        // handle timers
+        process_timers();
+    }   // the event loop
+}
+
+static void conn_resume(Conn *conn) {
+    if (g_data.io_backend == IO_URING) {
+        return uring_conn_resume(conn);
+    }
+    if (conn->want_write) {
+        handle_write(conn);     // likely writable
+    }
+    conn_update_events(conn);
+    if (conn->want_close) {
+        conn_destroy(conn);
+    }
+}
+
+static void reactor_init(Reactor *r, size_t id) {
+    r->id = id;
+    dlist_init(&r->idle_list);
+    dlist_init(&r->aof_waiters);
+    mpsc_init(&r->inbox);
+    // blocking, so that io_uring waits for it instead of failing with EAGAIN
+    r->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (r->wake_fd < 0) {
+        die("eventfd()");
+    }
+}
 
-    // the listening socket
+static int listen_socket(bool reuseport) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         die("socket()");
     }
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuseport) {
+        // each reactor has its own listening socket; the kernel balances them
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
 
     // bind
     struct sockaddr_in addr = {};
@@ -1231,87 +4335,138 @@ int main() {
         die("bind()");
     }
 
-    // set the listen fd to nonblocking mode
-    fd_set_nb(fd);
+    // set the listen fd to nonblocking mode.
+    // io_uring polls internally, and would return EAGAIN for it instead.
+    if (g_data.io_backend != IO_URING) {
+        fd_set_nb(fd);
+    }
 
     // listen
     rv = listen(fd, SOMAXCONN);
     if (rv) {
         die("listen()");
     }
+    return fd;
+}
 
-    // the event loop
-    std::vector<struct pollfd> poll_args;
-    while (true) {
-        // prepare the arguments of the poll()
-        poll_args.clear();
-        // put the listening sockets in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
-        // the rest are connection sockets
-        for (Conn *conn : g_data.fd2conn) {
-            if (!conn) {
-                continue;
+static void *reactor_main(void *arg) {
+    g_reactor = (Reactor *)arg;
+    if (g_data.io_backend == IO_URING) {
+        uring_event_loop();
+    } else {
+        epoll_event_loop();
+    }
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: redis-server [--io-uring] [--threads N]"
+        " [--appendonly yes|no] [--appendfsync always|everysec|no]"
+        " [--aof-rdb-preamble yes|no] [--maxmemory bytes]"
+        " [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]"
+        " [--<config parameter> value]\n");
+    exit(1);
+}
+
+static bool parse_yes_no(const char *arg, bool *out) {
+    if (strcmp(arg, "yes") == 0 || strcmp(arg, "no") == 0) {
+        *out = arg[0] == 'y';
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    // options
+    bool want_uring = false;
+    size_t nthreads = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--io-uring") == 0) {
+            want_uring = true;
+        } else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "always") == 0) {
+                g_data.aof_fsync = AOF_FSYNC_ALWAYS;
+            } else if (strcmp(policy, "everysec") == 0) {
+                g_data.aof_fsync = AOF_FSYNC_EVERYSEC;
+            } else if (strcmp(policy, "no") == 0) {
+                g_data.aof_fsync = AOF_FSYNC_NO;
+            } else {
+                usage();
             }
-            // always poll() for error
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
-            // poll() flags from the application's intent
-            if (conn->want_read) {
-                pfd.events |= POLLIN;
+        } else if (strcmp(argv[i], "--appendonly") == 0 && i + 1 < argc) {
+            if (!parse_yes_no(argv[++i], &g_data.aof_enabled)) {
+                usage();
             }
-            if (conn->want_write) {
-                pfd.events |= POLLOUT;
+        } else if (strcmp(argv[i], "--aof-rdb-preamble") == 0 && i + 1 < argc) {
+            if (!parse_yes_no(argv[++i], &g_data.aof_rdb_preamble)) {
+                usage();
             }
-            poll_args.push_back(pfd);
-        }
-
-        // wait for readiness
-        int32_t timeout_ms = next_timer_ms();
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
-        if (rv < 0 && errno == EINTR) {
-            continue;   // not an error
-        }
-        if (rv < 0) {
-            die("poll");
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nthreads = strtoul(argv[++i], NULL, 10);
+            if (nthreads == 0 || nthreads > 1024) {
+                usage();
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0 && i + 1 < argc) {
+            // the parameters of CONFIG SET
+            const ConfigParam *p = config_lookup(argv[i] + 2);
+            if (!p || !config_set(p, argv[++i])) {
+                usage();
+            }
+        } else {
+            usage();
         }
+    }
 
-        // handle the listening socket
-        if (poll_args[0].revents) {
-            handle_accept(fd);
+    // initialization
+    // a random hash seed, so the clients can't predict the collisions
+    if (getrandom(&g_hash_seed, sizeof(g_hash_seed), 0) != sizeof(g_hash_seed)) {
+        g_hash_seed ^= get_monotonic_msec() ^ (uint64_t)getpid() << 32;
+    }
+    cmd_table_init();
+    for (size_t i = 0; i < nthreads; ++i) {
+        Reactor *r = new Reactor();
+        reactor_init(r, i);
+        g_data.reactors.push_back(r);
+    }
+    g_reactor = g_data.reactors[0];     // the main thread runs the 1st one
+    thread_pool_init(&g_data.thread_pool, 4);
+    if (want_uring) {
+        const unsigned k_ring_entries = 4096;
+        size_t n = 0;
+        while (n < nthreads && uring_init(&g_data.reactors[n]->ring, k_ring_entries) == 0) {
+            n++;
         }
-
-        // handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); ++i) { // note: skip the 1st
-            uint32_t ready = poll_args[i].revents;
-            if (ready == 0) {
-                continue;
+        if (n == nthreads) {
+            g_data.io_backend = IO_URING;
+            msg("I/O backend: io_uring");
+        } else {
+            msg_errno("io_uring unavailable, falling back to epoll");
+            for (size_t i = 0; i < n; ++i) {
+                uring_destroy(&g_data.reactors[i]->ring);
             }
-            Conn *conn = g_data.fd2conn[poll_args[i].fd];
-
-            // update the idle timer by moving conn to the end of the list
-            conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+        }
+    }
+    if (g_data.aof_enabled) {
+        aof_init();
+    } else {
+        load_rdb_file();
+    }
 
-            // handle IO
-            if (ready & POLLIN) {
-                assert(conn->want_read);
-                handle_read(conn);  // application logic
-            }
-            if (ready & POLLOUT) {
-                assert(conn->want_write);
-                handle_write(conn); // application logic
-            }
+    // the listening sockets
+    for (Reactor *r : g_data.reactors) {
+        r->listen_fd = listen_socket(nthreads > 1);
+    }
 
-            // close the socket from socket error or application logic
-            if ((ready & POLLERR) || conn->want_close) {
-                conn_destroy(conn);
-            }
-        }   // for each connection sockets
+    // the event loops
+    for (size_t i = 1; i < nthreads; ++i) {
+        Reactor *r = g_data.reactors[i];
+        if (pthread_create(&r->thread, NULL, &reactor_main, r) != 0) {
+            die("pthread_create()");
+        }
+    }
+    reactor_main(g_data.reactors[0]);
 
-        // handle timers
-        process_timers();
-    }   // the event loop
     if (g_data.aof_fd != -1) {
         close(g_data.aof_fd);
         g_data.aof_fd = -1;
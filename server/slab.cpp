@@ -0,0 +1,178 @@
+#include <assert.h>
+#include <stdlib.h>     // malloc(), free()
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "slab.h"
+
+
+const size_t k_page_size = 64 << 10;    // also the alignment of a page
+const size_t k_pages_per_map = 32;      // mapped together
+
+struct SlabCache;
+
+// at the start of each page, found by masking the address of an object
+struct alignas(16) SlabPage {
+    SlabCache *owner;
+    size_t cls;
+};
+
+struct FreeObj {
+    FreeObj *next;
+};
+
+struct SlabClass {
+    FreeObj *free = NULL;                   // freed by the owner
+    std::atomic<FreeObj *> remote{NULL};    // freed by other threads
+    char *pos = NULL;                       // the uncarved part of the newest page
+    char *end = NULL;
+    // written by the owner only, read by slab_stats()
+    std::atomic<uint64_t> pages{0};
+    std::atomic<uint64_t> used{0};
+};
+
+// the pools of a thread
+struct SlabCache {
+    SlabClass classes[k_slab_classes];
+    char *pages = NULL;     // the unused part of the last mapping
+    char *pages_end = NULL;
+};
+
+// all the caches, for the stats. threads are never destroyed.
+static std::mutex g_caches_mu;
+static std::vector<SlabCache *> g_caches;
+static thread_local SlabCache *t_cache = NULL;
+
+static SlabCache *cache_get() {
+    if (!t_cache) {
+        t_cache = new SlabCache();
+        std::lock_guard<std::mutex> lock(g_caches_mu);
+        g_caches.push_back(t_cache);
+    }
+    return t_cache;
+}
+
+static size_t class_of(size_t size) {
+    return (size + k_slab_align - 1) / k_slab_align - 1;
+}
+
+static size_t class_size(size_t cls) {
+    return (cls + 1) * k_slab_align;
+}
+
+static size_t objs_per_page(size_t cls) {
+    return (k_page_size - sizeof(SlabPage)) / class_size(cls);
+}
+
+// single writer
+static void counter_add(std::atomic<uint64_t> &c, int64_t delta) {
+    c.store(c.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// map a few pages at a time, aligned by trimming the ends. a page from
+// aligned_alloc() would leave a gap in the malloc() heap for each page.
+static SlabPage *page_map(SlabCache *cache) {
+    if (cache->pages == cache->pages_end) {
+        size_t len = k_page_size * (k_pages_per_map + 1);
+        void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(ptr != MAP_FAILED);
+        uintptr_t start = ((uintptr_t)ptr + k_page_size - 1) & ~(uintptr_t)(k_page_size - 1);
+        uintptr_t end = start + k_page_size * k_pages_per_map;
+        if (start > (uintptr_t)ptr) {
+            munmap(ptr, start - (uintptr_t)ptr);
+        }
+        if ((uintptr_t)ptr + len > end) {
+            munmap((void *)end, (uintptr_t)ptr + len - end);
+        }
+        cache->pages = (char *)start;
+        cache->pages_end = (char *)end;
+    }
+    SlabPage *page = (SlabPage *)cache->pages;
+    cache->pages += k_page_size;
+    return page;
+}
+
+static void page_new(SlabCache *cache, size_t cls) {
+    SlabPage *page = page_map(cache);
+    page->owner = cache;
+    page->cls = cls;
+    SlabClass *sc = &cache->classes[cls];
+    sc->pos = (char *)(page + 1);
+    sc->end = sc->pos + objs_per_page(cls) * class_size(cls);
+    counter_add(sc->pages, 1);
+}
+
+void *slab_alloc(size_t size) {
+    assert(size > 0);
+    if (size > k_slab_max) {
+        void *ptr = malloc(size);
+        assert(ptr);
+        return ptr;
+    }
+    SlabCache *cache = cache_get();
+    size_t cls = class_of(size);
+    SlabClass *sc = &cache->classes[cls];
+    if (!sc->free && sc->remote.load(std::memory_order_relaxed)) {
+        // take the whole list of the other threads
+        sc->free = sc->remote.exchange(NULL, std::memory_order_acquire);
+        int64_t n = 0;
+        for (FreeObj *obj = sc->free; obj; obj = obj->next) {
+            n++;
+        }
+        counter_add(sc->used, -n);
+    }
+    counter_add(sc->used, 1);
+    if (FreeObj *obj = sc->free) {
+        sc->free = obj->next;
+        return obj;
+    }
+    if (sc->pos == sc->end) {
+        page_new(cache, cls);
+    }
+    void *ptr = sc->pos;
+    sc->pos += class_size(cls);
+    return ptr;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (size > k_slab_max) {
+        return free(ptr);
+    }
+    SlabPage *page = (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_page_size - 1));
+    assert(page->cls == class_of(size));
+    SlabClass *sc = &page->owner->classes[page->cls];
+    FreeObj *obj = (FreeObj *)ptr;
+    if (page->owner == t_cache) {
+        obj->next = sc->free;
+        sc->free = obj;
+        counter_add(sc->used, -1);
+        return;
+    }
+    // push to the owner; it takes the whole list, so there is no ABA
+    FreeObj *head = sc->remote.load(std::memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while (!sc->remote.compare_exchange_weak(
+        head, obj, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void slab_stats(SlabStats *out) {
+    for (size_t cls = 0; cls < k_slab_classes; cls++) {
+        out[cls] = SlabStats{};
+        out[cls].size = class_size(cls);
+    }
+    std::lock_guard<std::mutex> lock(g_caches_mu);
+    for (SlabCache *cache : g_caches) {
+        for (size_t cls = 0; cls < k_slab_classes; cls++) {
+            out[cls].pages += cache->classes[cls].pages.load(std::memory_order_relaxed);
+            out[cls].used += cache->classes[cls].used.load(std::memory_order_relaxed);
+        }
+    }
+    for (size_t cls = 0; cls < k_slab_classes; cls++) {
+        // the objects freed by other threads and not yet taken count as used.
+        // the counters are read while changing, so it's approximate.
+        uint64_t total = out[cls].pages * objs_per_page(cls);
+        out[cls].free = total > out[cls].used ? total - out[cls].used : 0;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// size-class pools for the small objects of the keyspace: entries, zset
+// chunks. each thread carves objects of a class from its own 64KB pages
+// and reuses the freed ones, without locks or per-object headers.
+// an object freed by another thread, e.g. by the thread pool, goes back
+// to the thread that owns its page through a lock-free list.
+// the pages are kept for reuse, not returned to the system.
+const size_t k_slab_align = 8;          // the class granularity
+const size_t k_slab_max = 512;          // larger sizes go to malloc()
+const size_t k_slab_classes = k_slab_max / k_slab_align;
+
+void *slab_alloc(size_t size);
+// `size` is the one given to slab_alloc()
+void  slab_free(void *ptr, size_t size);
+
+struct SlabStats {
+    size_t size = 0;        // object size of the class
+    uint64_t pages = 0;
+    uint64_t used = 0;      // objects in use
+    uint64_t free = 0;      // objects free or not carved yet
+};
+
+// summed over the threads, k_slab_classes items
+void slab_stats(SlabStats *out);
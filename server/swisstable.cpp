@@ -0,0 +1,238 @@
+#include <assert.h>
+#include <stdlib.h>     // aligned_alloc(), free()
+#include <string.h>     // memset()
+#include "swisstable.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+// control bytes: a full slot holds the low 7 bits of the hash (the tag),
+// the free ones have the high bit set
+const uint8_t k_empty = 0x80;
+const uint8_t k_deleted = 0xFE;
+
+static size_t h1(uint64_t hcode) { return (size_t)(hcode >> 7); }
+static uint8_t h2(uint64_t hcode) { return hcode & 0x7F; }
+
+// bitmask of the group's slots whose control byte is `tag`
+static uint32_t group_match(const uint8_t *ctrl, uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < k_swiss_group; i++) {
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// bitmask of the group's empty or deleted slots
+static uint32_t group_match_free(const uint8_t *ctrl) {
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < k_swiss_group; i++) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// n must be a power of 2
+static void s_init(SwissTab *stab, size_t ngroups) {
+    assert(ngroups > 0 && ((ngroups - 1) & ngroups) == 0);
+    size_t n = ngroups * k_swiss_group;
+    stab->ctrl = (uint8_t *)aligned_alloc(k_swiss_group, n);
+    stab->slots = (HNode **)malloc(n * sizeof(HNode *));
+    assert(stab->ctrl && stab->slots);
+    memset(stab->ctrl, k_empty, n);
+    stab->mask = ngroups - 1;
+    stab->size = 0;
+    stab->used = 0;
+}
+
+static size_t s_capacity(SwissTab *stab) {
+    return stab->ctrl ? (stab->mask + 1) * k_swiss_group : 0;
+}
+
+// the probe sequence visits the groups at triangular offsets,
+// which covers all of them since the number of groups is a power of 2.
+// returns the slot index, or -1 if not found.
+static size_t s_lookup(SwissTab *stab, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    if (!stab->ctrl) {
+        return (size_t)-1;
+    }
+    uint8_t tag = h2(key->hcode);
+    size_t g = h1(key->hcode) & stab->mask;
+    for (size_t step = 1; ; step++) {
+        const uint8_t *ctrl = &stab->ctrl[g * k_swiss_group];
+        for (uint32_t m = group_match(ctrl, tag); m != 0; m &= m - 1) {
+            size_t pos = g * k_swiss_group + __builtin_ctz(m);
+            HNode *node = stab->slots[pos];
+            if (node->hcode == key->hcode && eq(node, key)) {
+                return pos;
+            }
+        }
+        if (group_match(ctrl, k_empty)) {
+            return (size_t)-1;  // an insert would have stopped here
+        }
+        g = (g + step) & stab->mask;
+    }
+}
+
+// take the first free slot in the probe sequence, there must be one
+static void s_insert(SwissTab *stab, HNode *node) {
+    size_t g = h1(node->hcode) & stab->mask;
+    for (size_t step = 1; ; step++) {
+        uint32_t m = group_match_free(&stab->ctrl[g * k_swiss_group]);
+        if (m != 0) {
+            size_t pos = g * k_swiss_group + __builtin_ctz(m);
+            if (stab->ctrl[pos] == k_empty) {
+                stab->used++;
+            }
+            stab->ctrl[pos] = h2(node->hcode);
+            stab->slots[pos] = node;
+            stab->size++;
+            return;
+        }
+        g = (g + step) & stab->mask;
+    }
+}
+
+static HNode *s_detach(SwissTab *stab, size_t pos) {
+    HNode *node = stab->slots[pos];
+    // a group that still has an empty slot has never been full, so no
+    // probe sequence continues past it and the slot can become empty.
+    // otherwise leave a deleted marker to keep the sequences intact.
+    const uint8_t *group = &stab->ctrl[pos & ~(k_swiss_group - 1)];
+    if (group_match(group, k_empty)) {
+        stab->ctrl[pos] = k_empty;
+        stab->used--;
+    } else {
+        stab->ctrl[pos] = k_deleted;
+    }
+    stab->size--;
+    return node;
+}
+
+static void s_free(SwissTab *stab) {
+    free(stab->ctrl);
+    free(stab->slots);
+    *stab = SwissTab{};
+}
+
+const size_t k_rehashing_work = 256;    // slots scanned per operation
+
+static void sm_help_rehashing(SwissMap *smap) {
+    SwissTab *older = &smap->older;
+    size_t nwork = 0;
+    while (nwork < k_rehashing_work && older->size > 0) {
+        size_t pos = smap->migrate_pos++;
+        assert(pos < s_capacity(older));
+        if (!(older->ctrl[pos] & 0x80)) {   // a full slot
+            s_insert(&smap->newer, s_detach(older, pos));
+        }
+        nwork++;
+    }
+    // discard the old table if done
+    if (older->size == 0 && older->ctrl) {
+        s_free(older);
+    }
+}
+
+// keep at least 1/8 of the slots empty so that the probe sequences end.
+// the keys left in the older table are counted since they move here.
+static bool sm_full(SwissMap *smap) {
+    size_t cap = s_capacity(&smap->newer);
+    return smap->newer.used + smap->older.size >= cap - cap / 8;
+}
+
+static void sm_trigger_rehashing(SwissMap *smap) {
+    // finish the previous one first; rare since the newer table is
+    // at least as large as the older one
+    while (smap->older.ctrl) {
+        sm_help_rehashing(smap);
+    }
+    // double it, or just drop the deleted markers if there are many
+    size_t ngroups = smap->newer.mask + 1;
+    if (smap->newer.size >= s_capacity(&smap->newer) / 2) {
+        ngroups *= 2;
+    }
+    // (newer, older) <- (new_table, newer)
+    smap->older = smap->newer;
+    s_init(&smap->newer, ngroups);
+    smap->migrate_pos = 0;
+}
+
+HNode *sm_lookup(SwissMap *smap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    sm_help_rehashing(smap);
+    size_t pos = s_lookup(&smap->newer, key, eq);
+    if (pos != (size_t)-1) {
+        return smap->newer.slots[pos];
+    }
+    pos = s_lookup(&smap->older, key, eq);
+    return pos != (size_t)-1 ? smap->older.slots[pos] : NULL;
+}
+
+void sm_insert(SwissMap *smap, HNode *node) {
+    if (!smap->newer.ctrl) {
+        s_init(&smap->newer, 1);    // initialize it if empty
+    }
+    s_insert(&smap->newer, node);   // always insert to the newer table
+    if (sm_full(smap)) {
+        sm_trigger_rehashing(smap);
+    }
+    sm_help_rehashing(smap);        // migrate some keys
+}
+
+HNode *sm_delete(SwissMap *smap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    sm_help_rehashing(smap);
+    size_t pos = s_lookup(&smap->newer, key, eq);
+    if (pos != (size_t)-1) {
+        return s_detach(&smap->newer, pos);
+    }
+    pos = s_lookup(&smap->older, key, eq);
+    if (pos != (size_t)-1) {
+        return s_detach(&smap->older, pos);
+    }
+    return NULL;
+}
+
+void sm_clear(SwissMap *smap) {
+    s_free(&smap->newer);
+    s_free(&smap->older);
+    *smap = SwissMap{};
+}
+
+size_t sm_size(SwissMap *smap) {
+    return smap->newer.size + smap->older.size;
+}
+
+void sm_reserve(SwissMap *smap, size_t n) {
+    if (smap->newer.ctrl || smap->older.ctrl) {
+        return;     // only for empty maps
+    }
+    size_t ngroups = 1;
+    while (ngroups * k_swiss_group / 8 * 7 <= n) {
+        ngroups *= 2;
+    }
+    s_init(&smap->newer, ngroups);
+}
+
+static bool s_foreach(SwissTab *stab, bool (*f)(HNode *, void *), void *arg) {
+    for (size_t i = 0; i < s_capacity(stab); i++) {
+        if (!(stab->ctrl[i] & 0x80) && !f(stab->slots[i], arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sm_foreach(SwissMap *smap, bool (*f)(HNode *, void *), void *arg) {
+    s_foreach(&smap->newer, f, arg) && s_foreach(&smap->older, f, arg);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"  // HNode
+
+
+// an open-addressing table in the style of the Swiss table.
+// the slots are split into groups of 16, each with 16 control bytes that
+// hold a 7-bit tag of the hash for a full slot, or an empty/deleted marker.
+// a lookup scans a group's control bytes with one SIMD compare, so a miss
+// usually touches a single cache line and never the nodes.
+const size_t k_swiss_group = 16;
+
+struct SwissTab {
+    uint8_t *ctrl = NULL;   // control bytes, 1 per slot
+    HNode **slots = NULL;   // the nodes
+    size_t mask = 0;        // number of groups - 1, power of 2
+    size_t size = 0;        // number of keys
+    size_t used = 0;        // keys + deleted markers
+};
+
+// the same interface as HMap, including the progressive rehashing:
+// a resize moves a bounded number of slots per operation.
+struct SwissMap {
+    SwissTab newer;
+    SwissTab older;
+    size_t migrate_pos = 0;
+};
+
+HNode *sm_lookup(SwissMap *smap, HNode *key, bool (*eq)(HNode *, HNode *));
+void   sm_insert(SwissMap *smap, HNode *node);
+HNode *sm_delete(SwissMap *smap, HNode *key, bool (*eq)(HNode *, HNode *));
+void   sm_clear(SwissMap *smap);
+size_t sm_size(SwissMap *smap);
+void   sm_reserve(SwissMap *smap, size_t n);
+void   sm_foreach(SwissMap *smap, bool (*f)(HNode *, void *), void *arg);
@@ -39,7 +39,300 @@ $ ./client zquery zset 1 "" 0 10
 (str) n2
 (dbl) 2
 (arr) end
+$ ./client ZSCORE zset n2
+(dbl) 2
+$ ./client zscore zset
+(err) 4 wrong number of arguments.
+$ ./client nosuchcmd zset
+(err) 1 unknown command.
+$ ./client mset k1 v1 k2 v2 k1 v3
+(nil)
+$ ./client mget k1 nokey k2 zset
+(arr) len=4
+(str) v3
+(nil)
+(str) v2
+(nil)
+(arr) end
+$ ./client mset k1 v1 zset v2
+(err) 3 a non-string value exists
+$ ./client mset k1 v1 k2
+(err) 4 wrong number of arguments.
+$ ./client mdel k1 k1 nokey k2
+(int) 2
+$ ./client mget k1 k2
+(arr) len=2
+(nil)
+(nil)
+(arr) end
+$ ./client set {longkey} v1
+(nil)
+$ ./client mdel {longkey} {longkey} nokey
+(int) 1
+$ ./client get {longkey}
+(nil)
+$ ./client config set rehash-work 64
+(int) 64
+$ ./client CONFIG GET rehash-work
+(int) 64
+$ ./client config set rehash-work 0
+(err) 4 bad value
+$ ./client config get nosuchparam
+(err) 4 unknown parameter
+$ ./client config get maxmemory-policy
+(str) noeviction
+$ ./client config set maxmemory-policy ALLKEYS-LFU
+(str) allkeys-lfu
+$ ./client config set maxmemory-policy lru
+(err) 4 bad value
+$ ./client config set maxmemory-samples 65
+(err) 4 bad value
+$ ./client config set maxmemory 1mb
+(int) 1048576
+$ ./client config set maxmemory 0
+(int) 0
+$ ./client config set maxmemory-policy noeviction
+(str) noeviction
+$ ./client config set zset-max-listpack-entries 2
+(int) 2
+$ ./client zadd zl 3 c
+(int) 1
+$ ./client zadd zl 1 a
+(int) 1
+$ ./client zquery zl 3 c -1 10
+(arr) len=4
+(str) a
+(dbl) 1
+(str) c
+(dbl) 3
+(arr) end
+$ ./client zadd zl 2 b
+(int) 1
+$ ./client zquery zl 3 c -1 4
+(arr) len=4
+(str) b
+(dbl) 2
+(str) c
+(dbl) 3
+(arr) end
+$ ./client zrem zl a
+(int) 1
+$ ./client config set zset-max-listpack-entries 128
+(int) 128
+$ ./client config set zset-max-listpack-value 256
+(err) 4 bad value
+$ ./client config get zset-index
+(str) btree
+$ ./client config set zset-index avl
+(str) avl
+$ ./client config set zset-index rbtree
+(err) 4 bad value
+$ ./client config set zset-index btree
+(str) btree
+$ ./client scan 0 match zs* count 100
+(arr) len=2
+(int) 0
+(arr) len=1
+(str) zset
+(arr) end
+(arr) end
+$ ./client zscan zset 0
+(arr) len=2
+(int) 0
+(arr) len=2
+(str) n2
+(dbl) 2
+(arr) end
+(arr) end
+$ ./client zscan zset 0 match x*
+(arr) len=2
+(int) 0
+(arr) len=0
+(arr) end
+(arr) end
+$ ./client zadd zr 1 a
+(int) 1
+$ ./client zadd zr 2 b
+(int) 1
+$ ./client zadd zr 2 c
+(int) 1
+$ ./client zadd zr 3 d
+(int) 1
+$ ./client zrank zr c
+(int) 2
+$ ./client zrevrank zr a
+(int) 3
+$ ./client zrank zr x
+(nil)
+$ ./client zrange zr 1 -2 withscores
+(arr) len=4
+(str) b
+(dbl) 2
+(str) c
+(dbl) 2
+(arr) end
+$ ./client zrevrange zr 0 1
+(arr) len=2
+(str) d
+(str) c
+(arr) end
+$ ./client zrangebyscore zr (1 +inf limit 1 2
+(arr) len=2
+(str) c
+(str) d
+(arr) end
+$ ./client zrevrangebyscore zr 2 -inf withscores
+(arr) len=6
+(str) c
+(dbl) 2
+(str) b
+(dbl) 2
+(str) a
+(dbl) 1
+(arr) end
+$ ./client zrangebyscore zr -inf +inf limit 9223372036854775807 1
+(arr) len=0
+(arr) end
+$ ./client zrevrangebyscore zr +inf -inf limit 9223372036854775807 1
+(arr) len=0
+(arr) end
+$ ./client zrevrangebyscore zr +inf -inf limit -9223372036854775808 1
+(arr) len=0
+(arr) end
+$ ./client zcount zr 2 3
+(int) 3
+$ ./client zcount zr x 3
+(err) 4 min or max is not a float
+$ ./client zrange zr 0 -1 limit 0 1
+(err) 4 syntax error
+$ ./client zremrangebyrank zr 0 0
+(int) 1
+$ ./client zremrangebyscore zr (2 +inf
+(int) 1
+$ ./client zrange zr 0 -1
+(arr) len=2
+(str) b
+(str) c
+(arr) end
+$ ./client zadd zv 1 a 2 b 1 a
+(int) 2
+$ ./client zadd zv CH 3 a 5 c
+(int) 2
+$ ./client zadd zv nx 9 a 9 d
+(int) 1
+$ ./client zadd zv xx gt ch 2 b 1 c
+(int) 0
+$ ./client zadd zv incr 10 a
+(dbl) 13
+$ ./client zadd zv nx incr 1 a
+(nil)
+$ ./client zadd zv nx xx 1 a
+(err) 4 NX is not compatible with XX, GT or LT
+$ ./client zadd zv incr 1 a 2 b
+(err) 4 INCR supports a single score-name pair
+$ ./client zadd zv nx 1
+(err) 4 syntax error
+$ ./client zadd zv 1 a x b
+(err) 4 expect float
+$ ./client zrange zv 0 -1 withscores
+(arr) len=8
+(str) b
+(dbl) 2
+(str) c
+(dbl) 5
+(str) d
+(dbl) 9
+(str) a
+(dbl) 13
+(arr) end
+$ ./client zadd nokey xx 1 a
+(int) 0
+$ ./client pttl nokey
+(int) -2
+$ ./client zadd zu1 1 a 2 b 3 c
+(int) 3
+$ ./client zadd zu2 10 b 20 c 30 d
+(int) 3
+$ ./client zunionstore zdst 2 zu1 zu2 weights 2 1
+(int) 4
+$ ./client zrange zdst 0 -1 withscores
+(arr) len=8
+(str) a
+(dbl) 2
+(str) b
+(dbl) 14
+(str) c
+(dbl) 26
+(str) d
+(dbl) 30
+(arr) end
+$ ./client zinterstore zdst 2 zu1 zu2 aggregate max
+(int) 2
+$ ./client zrange zdst 0 -1 withscores
+(arr) len=4
+(str) b
+(dbl) 10
+(str) c
+(dbl) 20
+(arr) end
+$ ./client zdiffstore zu1 2 zu1 zu2
+(int) 1
+$ ./client zrange zu1 0 -1 withscores
+(arr) len=2
+(str) a
+(dbl) 1
+(arr) end
+$ ./client zinterstore zdst 2 zu1 zu2
+(int) 0
+$ ./client pttl zdst
+(int) -2
+$ ./client zunionstore zdst 2 zu1
+(err) 4 bad numkeys
+$ ./client zunionstore zdst 1 zu1 aggregate avg
+(err) 4 syntax error
+$ ./client zdiffstore zdst 1 zu1 weights 1
+(err) 4 syntax error
+$ ./client zscan zset 0 count 9223372036854775807
+(arr) len=2
+(int) 0
+(arr) len=2
+(str) n2
+(dbl) 2
+(arr) end
+(arr) end
+$ ./client scan 0 count 0
+(err) 4 syntax error
+$ ./client scan x
+(err) 4 invalid cursor
+$ ./client incr cnt
+(int) 1
+$ ./client incrby cnt 41
+(int) 42
+$ ./client decrby cnt 50
+(int) -8
+$ ./client decr cnt
+(int) -9
+$ ./client get cnt
+(str) -9
+$ ./client set cnt 0012
+(nil)
+$ ./client incr cnt
+(err) 4 value is not an integer or out of range
+$ ./client set cnt 9223372036854775807
+(nil)
+$ ./client incr cnt
+(err) 4 increment or decrement would overflow
+$ ./client incr zset
+(err) 3 expect string
+$ ./client incrbyfloat flt 1.5
+(str) 1.5
+$ ./client incrbyfloat flt 0.5
+(str) 2
+$ ./client incr flt
+(int) 3
 '''
+# a key larger than the slab objects, freed to malloc when deleted
+CASES = CASES.replace('{longkey}', 'k' * 600)
 
 
 import shlex
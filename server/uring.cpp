@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(
+    int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+    void *arg, size_t argsz)
+{
+    return (int)syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int uring_init(URing *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) {
+        return -1;  // ENOSYS, EPERM (seccomp), ...
+    }
+    // one mmap() for both rings, and timeouts passed to io_uring_enter()
+    const unsigned k_required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+    if ((p.features & k_required) != k_required) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_len = sq_len > cq_len ? sq_len : cq_len;
+    void *ptr = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    size_t sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ptr, ring_len);
+        close(fd);
+        return -1;
+    }
+
+    char *base = (char *)ptr;
+    ring->fd = fd;
+    ring->sq_head = (unsigned *)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + p.sq_off.array);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    ring->sq_entries = p.sq_entries;
+    ring->to_submit = 0;
+    ring->cq_head = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    ring->ring_ptr = ptr;
+    ring->ring_len = ring_len;
+    ring->sqes_len = sqes_len;
+    return 0;
+}
+
+void uring_destroy(URing *ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->ring_ptr, ring->ring_len);
+    close(ring->fd);
+    *ring = URing{};
+}
+
+struct io_uring_sqe *uring_get_sqe(URing *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->to_submit;
+    if (tail - head >= ring->sq_entries) {
+        return NULL;    // full, the caller should submit first
+    }
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_submit_and_wait(URing *ring, unsigned wait_nr, int32_t timeout_ms) {
+    // publish the queued SQEs
+    unsigned submit = ring->to_submit;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000 * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+    int rv = sys_io_uring_enter(
+        ring->fd, submit, wait_nr, flags, &arg, sizeof(arg));
+    if (rv < 0 && errno == ETIME) {
+        return 0;   // timed out, not an error
+    }
+    return rv;
+}
+
+struct io_uring_cqe *uring_peek_cqe(URing *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+
+// a minimal io_uring wrapper on top of the raw syscalls (no liburing)
+struct URing {
+    int fd = -1;
+    // submission queue
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned *sq_mask = NULL;
+    unsigned *sq_array = NULL;
+    struct io_uring_sqe *sqes = NULL;
+    unsigned sq_entries = 0;
+    unsigned to_submit = 0;     // SQEs queued but not yet submitted
+    // completion queue
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned *cq_mask = NULL;
+    struct io_uring_cqe *cqes = NULL;
+    // mmap()ed regions
+    void *ring_ptr = NULL;
+    size_t ring_len = 0;
+    size_t sqes_len = 0;
+};
+
+// returns -1 if the kernel lacks io_uring or the needed features
+int  uring_init(URing *ring, unsigned entries);
+void uring_destroy(URing *ring);
+// returns NULL if the submission queue is full
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+// submit all queued SQEs and wait for at least `wait_nr` completions,
+// all in a single io_uring_enter(). `timeout_ms < 0` means no timeout.
+int  uring_submit_and_wait(URing *ring, unsigned wait_nr, int32_t timeout_ms);
+// completion queue consumption
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
@@ -1,25 +1,155 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
 // proj
 #include "zset.h"
 #include "common.h"
+#include "slab.h"
 
 
-static ZNode *znode_new(const char *name, size_t len, double score) {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
-    assert(node);   // not a good idea in real projects
-    avl_init(&node->tree);
-    node->hmap.next = NULL;
-    node->hmap.hcode = str_hash((uint8_t *)name, len);
-    node->score = score;
-    node->len = len;
-    memcpy(&node->name[0], name, len);
-    return node;
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;    // including this header
+};
+
+struct ArenaBig {
+    ArenaBig *prev;
+    ArenaBig *next;
+    size_t size;    // including this header
+};
+
+struct ArenaFree {
+    ArenaFree *next;
+};
+
+// each chunk adds about an eighth to the arena, so a small zset wastes
+// little and a large one needs few chunks.
+const size_t k_arena_max_chunk = 64 << 10;
+
+static void *arena_mem_new(size_t size) {
+    mem_track((int64_t)size);
+    return slab_alloc(size);
+}
+
+static void arena_mem_del(void *ptr, size_t size) {
+    mem_track(-(int64_t)size);
+    slab_free(ptr, size);   // maybe from the thread pool
+}
+
+static size_t arena_class(size_t size) {
+    return (size + k_arena_align - 1) / k_arena_align - 1;
+}
+
+static void arena_push_free(ZArena *arena, void *ptr, size_t cls) {
+    ArenaFree *obj = (ArenaFree *)ptr;
+    obj->next = (ArenaFree *)arena->free[cls];
+    arena->free[cls] = obj;
+}
+
+static void *arena_alloc_big(ZArena *arena, size_t size) {
+    size += sizeof(ArenaBig);
+    ArenaBig *big = (ArenaBig *)arena_mem_new(size);
+    big->size = size;
+    big->prev = NULL;
+    big->next = arena->bigs;
+    if (big->next) {
+        big->next->prev = big;
+    }
+    arena->bigs = big;
+    return big + 1;
+}
+
+static void arena_free_big(ZArena *arena, ArenaBig *big) {
+    if (big->prev) {
+        big->prev->next = big->next;
+    } else {
+        arena->bigs = big->next;
+    }
+    if (big->next) {
+        big->next->prev = big->prev;
+    }
+    arena_mem_del(big, big->size);
+}
+
+static void *arena_alloc(ZArena *arena, size_t size) {
+    if (size > k_arena_max) {
+        return arena_alloc_big(arena, size);
+    }
+    size_t cls = arena_class(size);
+    if (ArenaFree *obj = (ArenaFree *)arena->free[cls]) {
+        arena->free[cls] = obj->next;
+        return obj;
+    }
+    size_t csize = (cls + 1) * k_arena_align;
+    if ((size_t)(arena->end - arena->pos) < csize) {
+        // the rest of the chunk is a free object of a smaller class
+        if (arena->end != arena->pos) {
+            arena_push_free(arena, arena->pos, arena_class(arena->end - arena->pos));
+        }
+        // a whole number of objects of this class
+        size_t n = arena->total / 8;
+        n = n < k_arena_max_chunk ? n : k_arena_max_chunk;
+        n = (n > csize ? n / csize * csize : csize) + sizeof(ArenaChunk);
+        ArenaChunk *chunk = (ArenaChunk *)arena_mem_new(n);
+        chunk->size = n;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->total += n;
+        arena->pos = (char *)(chunk + 1);
+        arena->end = (char *)chunk + n;
+    }
+    void *ptr = arena->pos;
+    arena->pos += csize;
+    return ptr;
+}
+
+static void arena_free(ZArena *arena, void *ptr, size_t size) {
+    if (size > k_arena_max) {
+        return arena_free_big(arena, (ArenaBig *)ptr - 1);
+    }
+    arena_push_free(arena, ptr, arena_class(size));
+}
+
+static void arena_clear(ZArena *arena) {
+    while (ArenaChunk *chunk = arena->chunks) {
+        arena->chunks = chunk->next;
+        arena_mem_del(chunk, chunk->size);
+    }
+    while (arena->bigs) {
+        arena_free_big(arena, arena->bigs);
+    }
+    *arena = ZArena{};
+}
+
+// the limits of the small encoding
+static std::atomic<size_t> g_list_max_entries{128};
+static std::atomic<size_t> g_list_max_len{64};
+
+void zset_set_list_limits(size_t max_entries, size_t max_len) {
+    g_list_max_entries.store(max_entries, std::memory_order_relaxed);
+    g_list_max_len.store(max_len < 255 ? max_len : 255, std::memory_order_relaxed);
 }
 
-static void znode_del(ZNode *node) {
-    free(node);
+size_t zset_list_max_entries() {
+    return g_list_max_entries.load(std::memory_order_relaxed);
+}
+
+size_t zset_list_max_len() {
+    return g_list_max_len.load(std::memory_order_relaxed);
+}
+
+static std::atomic<uint8_t> g_index{ZSET_INDEX_DEFAULT};
+
+void zset_set_index(uint8_t index) {
+    g_index.store(index, std::memory_order_relaxed);
+}
+
+uint8_t zset_index() {
+    return g_index.load(std::memory_order_relaxed);
 }
 
 static size_t min(size_t lhs, size_t rhs) {
@@ -27,114 +157,173 @@ static size_t min(size_t lhs, size_t rhs) {
 }
 
 // compare by the (score, name) tuple
-static bool zless(
-    AVLNode *lhs, double score, const char *name, size_t len)
+static bool zless(double s1, const char *n1, size_t l1,
+                  double s2, const char *n2, size_t l2)
 {
-    ZNode *zl = container_of(lhs, ZNode, tree);
-    if (zl->score != score) {
-        return zl->score < score;
+    if (s1 != s2) {
+        return s1 < s2;
     }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
+    int rv = memcmp(n1, n2, min(l1, l2));
     if (rv != 0) {
         return rv < 0;
     }
-    return zl->len < len;
+    return l1 < l2;
+}
+
+// the AVLNode in front of the ZNode
+static AVLNode *znode_avl(ZNode *node) {
+    return (AVLNode *)node - 1;
+}
+
+static ZNode *avl_znode(AVLNode *node) {
+    return (ZNode *)(node + 1);
+}
+
+static bool zless(AVLNode *lhs, double score, const char *name, size_t len) {
+    ZNode *zl = avl_znode(lhs);
+    return zless(zl->score, zl->name, zl->len, score, name, len);
 }
 
 static bool zless(AVLNode *lhs, AVLNode *rhs) {
-    ZNode *zr = container_of(rhs, ZNode, tree);
+    ZNode *zr = avl_znode(rhs);
     return zless(lhs, zr->score, zr->name, zr->len);
 }
 
-// insert into the AVL tree
-static void tree_insert(ZSet *zset, ZNode *node) {
+static bool zless(const ZMember &lhs, const ZMember &rhs) {
+    return zless(lhs.score, lhs.name, lhs.len, rhs.score, rhs.name, rhs.len);
+}
+
+static ZMember znode_member(ZNode *node) {
+    return ZMember{node->score, node->name, node->len};
+}
+
+// the tree encoding
+
+static size_t znode_size(ZTree *tree, size_t len) {
+    size_t avl = tree->index == ZINDEX_AVL ? sizeof(AVLNode) : 0;
+    return avl + sizeof(ZNode) + len;
+}
+
+static ZNode *znode_new(ZTree *tree, const char *name, size_t len, double score) {
+    void *ptr = arena_alloc(&tree->arena, znode_size(tree, len));
+    ZNode *node = (ZNode *)ptr;
+    if (tree->index == ZINDEX_AVL) {
+        avl_init((AVLNode *)ptr);
+        node = avl_znode((AVLNode *)ptr);
+    }
+    node->hmap.next = NULL;
+    node->hmap.hcode = str_hash((uint8_t *)name, len);
+    node->score = score;
+    node->len = len;
+    memcpy(&node->name[0], name, len);
+    return node;
+}
+
+static void znode_del(ZTree *tree, ZNode *node) {
+    void *ptr = tree->index == ZINDEX_AVL ? (void *)znode_avl(node) : (void *)node;
+    arena_free(&tree->arena, ptr, znode_size(tree, node->len));
+}
+
+static ZTree *ztree_new() {
+    mem_track(sizeof(ZTree));
+    ZTree *tree = new (slab_alloc(sizeof(ZTree))) ZTree();
+    tree->index = zset_index();
+    return tree;
+}
+
+// the nodes go with the arena
+static void ztree_del(ZTree *tree) {
+    bt_clear(&tree->bt);
+    hm_clear(&tree->hmap);
+    arena_clear(&tree->arena);
+    tree->~ZTree();
+    mem_track(-(int64_t)sizeof(ZTree));
+    slab_free(tree, sizeof(ZTree));     // maybe from the thread pool
+}
+
+// insert into the order index
+static void tree_insert(ZTree *tree, ZNode *node) {
+    if (tree->index == ZINDEX_BTREE) {
+        return bt_insert(&tree->bt, node);
+    }
+    AVLNode *anode = znode_avl(node);
     AVLNode *parent = NULL;         // insert under this node
-    AVLNode **from = &zset->root;   // the incoming pointer to the next node
+    AVLNode **from = &tree->root;   // the incoming pointer to the next node
     while (*from) {                 // tree search
         parent = *from;
-        from = zless(&node->tree, parent) ? &parent->left : &parent->right;
+        from = zless(anode, parent) ? &parent->left : &parent->right;
+    }
+    *from = anode;                  // attach the new node
+    anode->parent = parent;
+    tree->root = avl_fix(anode);
+}
+
+// remove from the order index
+static void tree_detach(ZTree *tree, ZNode *node) {
+    if (tree->index == ZINDEX_BTREE) {
+        return bt_delete(&tree->bt, node);
     }
-    *from = &node->tree;            // attach the new node
-    node->tree.parent = parent;
-    zset->root = avl_fix(&node->tree);
+    tree->root = avl_del(znode_avl(node));
+    avl_init(znode_avl(node));
 }
 
 // update the score of an existing node
-static void zset_update(ZSet *zset, ZNode *node, double score) {
+static void tree_update(ZTree *tree, ZNode *node, double score) {
     if (node->score == score) {
         return;
     }
-    // detach the tree node
-    zset->root = avl_del(&node->tree);
-    avl_init(&node->tree);
-    // reinsert the tree node
+    tree_detach(tree, node);
     node->score = score;
-    tree_insert(zset, node);
-}
-
-// add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_insert(ZSet *zset, const char *name, size_t len, double score) {
-    ZNode *node = zset_lookup(zset, name, len);
-    if (node) {
-        zset_update(zset, node, score);
-        return false;
-    } else {
-        node = znode_new(name, len, score);
-        hm_insert(&zset->hmap, &node->hmap);
-        tree_insert(zset, node);
-        return true;
-    }
+    tree_insert(tree, node);
 }
 
-// a helper structure for the hashtable lookup
-struct HKey {
-    HNode node;
-    const char *name = NULL;
-    size_t len = 0;
-};
-
-static bool hcmp(HNode *node, HNode *key) {
+bool ZNodeEq::operator()(HNode *node, HNode *key) const {
     ZNode *znode = container_of(node, ZNode, hmap);
     HKey *hkey = container_of(key, HKey, node);
-    if (znode->len != hkey->len) {
-        return false;
-    }
-    return 0 == memcmp(znode->name, hkey->name, znode->len);
+    return key_eq(znode->name, znode->len, hkey->name, hkey->len);
 }
 
 // lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset->root) {
-        return NULL;
-    }
-
+static ZNode *tree_lookup(ZTree *tree, const char *name, size_t len) {
     HKey key;
     key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    HNode *found = hm_lookup(&tree->hmap, &key.node);
     return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
+// add a new (score, name) tuple, or update the score of the existing tuple
+static bool tree_add(ZTree *tree, const char *name, size_t len, double score) {
+    ZNode *node = tree_lookup(tree, name, len);
+    if (node) {
+        tree_update(tree, node, score);
+        return false;
+    }
+    node = znode_new(tree, name, len, score);
+    hm_insert(&tree->hmap, &node->hmap);
+    tree_insert(tree, node);
+    return true;
+}
+
 // delete a node
-void zset_delete(ZSet *zset, ZNode *node) {
+static void tree_delete(ZTree *tree, ZNode *node) {
     // remove from the hashtable
     HKey key;
     key.node.hcode = node->hmap.hcode;
     key.name = node->name;
     key.len = node->len;
-    HNode *found = hm_delete(&zset->hmap, &key.node, &hcmp);
+    HNode *found = hm_delete(&tree->hmap, &key.node);
     assert(found);
     // remove from the tree
-    zset->root = avl_del(&node->tree);
+    tree_detach(tree, node);
     // deallocate the node
-    znode_del(node);
+    znode_del(tree, node);
 }
 
-// find the first (score, name) tuple that is >= key.
-ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len) {
+static ZNode *tree_seekge(ZTree *tree, double score, const char *name, size_t len) {
     AVLNode *found = NULL;
-    for (AVLNode *node = zset->root; node; ) {
+    for (AVLNode *node = tree->root; node; ) {
         if (zless(node, score, name, len)) {
             node = node->right; // node < key
         } else {
@@ -142,33 +331,22 @@ ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len) {
             node = node->left;
         }
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
+    return found ? avl_znode(found) : NULL;
 }
 
-// offset into the succeeding or preceding node.
-ZNode *znode_offset(ZNode *node, int64_t offset) {
-    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
-    return tnode ? container_of(tnode, ZNode, tree) : NULL;
-}
-
-static void tree_dispose(AVLNode *node) {
-    if (!node) {
-        return;
+// the node at the rank, which is in range
+static ZNode *tree_select(ZTree *tree, uint64_t rank, BIter *bit) {
+    if (tree->index == ZINDEX_BTREE) {
+        bt_select(&tree->bt, rank, bit);
+        return bt_get(bit);
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
-}
-
-// destroy the zset
-void zset_clear(ZSet *zset) {
-    hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
-    zset->root = NULL;
+    // the rank of the root is the size of its left subtree
+    AVLNode *root = tree->root;
+    return avl_znode(avl_offset(root, (int64_t)rank - avl_cnt(root->left)));
 }
 
 // traverse the AVL tree in-order and apply the function to each node
-static bool tree_foreach(AVLNode *node, bool (*f)(ZNode *, void *), void *arg) {
+static bool tree_foreach(AVLNode *node, bool (*f)(const ZMember *, void *), void *arg) {
     if (!node) {
         return true;
     }
@@ -179,8 +357,8 @@ static bool tree_foreach(AVLNode *node, bool (*f)(ZNode *, void *), void *arg) {
     }
     
     // Process current node
-    ZNode *znode = container_of(node, ZNode, tree);
-    if (!f(znode, arg)) {
+    ZMember m = znode_member(avl_znode(node));
+    if (!f(&m, arg)) {
         return false;
     }
     
@@ -188,7 +366,495 @@ static bool tree_foreach(AVLNode *node, bool (*f)(ZNode *, void *), void *arg) {
     return tree_foreach(node->right, f, arg);
 }
 
-// apply the function to each node in the zset, in order of (score, name)
-void zset_foreach(ZSet *zset, bool (*f)(ZNode *, void *), void *arg) {
-    tree_foreach(zset->root, f, arg);
-}
\ No newline at end of file
+// build a balanced tree from sorted nodes
+static AVLNode *tree_build(ZNode **nodes, size_t n, AVLNode *parent) {
+    if (n == 0) {
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *node = znode_avl(nodes[mid]);
+    node->parent = parent;
+    node->left = tree_build(nodes, mid, node);
+    node->right = tree_build(nodes + mid + 1, n - mid - 1, node);
+    uint32_t hl = avl_height(node->left), hr = avl_height(node->right);
+    node->height = 1 + (hl > hr ? hl : hr);
+    node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+    return node;
+}
+
+// a tree from sorted members, NULL if a name is repeated
+static ZTree *tree_load(const ZMember *members, size_t n) {
+    ZTree *tree = ztree_new();
+    std::vector<ZNode *> nodes(n);
+    hm_reserve(&tree->hmap, n);
+    for (size_t i = 0; i < n; i++) {
+        nodes[i] = znode_new(tree, members[i].name, members[i].len, members[i].score);
+        HKey key;
+        key.node.hcode = nodes[i]->hmap.hcode;
+        key.name = members[i].name;
+        key.len = members[i].len;
+        if (hm_lookup(&tree->hmap, &key.node)) {
+            ztree_del(tree);
+            return NULL;
+        }
+        hm_insert(&tree->hmap, &nodes[i]->hmap);
+    }
+    if (tree->index == ZINDEX_BTREE) {
+        bt_build(&tree->bt, nodes.data(), n);
+    } else {
+        tree->root = tree_build(nodes.data(), n, NULL);
+    }
+    return tree;
+}
+
+// the list encoding
+
+const size_t k_zl_header = sizeof(double) + 1;  // score and length
+
+static size_t zl_rec_size(size_t len) {
+    return k_zl_header + len;
+}
+
+static ZMember zl_read(ZList *list, size_t pos) {
+    ZMember m;
+    memcpy(&m.score, &list->data[pos], sizeof(double));
+    m.len = list->data[pos + sizeof(double)];
+    m.name = (const char *)&list->data[pos + k_zl_header];
+    return m;
+}
+
+// a list changes its size on each update, so it's from malloc() rather
+// than the slab, whose size classes keep their pages.
+static ZList *zl_realloc(ZList *list, size_t cap) {
+    size_t old = list ? sizeof(ZList) + list->cap : 0;
+    cap = (cap + 7) & ~(size_t)7;
+    list = (ZList *)realloc(list, sizeof(ZList) + cap);
+    assert(list);
+    if (!old) {
+        list->size = 0;
+        list->bytes = 0;
+    }
+    list->cap = (uint32_t)cap;
+    mem_track((int64_t)(sizeof(ZList) + cap) - (int64_t)old);
+    return list;
+}
+
+static void zl_free(ZList *list) {
+    mem_track(-(int64_t)(sizeof(ZList) + list->cap));
+    free(list);
+}
+
+// make room for `need` bytes of records, with some slack for growth
+static ZList *zl_resize(ZList *list, size_t need) {
+    return zl_realloc(list, need + need / 8);
+}
+
+// the position of a name, or false; a linear scan of the small array
+static bool zl_find(ZList *list, const char *name, size_t len, size_t *out) {
+    for (size_t pos = 0; list && pos < list->bytes; ) {
+        ZMember m = zl_read(list, pos);
+        if (key_eq(m.name, m.len, name, len)) {
+            *out = pos;
+            return true;
+        }
+        pos += zl_rec_size(m.len);
+    }
+    return false;
+}
+
+// the first record >= the key, and its rank
+static size_t zl_seekge(ZList *list, const ZMember &key, uint32_t *idx) {
+    size_t pos = 0;
+    *idx = 0;
+    while (list && pos < list->bytes) {
+        ZMember m = zl_read(list, pos);
+        if (!zless(m, key)) {
+            break;
+        }
+        pos += zl_rec_size(m.len);
+        (*idx)++;
+    }
+    return pos;
+}
+
+static void zl_insert(ZSet *zset, const char *name, size_t len, double score) {
+    ZList *list = zset->list;
+    size_t rec = zl_rec_size(len);
+    size_t bytes = list ? list->bytes : 0;
+    if (!list || bytes + rec > list->cap) {
+        list = zset->list = zl_resize(list, bytes + rec);
+    }
+    uint32_t idx = 0;
+    size_t pos = zl_seekge(list, ZMember{score, name, len}, &idx);
+    memmove(&list->data[pos + rec], &list->data[pos], bytes - pos);
+    memcpy(&list->data[pos], &score, sizeof(double));
+    list->data[pos + sizeof(double)] = (uint8_t)len;
+    memcpy(&list->data[pos + k_zl_header], name, len);
+    list->bytes += (uint32_t)rec;
+    list->size++;
+}
+
+// skip `n` records from the position
+static size_t zl_skip(ZList *list, size_t pos, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        pos += zl_rec_size(zl_read(list, pos).len);
+    }
+    return pos;
+}
+
+// delete `n` records from the position in 1 move
+static void zl_delete_range(ZSet *zset, size_t pos, size_t n) {
+    ZList *list = zset->list;
+    size_t rec = zl_skip(list, pos, n) - pos;
+    memmove(&list->data[pos], &list->data[pos + rec], list->bytes - pos - rec);
+    list->bytes -= (uint32_t)rec;
+    list->size -= (uint32_t)n;
+    if (list->size == 0) {
+        zl_free(list);
+        zset->list = NULL;
+    } else if (list->cap > 64 && list->bytes < list->cap / 2) {
+        zset->list = zl_resize(list, list->bytes);  // shrink
+    }
+}
+
+static void zl_delete(ZSet *zset, size_t pos) {
+    zl_delete_range(zset, pos, 1);
+}
+
+static bool zl_fits(size_t size, size_t len) {
+    return size <= zset_list_max_entries() && len <= zset_list_max_len();
+}
+
+// the list to the tree, once it's too large
+static void zset_convert(ZSet *zset) {
+    ZList *list = zset->list;
+    std::vector<ZMember> members;
+    for (size_t pos = 0; list && pos < list->bytes; ) {
+        members.push_back(zl_read(list, pos));
+        pos += zl_rec_size(members.back().len);
+    }
+    zset->tree = tree_load(members.data(), members.size());
+    assert(zset->tree);
+    if (list) {
+        zl_free(list);
+        zset->list = NULL;
+    }
+}
+
+// the interface
+
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_insert(ZSet *zset, const char *name, size_t len, double score) {
+    if (zset->tree) {
+        return tree_add(zset->tree, name, len, score);
+    }
+    size_t pos = 0;
+    if (zl_find(zset->list, name, len, &pos)) {
+        if (zl_read(zset->list, pos).score != score) {
+            zl_delete(zset, pos);   // reinsert in order
+            zl_insert(zset, name, len, score);
+        }
+        return false;
+    }
+    size_t size = zset->list ? zset->list->size : 0;
+    if (!zl_fits(size + 1, len)) {
+        zset_convert(zset);
+        return tree_add(zset->tree, name, len, score);
+    }
+    zl_insert(zset, name, len, score);
+    return true;
+}
+
+bool zset_lookup(ZSet *zset, const char *name, size_t len, double *score) {
+    if (zset->tree) {
+        ZNode *node = tree_lookup(zset->tree, name, len);
+        if (node) {
+            *score = node->score;
+        }
+        return node != NULL;
+    }
+    size_t pos = 0;
+    if (!zl_find(zset->list, name, len, &pos)) {
+        return false;
+    }
+    *score = zl_read(zset->list, pos).score;
+    return true;
+}
+
+bool zset_peek(ZSet *zset, const char *name, size_t len, double *score) {
+    if (zset->tree) {
+        HKey key;
+        key.node.hcode = str_hash((uint8_t *)name, len);
+        key.name = name;
+        key.len = len;
+        HNode *found = hm_peek(&zset->tree->hmap, &key.node);
+        if (found) {
+            *score = container_of(found, ZNode, hmap)->score;
+        }
+        return found != NULL;
+    }
+    size_t pos = 0;
+    if (!zl_find(zset->list, name, len, &pos)) {
+        return false;
+    }
+    *score = zl_read(zset->list, pos).score;
+    return true;
+}
+
+bool zset_remove(ZSet *zset, const char *name, size_t len) {
+    if (zset->tree) {
+        ZNode *node = tree_lookup(zset->tree, name, len);
+        if (node) {
+            tree_delete(zset->tree, node);
+        }
+        return node != NULL;
+    }
+    size_t pos = 0;
+    if (!zl_find(zset->list, name, len, &pos)) {
+        return false;
+    }
+    zl_delete(zset, pos);
+    return true;
+}
+
+size_t zset_size(ZSet *zset) {
+    if (zset->tree) {
+        return hm_size(&zset->tree->hmap);
+    }
+    return zset->list ? zset->list->size : 0;
+}
+
+// destroy the zset
+void zset_clear(ZSet *zset) {
+    if (zset->tree) {
+        ztree_del(zset->tree);
+    }
+    if (zset->list) {
+        zl_free(zset->list);
+    }
+    *zset = ZSet{};
+}
+
+void zset_seekge(ZSet *zset, double score, const char *name, size_t len, ZIter *it) {
+    *it = ZIter{};
+    it->zset = zset;
+    if (zset->tree && zset->tree->index == ZINDEX_BTREE) {
+        bt_seekge(&zset->tree->bt, score, name, len, &it->bit);
+        it->valid = it->bit.leaf != NULL;
+        return;
+    }
+    if (zset->tree) {
+        it->node = tree_seekge(zset->tree, score, name, len);
+        it->valid = it->node != NULL;
+        return;
+    }
+    it->pos = (uint32_t)zl_seekge(zset->list, ZMember{score, name, len}, &it->idx);
+    it->valid = zset->list && it->pos < zset->list->bytes;
+}
+
+// offset into the succeeding or preceding member
+void ziter_offset(ZIter *it, int64_t offset) {
+    if (!it->valid) {
+        return;
+    }
+    ZTree *tree = it->zset->tree;
+    if (tree && tree->index == ZINDEX_BTREE) {
+        bt_offset(&tree->bt, &it->bit, offset);
+        it->valid = it->bit.leaf != NULL;
+        return;
+    }
+    if (tree) {
+        AVLNode *tnode = avl_offset(znode_avl(it->node), offset);
+        it->node = tnode ? avl_znode(tnode) : NULL;
+        it->valid = it->node != NULL;
+        return;
+    }
+    ZList *list = it->zset->list;
+    int64_t idx = (int64_t)it->idx + offset;
+    if (idx < 0 || idx >= (int64_t)list->size) {
+        it->valid = false;
+        return;
+    }
+    if (offset < 0) {   // no links backwards, scan from the start
+        it->idx = 0;
+        it->pos = 0;
+    }
+    while (it->idx < idx) {
+        it->pos += (uint32_t)zl_rec_size(zl_read(list, it->pos).len);
+        it->idx++;
+    }
+}
+
+int64_t ziter_rank(ZIter *it) {
+    assert(it->valid);
+    ZTree *tree = it->zset->tree;
+    if (tree && tree->index == ZINDEX_BTREE) {
+        return (int64_t)bt_rank(&tree->bt, &it->bit);
+    }
+    if (tree) {
+        return avl_rank(znode_avl(it->node));
+    }
+    return it->idx;
+}
+
+void zset_seek_rank(ZSet *zset, int64_t rank, ZIter *it) {
+    *it = ZIter{};
+    it->zset = zset;
+    if (rank < 0 || rank >= (int64_t)zset_size(zset)) {
+        return;
+    }
+    it->valid = true;
+    if (zset->tree) {
+        it->node = tree_select(zset->tree, (uint64_t)rank, &it->bit);
+        return;
+    }
+    it->idx = (uint32_t)rank;
+    it->pos = (uint32_t)zl_skip(zset->list, 0, (size_t)rank);
+}
+
+size_t zset_remove_range(ZSet *zset, int64_t rank, size_t n) {
+    size_t size = zset_size(zset);
+    if (rank < 0 || (size_t)rank >= size) {
+        return 0;
+    }
+    n = min(n, size - (size_t)rank);
+    if (n == 0) {
+        return 0;
+    }
+    if (zset->tree) {
+        // the following member takes the rank of the deleted one
+        for (size_t i = 0; i < n; i++) {
+            BIter bit;
+            tree_delete(zset->tree, tree_select(zset->tree, (uint64_t)rank, &bit));
+        }
+        return n;
+    }
+    zl_delete_range(zset, zl_skip(zset->list, 0, (size_t)rank), n);
+    return n;
+}
+
+ZMember ziter_get(ZIter *it) {
+    assert(it->valid);
+    if (it->zset->tree) {
+        bool bt = it->zset->tree->index == ZINDEX_BTREE;
+        return znode_member(bt ? bt_get(&it->bit) : it->node);
+    }
+    return zl_read(it->zset->list, it->pos);
+}
+
+struct ZForeachCtx {
+    bool (*f)(const ZMember *, void *);
+    void *arg;
+};
+
+static bool cb_foreach_node(ZNode *node, void *arg) {
+    ZForeachCtx *ctx = (ZForeachCtx *)arg;
+    ZMember m = znode_member(node);
+    return ctx->f(&m, ctx->arg);
+}
+
+// apply the function to each member in the zset, in order of (score, name)
+void zset_foreach(ZSet *zset, bool (*f)(const ZMember *, void *), void *arg) {
+    if (zset->tree && zset->tree->index == ZINDEX_BTREE) {
+        ZForeachCtx ctx = {f, arg};
+        bt_foreach(&zset->tree->bt, &cb_foreach_node, &ctx);
+        return;
+    }
+    if (zset->tree) {
+        tree_foreach(zset->tree->root, f, arg);
+        return;
+    }
+    for (size_t pos = 0; zset->list && pos < zset->list->bytes; ) {
+        ZMember m = zl_read(zset->list, pos);
+        if (!f(&m, arg)) {
+            return;
+        }
+        pos += zl_rec_size(m.len);
+    }
+}
+
+struct ZScanCtx {
+    void (*f)(const ZMember *, void *);
+    void *arg;
+};
+
+static void cb_scan_node(HNode *node, void *arg) {
+    ZScanCtx *ctx = (ZScanCtx *)arg;
+    ZMember m = znode_member(container_of(node, ZNode, hmap));
+    ctx->f(&m, ctx->arg);
+}
+
+uint64_t zset_scan(ZSet *zset, uint64_t cursor, void (*f)(const ZMember *, void *), void *arg) {
+    if (zset->tree) {
+        ZScanCtx ctx = {f, arg};
+        return hm_scan(&zset->tree->hmap, cursor, &cb_scan_node, &ctx);
+    }
+    ZScanCtx ctx = {f, arg};
+    zset_foreach(zset, [](const ZMember *m, void *arg) {
+        ZScanCtx *ctx = (ZScanCtx *)arg;
+        ctx->f(m, ctx->arg);
+        return true;
+    }, &ctx);
+    return 0;
+}
+
+// move the members into an empty zset
+// the sorted order only rules out equal neighbours; a name may still be
+// repeated with other scores. the list is small, compare the names sorted.
+static bool zl_names_unique(const ZMember *members, size_t n) {
+    std::vector<ZMember> names(members, members + n);
+    auto name_less = [](const ZMember &a, const ZMember &b) {
+        return zless(0, a.name, a.len, 0, b.name, b.len);
+    };
+    std::sort(names.begin(), names.end(), name_less);
+    for (size_t i = 1; i < n; i++) {
+        if (!name_less(names[i - 1], names[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// one by one, for the members that are not from a snapshot
+static void zset_load_slow(ZSet *zset, const ZMember *members, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        zset_insert(zset, members[i].name, members[i].len, members[i].score);
+    }
+}
+
+void zset_load(ZSet *zset, const ZMember *members, size_t n) {
+    assert(!zset->tree && !zset->list);
+    bool sorted = true;
+    size_t bytes = 0, max_len = 0;
+    for (size_t i = 0; i < n; i++) {
+        sorted = sorted && (i == 0 || zless(members[i - 1], members[i]));
+        bytes += zl_rec_size(members[i].len);
+        max_len = members[i].len > max_len ? members[i].len : max_len;
+    }
+    if (!sorted) {
+        return zset_load_slow(zset, members, n);
+    }
+    if (n == 0) {
+        return;
+    }
+    if (!zl_fits(n, max_len)) {
+        zset->tree = tree_load(members, n);
+        if (!zset->tree) {  // repeated names
+            zset_load_slow(zset, members, n);
+        }
+        return;
+    }
+    if (!zl_names_unique(members, n)) {
+        return zset_load_slow(zset, members, n);
+    }
+    // the records are laid out in the same order
+    ZList *list = zset->list = zl_realloc(NULL, bytes);
+    for (size_t i = 0; i < n; i++) {
+        uint8_t *p = &list->data[list->bytes];
+        memcpy(p, &members[i].score, sizeof(double));
+        p[sizeof(double)] = (uint8_t)members[i].len;
+        memcpy(p + k_zl_header, members[i].name, members[i].len);
+        list->bytes += (uint32_t)zl_rec_size(members[i].len);
+    }
+    list->size = (uint32_t)n;
+}
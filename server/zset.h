@@ -1,26 +1,131 @@
 #pragma once
 
 #include "avl.h"
+#include "btree.h"
 #include "hashtable.h"
 
 
-struct ZSet {
-    AVLNode *root = NULL;   // index by (score, name)
-    HMap hmap;              // index by name
+// a helper structure for the hashtable lookup
+struct HKey {
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// compares a ZNode with a HKey
+struct ZNodeEq {
+    bool operator()(HNode *node, HNode *key) const;
 };
 
+// the members of a zset are carved from chunks owned by the zset. a freed
+// member is reused by a later one of the same size class, and clearing
+// the zset frees the chunks rather than each member.
+const size_t k_arena_align = 16;
+const size_t k_arena_max = 192;     // a larger member is allocated alone
+
+struct ArenaChunk;
+struct ArenaBig;
+
+struct ZArena {
+    ArenaChunk *chunks = NULL;
+    ArenaBig *bigs = NULL;          // doubly linked, for deleting one
+    char *pos = NULL;               // the uncarved part of the newest chunk
+    char *end = NULL;
+    size_t total = 0;               // bytes of the chunks
+    void *free[k_arena_max / k_arena_align] = {};   // by size class
+};
+
+// the order index of the large encoding
+enum {
+    ZINDEX_AVL = 0,     // a node per member, linked into the member
+    ZINDEX_BTREE = 1,   // wide nodes of pointers to the members
+};
+
+#ifndef ZSET_INDEX_DEFAULT
+#define ZSET_INDEX_DEFAULT ZINDEX_BTREE
+#endif
+
+// the large encoding: an ordered index and a hashtable over the same nodes
+struct ZTree {
+    uint8_t index = ZINDEX_AVL;
+    AVLNode *root = NULL;   // index by (score, name), one of them
+    BTree bt;
+    HMapT<ZNodeEq> hmap;    // index by name
+    ZArena arena;           // the nodes
+};
+
+// with the AVL index, an AVLNode is allocated in front of each ZNode
 struct ZNode {
-    AVLNode tree;
     HNode   hmap;
     double  score = 0;
     size_t  len = 0;
     char    name[0];        // flexible array
 };
 
+// the small encoding: the members in 1 array, sorted by (score, name).
+// a record is | f64 score | u8 len | name |, unaligned.
+struct ZList {
+    uint32_t size;          // number of members
+    uint32_t bytes;         // the used part of the data
+    uint32_t cap;           // the allocated part of the data
+    uint8_t data[0];
+};
+
+// a zset starts small and converts to the tree once it grows past the
+// limits; it doesn't go back. both are NULL for an empty zset.
+struct ZSet {
+    ZList *list = NULL;
+    ZTree *tree = NULL;
+};
+
+// a member of either encoding; the name belongs to the zset
+struct ZMember {
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// a position in the order of (score, name)
+struct ZIter {
+    ZSet *zset = NULL;
+    ZNode *node = NULL;     // the AVL tree,
+    BIter bit;              // or the B+tree
+    uint32_t idx = 0;       // the list: the rank,
+    uint32_t pos = 0;       // and the offset of the record
+    bool valid = false;
+};
+
 bool   zset_insert(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-void   zset_delete(ZSet *zset, ZNode *node);
-ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
+bool   zset_lookup(ZSet *zset, const char *name, size_t len, double *score);
+// zset_lookup() without changing anything, for the readers of other
+// threads while the owner doesn't write. the iterators are read-only too.
+bool   zset_peek(ZSet *zset, const char *name, size_t len, double *score);
+bool   zset_remove(ZSet *zset, const char *name, size_t len);
+size_t zset_size(ZSet *zset);
 void   zset_clear(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
-void zset_foreach(ZSet *zset, bool (*f)(ZNode *, void *), void *arg);
\ No newline at end of file
+// find the first (score, name) tuple that is >= key.
+void    zset_seekge(ZSet *zset, double score, const char *name, size_t len, ZIter *it);
+// move to the succeeding or preceding member, invalid if out of range
+void    ziter_offset(ZIter *it, int64_t offset);
+ZMember ziter_get(ZIter *it);
+// the number of members before it; O(log n) for the tree
+int64_t ziter_rank(ZIter *it);
+// the member at the rank, invalid if out of range
+void    zset_seek_rank(ZSet *zset, int64_t rank, ZIter *it);
+// remove up to `n` members from the rank, returns the number removed
+size_t  zset_remove_range(ZSet *zset, int64_t rank, size_t n);
+// in order of (score, name)
+void zset_foreach(ZSet *zset, bool (*f)(const ZMember *, void *), void *arg);
+// the members of a cursor, see hm_scan(); a small zset is done in 1 call
+uint64_t zset_scan(ZSet *zset, uint64_t cursor, void (*f)(const ZMember *, void *), void *arg);
+// bulk loading into an empty zset. the members must be sorted by
+// (score, name) and unique to get the O(n) build, otherwise they are
+// inserted one by one; a repeated name keeps its last score.
+void zset_load(ZSet *zset, const ZMember *members, size_t n);
+// the limits of the small encoding, shared by all zsets
+void   zset_set_list_limits(size_t max_entries, size_t max_len);
+size_t zset_list_max_entries();
+size_t zset_list_max_len();
+// the index of the zsets converted to the tree from now on
+void    zset_set_index(uint8_t index);
+uint8_t zset_index();